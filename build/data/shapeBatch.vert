@@ -0,0 +1,51 @@
+#version 150
+
+uniform mat4 view;
+
+// Quads are stored before triangles, a quad keeps its centre in in_vert0
+// and its rotation in in_vert1.x
+uniform int firstTriangle;
+
+in vec2 in_vert0;
+in vec2 in_vert1;
+in vec2 in_vert2;
+in vec4 in_color;
+
+out vec4 g_vert0;
+out vec4 g_vert1;
+out vec4 g_vert2;
+out vec4 g_vert3;
+out vec4 g_color;
+flat out int g_isQuad;
+
+vec4 QuadCorner(vec2 corner, mat2 m)
+{
+	return view * vec4((corner * m) + in_vert0, 0, 1);
+}
+
+void main()
+{
+	g_color = in_color;
+
+	if (gl_VertexID < firstTriangle)
+	{
+		float angle = in_vert1.x;
+		mat2 m = mat2(sin(angle), -cos(angle),
+					cos(angle), sin(angle));
+
+		// Corners in triangle strip order
+		g_vert0 = QuadCorner(vec2(-0.5, -0.5), m);
+		g_vert1 = QuadCorner(vec2(0.5, -0.5), m);
+		g_vert2 = QuadCorner(vec2(-0.5, 0.5), m);
+		g_vert3 = QuadCorner(vec2(0.5, 0.5), m);
+		g_isQuad = 1;
+	}
+	else
+	{
+		g_vert0 = view * vec4(in_vert0.xy, 0, 1);
+		g_vert1 = view * vec4(in_vert1.xy, 0, 1);
+		g_vert2 = view * vec4(in_vert2.xy, 0, 1);
+		g_vert3 = g_vert2;
+		g_isQuad = 0;
+	}
+}
\ No newline at end of file
@@ -26,7 +26,7 @@ bool AABB::Intersects(const AABB& aabb, double& penetrationDistance, Vector2d& c
 {
 	Vector2d dist = Midpoint() - aabb.Midpoint();
 
-	if (dist.length() == 0)
+	if (dist.lengthSquared() == 0)
 		return false;
 	
 	Vector2d minSize((Size().x() + aabb.Size().x()) / 2, (Size().y() + aabb.Size().y()) / 2);
@@ -59,7 +59,7 @@ bool AABB::Intersects(const Vector2d& point, double& penetrationDistance, Vector
 {
 	Vector2d dist = Midpoint() - point;
 
-	if (dist.length() == 0)
+	if (dist.lengthSquared() == 0)
 		return false;
 	
 	Vector2d minSize(Size().x() / 2, Size().y() / 2);
@@ -2,6 +2,7 @@
 
 #include "Application.h"
 #include "MyWindow.h"
+#include "Util.h"
 #include <iostream>
 #include <sstream>
 
@@ -13,7 +14,8 @@ Application::Application() :
 	_ticksPerSec(0),
 	_framesPerSec(0),
 	_viewZoom(32),
-	_viewTranslation(0, 30)
+	_viewTranslation(0, 30),
+	_numBlobbies(0)
 {
 	for (int i = 0; i < NUM_CAMERA_ACTIONS; ++i)
 	{
@@ -30,13 +32,17 @@ void Application::Create(MyWindow& window)
 	
 	const int BOX_GRID_W = 80;
 	const int BOX_GRID_H = 10;
+	const int NUM_ROWS = 14;
+
+	_world.ReserveObjects(BOX_GRID_W * BOX_GRID_H, NUM_ROWS * (NUM_ROWS + 1),
+		_numBlobbies * _world.GetBlobbyParts(), _numBlobbies);
 
 	for (int x = 0; x < BOX_GRID_W; x++)
 	{
 		for (int y = 0; y < BOX_GRID_H; y++)
 		{
 			Physics::BoxObject* b= _world.AddBox();
-			b->SetPosition(Vector2d((x*1.2)-BOX_GRID_W*0.6, y*1.1+1));
+			b->SetPosition(Vector2r(Vector2d((x*1.2)-BOX_GRID_W*0.6, y*1.1+1)));
 			
 			int m = rand() % 3;
 			if (m == 0) b->SetMass(1);
@@ -45,14 +51,13 @@ void Application::Create(MyWindow& window)
 		}
 	}
 
-	const int NUM_ROWS = 14;
 	const double PYRAMID_OFFSET = 15;
 	for (int row = 0; row < NUM_ROWS; ++row)
 	{
 		for (int x = 0; x < (NUM_ROWS - row); ++x)
 		{
 			Physics::TriangleObject* t = _world.AddTriangle();
-			t->SetPosition(Vector2d(-PYRAMID_OFFSET + (x*1.2)-(NUM_ROWS - row)*0.6, (BOX_GRID_H+row)*1.1+1));
+			t->SetPosition(Vector2r(Vector2d(-PYRAMID_OFFSET + (x*1.2)-(NUM_ROWS - row)*0.6, (BOX_GRID_H+row)*1.1+1)));
 
 			int m = rand() % 3;
 			if (m == 0) t->SetMass(1);
@@ -60,7 +65,7 @@ void Application::Create(MyWindow& window)
 			if (m == 2) t->SetMass(5);
 
 			t = _world.AddTriangle();
-			t->SetPosition(Vector2d(PYRAMID_OFFSET + (x*1.2)-(NUM_ROWS - row)*0.6, (BOX_GRID_H+row)*1.1+1));
+			t->SetPosition(Vector2r(Vector2d(PYRAMID_OFFSET + (x*1.2)-(NUM_ROWS - row)*0.6, (BOX_GRID_H+row)*1.1+1)));
 		
 			m = rand() % 3;
 			if (m == 0) t->SetMass(1);
@@ -69,6 +74,13 @@ void Application::Create(MyWindow& window)
 		}
 	}
 
+	for (int i = 0; i < _numBlobbies; ++i)
+	{
+		_world.AddBlobbyObject();
+	}
+
+	_world.ResetBlobbies();
+
 	_worldThread.SetWorld(&_world);
 	_worldThread.BeginThreads();
 
@@ -130,7 +142,7 @@ void Application::DrawHud()
 	Print(ss.str(), 0, 13*2);
 
 	ss = std::stringstream();
-	ss << "Objects: " << _world.GetNumObjects();
+	ss << "Objects: " << _world.GetNumObjects() << "   Precision: " << PHYSICS_PRECISION_NAME;
 
 	Print(ss.str(), 0, 13*3);
 
@@ -288,6 +300,9 @@ void Application::UpdateViewMatrix()
 					-_viewZoom + _viewTranslation.y());
 
 	_renderer.ViewMatrix(_view);
+
+	Vector2d edgeDist = Vector2d(_aspect * _viewZoom, _viewZoom);
+	_world.SetViewBounds(AABB(Vector2d(_viewTranslation) - edgeDist, Vector2d(_viewTranslation) + edgeDist));
 }
 
 void Application::UpdatePeerBounds()
@@ -382,4 +397,19 @@ void Application::SetFriction(double friction)
 void Application::SetElasticity(double elasticity)
 {
 	_world.SetElasticity(elasticity);
+}
+
+void Application::SetBlobbyParts(int numParts)
+{
+	_world.SetBlobbyParts(numParts);
+}
+
+void Application::SetBlobbyStiffness(double stiffness)
+{
+	_world.SetBlobbyStiffness(stiffness);
+}
+
+void Application::SetNumBlobbies(int numBlobbies)
+{
+	_numBlobbies = Util::Max(numBlobbies, 0);
 }
\ No newline at end of file
@@ -59,6 +59,10 @@ public:
 	void SetFriction(double friction);
 	void SetElasticity(double elasticity);
 
+	void SetBlobbyParts(int numParts);
+	void SetBlobbyStiffness(double stiffness);
+	void SetNumBlobbies(int numBlobbies);
+
 private:
 
 	void Print(const std::string& string, int x, int y);
@@ -99,6 +103,8 @@ private:
 	static const int NUM_CAMERA_ACTIONS = 6;
 	bool _cameraState[NUM_CAMERA_ACTIONS];
 
+	int _numBlobbies;
+
 	struct
 	{
 		Vector2i _cursor;
@@ -0,0 +1,120 @@
+// David Hart - 2012
+
+#include "Benchmark.h"
+#include "World.h"
+#include "Timer.h"
+#include <iostream>
+
+const double Benchmark::TICK_DELTA = 1.0 / 60.0;
+
+Benchmark::Benchmark() :
+	_numSprings(0),
+	_integrateTime(0)
+{
+}
+
+void Benchmark::Run(std::ostream& out)
+{
+	// The world is too large to keep on the stack
+	World* world = new World();
+	world->Create(NULL, Vector2d(-100, 0), Vector2d(100, 100));
+
+	CreateScene(*world);
+
+	_integrateTime = 0;
+
+	Timer timer;
+
+	for (int i = 0; i < NUM_TICKS; ++i)
+	{
+		Tick(*world);
+	}
+
+	double tickTime = timer.GetTime();
+
+	out << "Benchmark, " << PHYSICS_PRECISION_NAME << " precision" << std::endl;
+	out << "  " << world->GetNumObjects() << " objects, " << world->GetNumBlobbies() << " blobbies, "
+		<< _numSprings << " springs, " << NUM_TICKS << " ticks" << std::endl;
+	out << "  Integration: " << _integrateTime * 1000.0 / NUM_TICKS << " ms per tick" << std::endl;
+	out << "  Tick:        " << tickTime * 1000.0 / NUM_TICKS << " ms per tick" << std::endl;
+
+	world->Dispose();
+	delete world;
+}
+
+void Benchmark::CreateScene(World& world)
+{
+	world.ReserveObjects(BOX_GRID_W * BOX_GRID_H, 0,
+		BLOBBY_GRID_W * BLOBBY_GRID_H * world.GetBlobbyParts(), BLOBBY_GRID_W * BLOBBY_GRID_H);
+
+	// The same layout as the application's scene, with the masses
+	// chosen in turn so every run simulates the same objects
+	for (int x = 0; x < BOX_GRID_W; ++x)
+	{
+		for (int y = 0; y < BOX_GRID_H; ++y)
+		{
+			Physics::BoxObject* b = world.AddBox();
+			b->SetPosition(Vector2r(Vector2d((x*1.2)-BOX_GRID_W*0.6, y*1.1+1)));
+
+			const Real masses[] = { 1, 2, 5 };
+			b->SetMass(masses[(x + y) % 3]);
+		}
+	}
+
+	// Blobbies drop onto the boxes, each one is a spring network
+	_numSprings = 0;
+
+	for (int x = 0; x < BLOBBY_GRID_W; ++x)
+	{
+		for (int y = 0; y < BLOBBY_GRID_H; ++y)
+		{
+			Physics::BlobbyObject* blobby = world.AddBlobbyObject();
+			blobby->SetPosition(Vector2r(Vector2d(x*10.0 - BLOBBY_GRID_W*5.0 + 5.0, y*6.0 + 30.0)));
+
+			_numSprings += blobby->GetNumSprings();
+		}
+	}
+}
+
+// The stages of a tick in the order the simulation threads run them,
+// without the network exchange or shape generation
+void Benchmark::Tick(World& world)
+{
+	Physics::ConstraintSystem& constraints = world.GetConstraints();
+
+	world.PrepareWriteState();
+
+	constraints.Prepare(world.GetNumObjects());
+	world.PrepareContacts(1);
+
+	for (int batch = 0; batch < constraints.GetNumForceBatches(); ++batch)
+	{
+		constraints.SolveForceBatch(batch, 0, 1, 0);
+	}
+
+	Timer timer;
+
+	for (int i = 0; i < world.GetNumObjects(); ++i)
+	{
+		world.UpdateObject(i, TICK_DELTA);
+	}
+
+	_integrateTime += timer.GetTime();
+
+	for (int batch = 0; batch < constraints.GetNumProjectionBatches(); ++batch)
+	{
+		constraints.SolveProjectionBatch(batch, 0, 1, 0);
+	}
+
+	world.BroadPhase(0, world.GetNumBucketsWide() - 1);
+	world.DetectCollisions(0, world.GetNumBucketsWide() - 1, 0);
+
+	for (int i = 0; i < world.GetNumObjects(); ++i)
+	{
+		world.GetObject(i)->SolveContacts(world, 0);
+	}
+
+	world.ApplyContactImpulses();
+
+	world.UpdateSpatialIndex();
+}
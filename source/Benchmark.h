@@ -0,0 +1,39 @@
+// David Hart - 2012
+//
+// class Benchmark
+//   Benchmark runs the simulation headless on a fixed scene for a fixed number
+//   of ticks on one thread, and reports the time spent integrating the objects,
+//   which includes the blobby spring networks, and the time spent on whole ticks.
+//   The scalar type is chosen when the physics is built, so the precisions are
+//   compared by running the Release and ReleaseFloat builds with --bench
+
+#pragma once
+
+#include <iosfwd>
+
+class World;
+
+class Benchmark
+{
+
+public:
+
+	Benchmark();
+	void Run(std::ostream& out);
+
+private:
+
+	void CreateScene(World& world);
+	void Tick(World& world);
+
+	static const int NUM_TICKS = 1000;
+	static const double TICK_DELTA;
+
+	static const int BOX_GRID_W = 80;
+	static const int BOX_GRID_H = 10;
+	static const int BLOBBY_GRID_W = 16;
+	static const int BLOBBY_GRID_H = 4;
+
+	int _numSprings;
+	double _integrateTime;
+};
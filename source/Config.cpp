@@ -48,6 +48,30 @@ bool Config::Read(const char* filename, Application& application)
 
 			application.SetElasticity(elasticity);
 		}
+		else if (token == "blobby_parts")
+		{
+			int numParts;
+
+			file >> numParts;
+
+			application.SetBlobbyParts(numParts);
+		}
+		else if (token == "blobby_stiffness")
+		{
+			double stiffness;
+
+			file >> stiffness;
+
+			application.SetBlobbyStiffness(stiffness);
+		}
+		else if (token == "blobby_count")
+		{
+			int numBlobbies;
+
+			file >> numBlobbies;
+
+			application.SetNumBlobbies(numBlobbies);
+		}
 		else if (token == "listen_port")
 		{
 			unsigned short port;
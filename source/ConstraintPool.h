@@ -0,0 +1,225 @@
+// David Hart - 2012
+//
+// class ConstraintPool
+//   ConstraintPool stores constraints of a single type contiguously. Constraints
+//   are referred to by an id which stays valid until the constraint is removed,
+//   removal moves the last constraint into the freed slot so the array never has
+//   gaps. The constraints are also coloured into batches in which no two
+//   constraints share a body, so each batch can be solved by several threads at once
+
+#pragma once
+
+#include <vector>
+#include <algorithm>
+#include <cassert>
+
+namespace Physics
+{
+	class PhysicsObject;
+
+	typedef int ConstraintId;
+	const ConstraintId INVALID_CONSTRAINT = -1;
+
+	template <typename T> class ConstraintPool
+	{
+
+	public:
+
+		// Constraints which could not be given one of the colours are put into
+		// a final batch which must be solved by a single thread
+		static const int MAX_BATCHES = 32;
+
+		ConstraintPool() :
+			_overflowBatch(-1),
+			_batchesDirty(false)
+		{
+		}
+
+		ConstraintId Add(const T& constraint)
+		{
+			ConstraintId id;
+
+			if (_freeIds.size() > 0)
+			{
+				id = _freeIds.back();
+				_freeIds.pop_back();
+			}
+			else
+			{
+				id = _slotForId.size();
+				_slotForId.push_back(-1);
+			}
+
+			_slotForId[id] = _constraints.size();
+			_idForSlot.push_back(id);
+			_constraints.push_back(constraint);
+
+			_batchesDirty = true;
+
+			return id;
+		}
+
+		void Remove(ConstraintId id)
+		{
+			assert(id >= 0 && id < (int)_slotForId.size());
+			assert(_slotForId[id] >= 0);
+
+			int slot = _slotForId[id];
+			int lastSlot = _constraints.size() - 1;
+
+			// Move the last constraint into the freed slot
+			_constraints[slot] = _constraints[lastSlot];
+			_idForSlot[slot] = _idForSlot[lastSlot];
+			_slotForId[_idForSlot[slot]] = slot;
+
+			_constraints.pop_back();
+			_idForSlot.pop_back();
+
+			_slotForId[id] = -1;
+			_freeIds.push_back(id);
+
+			_batchesDirty = true;
+		}
+
+		// Removes every constraint with an end attached to the body
+		void RemoveAttachedTo(const PhysicsObject* body)
+		{
+			// Removal moves the last constraint into the freed slot, so walk backwards
+			// to make sure the moved constraint has already been tested
+			for (int slot = _constraints.size() - 1; slot >= 0; --slot)
+			{
+				if (_constraints[slot]._bodyA == body || _constraints[slot]._bodyB == body)
+				{
+					Remove(_idForSlot[slot]);
+				}
+			}
+		}
+
+		T* Get(ConstraintId id)
+		{
+			if (id < 0 || id >= (int)_slotForId.size() || _slotForId[id] < 0)
+				return NULL;
+
+			return &_constraints[_slotForId[id]];
+		}
+
+		void Clear()
+		{
+			_constraints.clear();
+			_idForSlot.clear();
+			_slotForId.clear();
+			_freeIds.clear();
+			_batchOrder.clear();
+			_batchStart.clear();
+			_overflowBatch = -1;
+
+			_batchesDirty = false;
+		}
+
+		inline int Size() const
+		{
+			return _constraints.size();
+		}
+
+		inline bool BatchesDirty() const
+		{
+			return _batchesDirty;
+		}
+
+		// Greedily give each constraint the lowest colour not already used by one of
+		// its bodies, colourMasks must hold an entry for every object in the world
+		void BuildBatches(std::vector<unsigned>& colourMasks)
+		{
+			std::fill(colourMasks.begin(), colourMasks.end(), 0);
+
+			std::vector<int> colours(_constraints.size());
+			int colourCounts[MAX_BATCHES + 1] = { 0 };
+
+			for (unsigned i = 0; i < _constraints.size(); ++i)
+			{
+				const T& constraint = _constraints[i];
+
+				unsigned used = colourMasks[constraint._bodyA->GetId()];
+				if (constraint._bodyB != NULL)
+					used |= colourMasks[constraint._bodyB->GetId()];
+
+				int colour = 0;
+				while (colour < MAX_BATCHES && (used & (1u << colour)) != 0)
+					colour++;
+
+				if (colour < MAX_BATCHES)
+				{
+					colourMasks[constraint._bodyA->GetId()] |= 1u << colour;
+					if (constraint._bodyB != NULL)
+						colourMasks[constraint._bodyB->GetId()] |= 1u << colour;
+				}
+
+				colours[i] = colour;
+				colourCounts[colour]++;
+			}
+
+			// Sort the slots by colour, skipping colours which were never used
+			_batchStart.clear();
+			_overflowBatch = -1;
+
+			int colourStart[MAX_BATCHES + 1];
+			int start = 0;
+			for (int colour = 0; colour <= MAX_BATCHES; ++colour)
+			{
+				colourStart[colour] = start;
+
+				if (colourCounts[colour] > 0)
+				{
+					if (colour == MAX_BATCHES)
+						_overflowBatch = _batchStart.size();
+
+					_batchStart.push_back(start);
+				}
+
+				start += colourCounts[colour];
+			}
+			_batchStart.push_back(start);
+
+			_batchOrder.resize(_constraints.size());
+			for (unsigned i = 0; i < _constraints.size(); ++i)
+			{
+				_batchOrder[colourStart[colours[i]]++] = i;
+			}
+
+			_batchesDirty = false;
+		}
+
+		inline int GetNumBatches() const
+		{
+			return _batchStart.size() > 0 ? _batchStart.size() - 1 : 0;
+		}
+
+		inline int GetBatchSize(int batch) const
+		{
+			return _batchStart[batch + 1] - _batchStart[batch];
+		}
+
+		inline bool IsOverflowBatch(int batch) const
+		{
+			return batch == _overflowBatch;
+		}
+
+		inline T& GetBatchConstraint(int batch, int i)
+		{
+			return _constraints[_batchOrder[_batchStart[batch] + i]];
+		}
+
+	private:
+
+		std::vector<T> _constraints;
+		std::vector<ConstraintId> _idForSlot;
+		std::vector<int> _slotForId;
+		std::vector<ConstraintId> _freeIds;
+
+		// Slots ordered by batch and the index of the first slot of each batch
+		std::vector<int> _batchOrder;
+		std::vector<int> _batchStart;
+		int _overflowBatch;
+		bool _batchesDirty;
+	};
+}
@@ -0,0 +1,363 @@
+// David Hart - 2012
+
+#include "ConstraintSystem.h"
+#include "PhysicsObjects.h"
+#include "PhysicsThreads.h"
+#include "Util.h"
+
+using namespace Physics;
+
+ConstraintLink::ConstraintLink() :
+	_bodyA(NULL),
+	_bodyB(NULL),
+	_offsetA(0),
+	_offsetB(0)
+{
+}
+
+Vector2r ConstraintLink::GetEndA() const
+{
+	return _bodyA->GetPosition() + _offsetA;
+}
+
+Vector2r ConstraintLink::GetEndB() const
+{
+	if (_bodyB == NULL)
+		return _offsetB;
+
+	return _bodyB->GetPosition() + _offsetB;
+}
+
+SpringConstraint::SpringConstraint() :
+	_length(0),
+	_k(4),
+	_b(2)
+{
+}
+
+DistanceConstraint::DistanceConstraint() :
+	_length(1),
+	_stiffness(1)
+{
+}
+
+RopeConstraint::RopeConstraint() :
+	_length(1)
+{
+}
+
+ConstraintSystem::ConstraintSystem()
+{
+}
+
+ConstraintId ConstraintSystem::AddSpring(const SpringConstraint& spring)
+{
+	assert(spring._bodyA != NULL);
+	return _springs.Add(spring);
+}
+
+ConstraintId ConstraintSystem::AddDistance(const DistanceConstraint& distance)
+{
+	assert(distance._bodyA != NULL);
+	return _distances.Add(distance);
+}
+
+ConstraintId ConstraintSystem::AddPin(const PinConstraint& pin)
+{
+	assert(pin._bodyA != NULL);
+	return _pins.Add(pin);
+}
+
+ConstraintId ConstraintSystem::AddRope(const RopeConstraint& rope)
+{
+	assert(rope._bodyA != NULL);
+	return _ropes.Add(rope);
+}
+
+void ConstraintSystem::RemoveSpring(ConstraintId id)
+{
+	_springs.Remove(id);
+}
+
+void ConstraintSystem::RemoveDistance(ConstraintId id)
+{
+	_distances.Remove(id);
+}
+
+void ConstraintSystem::RemovePin(ConstraintId id)
+{
+	_pins.Remove(id);
+}
+
+void ConstraintSystem::RemoveRope(ConstraintId id)
+{
+	_ropes.Remove(id);
+}
+
+void ConstraintSystem::RemoveConstraintsOn(const PhysicsObject* object)
+{
+	_springs.RemoveAttachedTo(object);
+	_distances.RemoveAttachedTo(object);
+	_pins.RemoveAttachedTo(object);
+	_ropes.RemoveAttachedTo(object);
+}
+
+void ConstraintSystem::Clear()
+{
+	_springs.Clear();
+	_distances.Clear();
+	_pins.Clear();
+	_ropes.Clear();
+
+	_projectionBatches.clear();
+}
+
+SpringConstraint* ConstraintSystem::GetSpring(ConstraintId id)
+{
+	return _springs.Get(id);
+}
+
+DistanceConstraint* ConstraintSystem::GetDistance(ConstraintId id)
+{
+	return _distances.Get(id);
+}
+
+PinConstraint* ConstraintSystem::GetPin(ConstraintId id)
+{
+	return _pins.Get(id);
+}
+
+RopeConstraint* ConstraintSystem::GetRope(ConstraintId id)
+{
+	return _ropes.Get(id);
+}
+
+void ConstraintSystem::Prepare(int numObjects)
+{
+	bool projectionChanged = _distances.BatchesDirty() || _pins.BatchesDirty() || _ropes.BatchesDirty();
+
+	if (!_springs.BatchesDirty() && !projectionChanged)
+		return;
+
+	_colourMasks.resize(numObjects);
+
+	if (_springs.BatchesDirty())
+		_springs.BuildBatches(_colourMasks);
+
+	if (_distances.BatchesDirty())
+		_distances.BuildBatches(_colourMasks);
+
+	if (_pins.BatchesDirty())
+		_pins.BuildBatches(_colourMasks);
+
+	if (_ropes.BatchesDirty())
+		_ropes.BuildBatches(_colourMasks);
+
+	if (projectionChanged)
+	{
+		_projectionBatches.clear();
+
+		Batch batch;
+
+		batch._type = CONSTRAINT_DISTANCE;
+		for (batch._index = 0; batch._index < _distances.GetNumBatches(); ++batch._index)
+			_projectionBatches.push_back(batch);
+
+		batch._type = CONSTRAINT_PIN;
+		for (batch._index = 0; batch._index < _pins.GetNumBatches(); ++batch._index)
+			_projectionBatches.push_back(batch);
+
+		batch._type = CONSTRAINT_ROPE;
+		for (batch._index = 0; batch._index < _ropes.GetNumBatches(); ++batch._index)
+			_projectionBatches.push_back(batch);
+	}
+}
+
+int ConstraintSystem::GetNumForceBatches() const
+{
+	return _springs.GetNumBatches();
+}
+
+void ConstraintSystem::SolveForceBatch(int batch, unsigned threadId, unsigned numThreads, unsigned peerId)
+{
+	int start, end;
+	GetBatchRange(_springs.GetBatchSize(batch), _springs.IsOverflowBatch(batch), threadId, numThreads, start, end);
+
+	for (int i = start; i <= end; ++i)
+	{
+		Solve(_springs.GetBatchConstraint(batch, i), peerId);
+	}
+}
+
+int ConstraintSystem::GetNumProjectionBatches() const
+{
+	return _projectionBatches.size();
+}
+
+void ConstraintSystem::SolveProjectionBatch(int batchIndex, unsigned threadId, unsigned numThreads, unsigned peerId)
+{
+	const Batch& batch = _projectionBatches[batchIndex];
+	int start, end;
+
+	switch (batch._type)
+	{
+	case CONSTRAINT_DISTANCE:
+		GetBatchRange(_distances.GetBatchSize(batch._index), _distances.IsOverflowBatch(batch._index), threadId, numThreads, start, end);
+		for (int i = start; i <= end; ++i)
+			Solve(_distances.GetBatchConstraint(batch._index, i), peerId);
+		break;
+
+	case CONSTRAINT_PIN:
+		GetBatchRange(_pins.GetBatchSize(batch._index), _pins.IsOverflowBatch(batch._index), threadId, numThreads, start, end);
+		for (int i = start; i <= end; ++i)
+			Solve(_pins.GetBatchConstraint(batch._index, i), peerId);
+		break;
+
+	case CONSTRAINT_ROPE:
+		GetBatchRange(_ropes.GetBatchSize(batch._index), _ropes.IsOverflowBatch(batch._index), threadId, numThreads, start, end);
+		for (int i = start; i <= end; ++i)
+			Solve(_ropes.GetBatchConstraint(batch._index, i), peerId);
+		break;
+	}
+}
+
+Real ConstraintSystem::GetInverseMass(PhysicsObject* object, unsigned peerId)
+{
+	// Bodies owned by another peer can't be moved, treat them as immovable
+	if (object == NULL || object->GetOwnerId() != peerId)
+		return 0;
+
+	return 1 / object->GetMass();
+}
+
+void ConstraintSystem::GetBatchRange(int batchSize, bool overflow, unsigned threadId, unsigned numThreads, int& start, int& end)
+{
+	// Constraints in the overflow batch may share bodies, so only the first thread solves them
+	if (overflow)
+	{
+		start = 0;
+		end = threadId == 0 ? batchSize - 1 : -1;
+		return;
+	}
+
+	start = PhysicsWorkerThread::GetStartIndexForId(threadId, numThreads, batchSize);
+	end = PhysicsWorkerThread::GetEndIndexForId(threadId, numThreads, batchSize);
+}
+
+void ConstraintSystem::Solve(SpringConstraint& spring, unsigned peerId)
+{
+	Vector2r delta = spring.GetEndB() - spring.GetEndA();
+	Vector2r relativeVelocity = -spring._bodyA->GetVelocity();
+
+	if (spring._bodyB != NULL)
+		relativeVelocity += spring._bodyB->GetVelocity();
+
+	Real length = delta.length();
+
+	// Springs with a rest length only act along their direction
+	if (spring._length > 0 && length > Util::EPSILON)
+	{
+		Vector2r direction = delta / length;
+
+		delta = direction * (length - spring._length);
+		relativeVelocity = direction * direction.dot(relativeVelocity);
+	}
+
+	Vector2r force = delta * spring._k + relativeVelocity * spring._b;
+
+	ApplySpring(spring._bodyA, force, spring, peerId);
+
+	if (spring._bodyB != NULL)
+		ApplySpring(spring._bodyB, -force, spring, peerId);
+}
+
+void ConstraintSystem::ApplySpring(PhysicsObject* body, const Vector2r& force, const SpringConstraint& spring, unsigned peerId)
+{
+	// The owner integrates the body and sends its state to the other peers
+	if (body->GetOwnerId() != peerId)
+		return;
+
+	Real inverseMass = 1 / body->GetMass();
+
+	body->_constraintAcceleration.addScaled(force, inverseMass);
+	body->_constraintStiffness += spring._k * inverseMass;
+	body->_constraintDamping += spring._b * inverseMass;
+}
+
+void ConstraintSystem::Solve(DistanceConstraint& distance, unsigned peerId)
+{
+	Project(distance, distance._length, distance._length, distance._stiffness, peerId);
+}
+
+void ConstraintSystem::Solve(PinConstraint& pin, unsigned peerId)
+{
+	Real inverseMassA = GetInverseMass(pin._bodyA, peerId);
+	Real inverseMassB = GetInverseMass(pin._bodyB, peerId);
+	Real inverseMassSum = inverseMassA + inverseMassB;
+
+	if (inverseMassSum <= 0)
+		return;
+
+	Vector2r correction = (pin.GetEndB() - pin.GetEndA()) / inverseMassSum;
+	Vector2r relativeVelocity = -pin._bodyA->GetVelocity();
+
+	if (pin._bodyB != NULL)
+		relativeVelocity += pin._bodyB->GetVelocity();
+
+	Vector2r impulse = relativeVelocity / inverseMassSum;
+
+	pin._bodyA->_state._position.addScaled(correction, inverseMassA);
+	pin._bodyA->_state._velocity.addScaled(impulse, inverseMassA);
+
+	if (pin._bodyB != NULL)
+	{
+		pin._bodyB->_state._position.addScaled(correction, -inverseMassB);
+		pin._bodyB->_state._velocity.addScaled(impulse, -inverseMassB);
+	}
+}
+
+void ConstraintSystem::Solve(RopeConstraint& rope, unsigned peerId)
+{
+	Project(rope, 0, rope._length, 1.0, peerId);
+}
+
+void ConstraintSystem::Project(ConstraintLink& link, Real minLength, Real maxLength, Real stiffness, unsigned peerId)
+{
+	Real inverseMassA = GetInverseMass(link._bodyA, peerId);
+	Real inverseMassB = GetInverseMass(link._bodyB, peerId);
+	Real inverseMassSum = inverseMassA + inverseMassB;
+
+	if (inverseMassSum <= 0)
+		return;
+
+	Vector2r delta = link.GetEndB() - link.GetEndA();
+	Real length = delta.length();
+
+	if (length < Util::EPSILON || (length > minLength && length < maxLength))
+		return;
+
+	Vector2r direction = delta / length;
+	Real error = length - Util::Clamp(length, minLength, maxLength);
+
+	Vector2r correction = direction * (stiffness * error / inverseMassSum);
+
+	Real separatingSpeed = -link._bodyA->GetVelocity().dot(direction);
+	if (link._bodyB != NULL)
+		separatingSpeed += link._bodyB->GetVelocity().dot(direction);
+
+	// Only remove the velocity which moves the ends further outside the limits
+	bool leavingLimits = (length >= maxLength && separatingSpeed > 0) || (length <= minLength && separatingSpeed < 0);
+	if (!leavingLimits)
+		separatingSpeed = 0;
+
+	Vector2r impulse = direction * (separatingSpeed / inverseMassSum);
+
+	link._bodyA->_state._position.addScaled(correction, inverseMassA);
+	link._bodyA->_state._velocity.addScaled(impulse, inverseMassA);
+
+	if (link._bodyB != NULL)
+	{
+		link._bodyB->_state._position.addScaled(correction, -inverseMassB);
+		link._bodyB->_state._velocity.addScaled(impulse, -inverseMassB);
+	}
+}
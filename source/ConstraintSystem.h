@@ -0,0 +1,153 @@
+// David Hart - 2012
+//
+// class ConstraintSystem
+//   The ConstraintSystem owns every constraint in the world, stored in one pool
+//   per constraint type. Springs are solved before integration by accumulating
+//   an acceleration, linearised about the start of the tick, onto each body
+//   which the integrator evaluates at every step. Distance, pin and rope
+//   constraints are solved after integration by projecting the positions and
+//   velocities of the bodies. Each pool is split into batches which are solved
+//   one after another, the constraints in a batch are spread across the threads
+
+#pragma once
+
+#include "Vector.h"
+#include "Precision.h"
+#include "ConstraintPool.h"
+#include <vector>
+
+namespace Physics
+{
+	class PhysicsObject;
+
+	// The ends of a constraint. End A is attached to _bodyA at _offsetA, end B is
+	// attached to _bodyB at _offsetB or, if _bodyB is NULL, _offsetB is a fixed point
+	// in world space. Objects don't rotate so the offsets are fixed
+	struct ConstraintLink
+	{
+		ConstraintLink();
+
+		Vector2r GetEndA() const;
+		Vector2r GetEndB() const;
+
+		PhysicsObject* _bodyA;
+		PhysicsObject* _bodyB;
+		Vector2r _offsetA;
+		Vector2r _offsetB;
+	};
+
+	// Damped spring, a rest length of zero pulls the ends together in any direction
+	struct SpringConstraint : public ConstraintLink
+	{
+		SpringConstraint();
+
+		Real _length;
+		Real _k;
+		Real _b;
+	};
+
+	// Keeps the ends a fixed distance apart, stiffness is the fraction of the
+	// error corrected each tick
+	struct DistanceConstraint : public ConstraintLink
+	{
+		DistanceConstraint();
+
+		Real _length;
+		Real _stiffness;
+	};
+
+	// Holds the ends together
+	struct PinConstraint : public ConstraintLink
+	{
+	};
+
+	// Stops the ends moving further apart than the rope length
+	struct RopeConstraint : public ConstraintLink
+	{
+		RopeConstraint();
+
+		Real _length;
+	};
+
+	class ConstraintSystem
+	{
+
+	public:
+
+		ConstraintSystem();
+
+		// May be called before integration and after narrowphase collision detection
+		// Should not be called from multiple threads
+		ConstraintId AddSpring(const SpringConstraint& spring);
+		ConstraintId AddDistance(const DistanceConstraint& distance);
+		ConstraintId AddPin(const PinConstraint& pin);
+		ConstraintId AddRope(const RopeConstraint& rope);
+
+		void RemoveSpring(ConstraintId id);
+		void RemoveDistance(ConstraintId id);
+		void RemovePin(ConstraintId id);
+		void RemoveRope(ConstraintId id);
+
+		// Removes every constraint attached to the object, must be called before
+		// the object is destroyed
+		void RemoveConstraintsOn(const PhysicsObject* object);
+
+		void Clear();
+
+		// Returned pointers are invalidated by adding or removing constraints of the same type
+		SpringConstraint* GetSpring(ConstraintId id);
+		DistanceConstraint* GetDistance(ConstraintId id);
+		PinConstraint* GetPin(ConstraintId id);
+		RopeConstraint* GetRope(ConstraintId id);
+
+		// Rebuilds the batches of any pool which has changed, must be called
+		// before the batches are solved each tick
+		void Prepare(int numObjects);
+
+		// Each thread should solve every batch in order, with all threads
+		// finishing a batch before the next batch is started
+		int GetNumForceBatches() const;
+		void SolveForceBatch(int batch, unsigned threadId, unsigned numThreads, unsigned peerId);
+
+		int GetNumProjectionBatches() const;
+		void SolveProjectionBatch(int batch, unsigned threadId, unsigned numThreads, unsigned peerId);
+
+	private:
+
+		enum eConstraintType
+		{
+			CONSTRAINT_DISTANCE,
+			CONSTRAINT_PIN,
+			CONSTRAINT_ROPE,
+		};
+
+		struct Batch
+		{
+			eConstraintType _type;
+			int _index;
+		};
+
+		static Real GetInverseMass(PhysicsObject* object, unsigned peerId);
+		static void GetBatchRange(int batchSize, bool overflow, unsigned threadId, unsigned numThreads, int& start, int& end);
+
+		void Solve(SpringConstraint& spring, unsigned peerId);
+
+		// Adds the spring force and its linearisation to a body this peer owns
+		static void ApplySpring(PhysicsObject* body, const Vector2r& force, const SpringConstraint& spring, unsigned peerId);
+		void Solve(DistanceConstraint& distance, unsigned peerId);
+		void Solve(PinConstraint& pin, unsigned peerId);
+		void Solve(RopeConstraint& rope, unsigned peerId);
+
+		// Moves the ends together or apart until their separation is between
+		// the limits, then removes any velocity taking it back outside them
+		void Project(ConstraintLink& link, Real minLength, Real maxLength, Real stiffness, unsigned peerId);
+
+		ConstraintPool<SpringConstraint> _springs;
+		ConstraintPool<DistanceConstraint> _distances;
+		ConstraintPool<PinConstraint> _pins;
+		ConstraintPool<RopeConstraint> _ropes;
+
+		std::vector<Batch> _projectionBatches;
+		std::vector<unsigned> _colourMasks;
+	};
+}
@@ -22,6 +22,28 @@ template <> inline bool Message::Read<std::string>(std::string& value)
 {
 	unsigned short length;
 
+	if (!Read(length))
+		return false;
+
+	return ReadString(value, length);
+}
+
+template <typename T> inline bool MessageView::Read(T& value)
+{
+	if (_readLocation + sizeof(T) > _size)
+		return false;
+
+	// The data may not be aligned for T
+	memcpy(&value, _data + _readLocation, sizeof(T));
+	_readLocation += sizeof(T);
+
+	return true;
+}
+
+template <> inline bool MessageView::Read<std::string>(std::string& value)
+{
+	unsigned short length;
+
 	if (!Read(length))
 		return false;
 
@@ -1,6 +1,8 @@
 // David Hart - 2012
 
 #include "MyWindow.h"
+#include "Benchmark.h"
+#include <iostream>
 
 using namespace gxbase;
 
@@ -22,6 +24,16 @@ void MyWindow::OnCreate()
 {
 	std::string file;
 
+	// Runs the benchmark instead of the application
+	if (_gxApp->ArgCount() == 2 && std::string(_gxApp->Arg(1)) == "--bench")
+	{
+		Benchmark benchmark;
+		benchmark.Run(std::cout);
+
+		Close();
+		return;
+	}
+
 	if (_gxApp->ArgCount() == 1)
 	{
 		file = "default.cfg";
@@ -32,7 +44,7 @@ void MyWindow::OnCreate()
 	}
 	else
 	{
-		MessageBoxA(GetSafeHwnd(), "Invalid Command Line Arguments usage:\nGraphicsACW.exe\nGraphicsACW.exe \"file\"", "Error", MB_OK);
+		MessageBoxA(GetSafeHwnd(), "Invalid Command Line Arguments usage:\nGraphicsACW.exe\nGraphicsACW.exe \"file\"\nGraphicsACW.exe --bench", "Error", MB_OK);
 		Close();
 	}
 
@@ -4,6 +4,8 @@
 #include "PhysicsThreads.h"
 #include <iostream>
 #include <sstream>
+#include <cstdlib>
+#include <algorithm>
 
 using namespace Networking;
 
@@ -14,34 +16,115 @@ unsigned short NetworkController::BROADCAST_PORT = 7777;
 unsigned short NetworkController::TCPLISTEN_PORT = 2869;
 
 const double ObjectExchange::RECV_TIMEOUT = 3;
-
-ObjectExchange::ObjectExchange(GameWorldThread& worldThread, unsigned peerId) :
+const double ObjectExchange::LOAD_REPORT_INTERVAL = 0.5;
+const double ObjectExchange::INTEREST_MARGIN = 5;
+const double ObjectExchange::LATENCY_SMOOTHING = 0.1;
+const double ObjectExchange::MIGRATION_HYSTERESIS = 2;
+const double ObjectExchange::REQUEST_TIMEOUT = 1;
+const double ObjectExchange::DENIED_RETRY_INTERVAL = 0.25;
+const double SessionMasterController::REBALANCE_INTERVAL = 1;
+const double ObjectExchange::MAX_REPLICATED_SPEED = 64;
+
+ObjectExchange::ObjectExchange(GameWorldThread& worldThread, bool relayUpdates) :
 	_worldThread(worldThread),
 	_world(*(worldThread._world)),
-	_peerId(peerId)
+	_peerId(0),
+	_remotePeerId(0),
+	_relayUpdates(relayUpdates)
 {
 	Reset();
 }
 
+void ObjectExchange::SetPeerIds(unsigned peerId, unsigned remotePeerId)
+{
+	_peerId = peerId;
+	_remotePeerId = remotePeerId;
+}
+
+unsigned ObjectExchange::GetPeerId() const
+{
+	return _peerId;
+}
+
+unsigned ObjectExchange::GetRemotePeerId() const
+{
+	return _remotePeerId;
+}
+
+void ObjectExchange::SetRemoteAddress(const Address& address)
+{
+	_remoteAddress = address;
+}
+
 void ObjectExchange::Reset()
 {
 	_objectMigrationIn.clear();
 	_objectMigrationOut.clear();
-
-	_sendData._messagesSent = 0;
-	_sendData._newState.clear();
-	_sendData._sendingState.clear();
-
-	_updateData._objectsRead = 0;
+	_ownershipChanges.clear();
+
+	_impulsesOut.clear();
+	_impulsesIn.clear();
+	_forwardedImpulses.clear();
+	_impulsesSent.clear();
+
+	_regionMessageQueued = false;
+	_regionMapChanged = false;
+
+	_stepTime = 0;
+	_remoteStepTime = 0;
+	_hasRemoteStepTime = false;
+	_loadReportTimer.Start();
+
+	_requestCursor = 0;
+	_requestRetryTimes.clear();
+
+	_hasSnapshotAddress = false;
+	_snapshotPortSent = false;
+
+	_clock.Start();
+	_latency = 0;
+	_hasLatency = false;
+
+	_sendData._newSnapshot.clear();
+	_sendData._sendingSnapshot.clear();
+	_sendData._newSnapshotTime = 0;
+	_sendData._sendingSnapshotTime = 0;
+	_sendData._snapshotReady = false;
+	_sendData._baselines.clear();
+	_sendData._frame = 0;
+	SentPacket unused;
+	unused.sequence = 0;
+	_sendData._sentPackets.assign(SENT_PACKET_HISTORY, unused);
+	_sendData._sequence = 0;
+
+	ReceivedPacket empty;
+	empty.sequence = 0;
+	_updateData._receivedPackets.assign(SENT_PACKET_HISTORY, empty);
+	_updateData._recordsReceived.clear();
 	_updateData._objectsReceived.clear();
 	_updateData._objectsUpdate.clear();
+	_updateData._viewsUpdate.clear();
+	_updateData._viewsFrame = 0;
+	_updateData._sequence = 0;
+	_updateData._ackBits = 0;
+	_updateData._objectFrames.clear();
+	_updateData._completeFrame = 0;
+
+	for (unsigned i = 0; i < FRAME_HISTORY; ++i)
+	{
+		_updateData._frameProgress[i].frame = 0;
+		_updateData._frameProgress[i].packetsReceived = 0;
+	}
+	_updateData._hasRemoteTime = false;
+	_updateData._frameArrival = 0;
 
-	_initialisationDataOut._messagesSent = 0;
+	_initialisationDataOut._messagesQueued = 0;
 	_initialisationDataOut._messages.clear();
 
 	
 	_initialisationDataIn._objectsRead = 0;
 	_initialisationDataIn._objects.clear();
+	_initialisationDataIn._partsExpected = 0;
 	_initialisationDataIn._initialisationReceived = false;
 
 	_timeout.Start();
@@ -56,19 +139,192 @@ bool ObjectExchange::Timeout()
 
 void ObjectExchange::ReloadLastKnownPosition()
 {
-	for (int i = 0; i < _world.GetNumObjects(); i++)
+	for (unsigned i = 0; i < _objectsByNetworkId.size(); i++)
 	{
-		Physics::PhysicsObject* object = _world.GetObject(i);
+		Physics::PhysicsObject* object = GetObjectByNetworkId(i);
+
+		if (object == NULL || !ReceivesUpdatesFor(object))
+			continue;
 
 		object->SetPosition(_lastReceivedObjectState[i].position);
 		object->SetVelocity(_lastReceivedObjectState[i].velocity);
 	}
 }
 
-void ObjectExchange::ReceiveState(TcpSocket& socket)
+void ObjectExchange::ReleaseRemoteObjects()
 {
-	// Store parts of frames as they arrive
-	Message message;
+	for (unsigned i = 0; i < _objectsByNetworkId.size(); i++)
+	{
+		Physics::PhysicsObject* object = GetObjectByNetworkId(i);
+
+		if (object != NULL && object->GetOwnerId() == _remotePeerId)
+			ChangeOwner(object, i, _peerId);
+	}
+}
+
+void ObjectExchange::QueueRegionMap(const RegionMap& regionMap)
+{
+	Threading::ScopedLock lock(_exchangeMutex);
+
+	// Only the latest map is worth sending
+	_regionMessageOut = Message();
+	_regionMessageOut.Append(PEER_REGIONS);
+	AppendRegionMap(_regionMessageOut, regionMap);
+
+	_regionMessageQueued = true;
+}
+
+void ObjectExchange::TakeOwnershipChanges(std::vector<ObjectMigration>& changes)
+{
+	changes.insert(changes.end(), _ownershipChanges.begin(), _ownershipChanges.end());
+	_ownershipChanges.clear();
+}
+
+void ObjectExchange::NotifyOwnershipChanges(const std::vector<ObjectMigration>& changes)
+{
+	Threading::ScopedLock lock(_exchangeMutex);
+
+	_objectMigrationOut.insert(_objectMigrationOut.end(), changes.begin(), changes.end());
+}
+
+bool ObjectExchange::GetRemoteStepTime(double& stepTime)
+{
+	Threading::ScopedLock lock(_exchangeMutex);
+
+	stepTime = _remoteStepTime;
+	return _hasRemoteStepTime;
+}
+
+void ObjectExchange::TakeForwardedImpulses(std::vector<ObjectImpulse>& impulses)
+{
+	impulses.insert(impulses.end(), _forwardedImpulses.begin(), _forwardedImpulses.end());
+	_forwardedImpulses.clear();
+}
+
+void ObjectExchange::ForwardImpulses(const std::vector<ObjectImpulse>& impulses)
+{
+	Threading::ScopedLock lock(_exchangeMutex);
+
+	for (unsigned i = 0; i < impulses.size(); ++i)
+	{
+		Physics::PhysicsObject* object = GetObjectByNetworkId(impulses[i].objectId);
+
+		if (object != NULL && ReceivesUpdatesFor(object))
+			_impulsesOut.push_back(impulses[i]);
+	}
+}
+
+void ObjectExchange::AppendRegionMap(Message& message, const RegionMap& regionMap)
+{
+	message.Append((unsigned char)regionMap.GetNumRegions());
+
+	for (unsigned i = 0; i < regionMap.GetNumRegions(); ++i)
+	{
+		message.Append((unsigned char)regionMap.GetPeer(i));
+	}
+
+	for (unsigned i = 0; i + 1 < regionMap.GetNumRegions(); ++i)
+	{
+		message.Append(regionMap.GetBoundary(i));
+	}
+}
+
+bool ObjectExchange::ReadRegionMap(MessageView& message, RegionMap& regionMap)
+{
+	unsigned char numRegions = 0;
+
+	if (!message.Read(numRegions) || numRegions == 0 || numRegions > RegionMap::MAX_PEERS)
+		return false;
+
+	std::vector<unsigned> peers(numRegions);
+	std::vector<double> boundaries(numRegions - 1);
+
+	bool hasRegion[RegionMap::MAX_PEERS] = { false };
+
+	for (unsigned i = 0; i < peers.size(); ++i)
+	{
+		unsigned char peerId;
+
+		if (!message.Read(peerId) || peerId >= RegionMap::MAX_PEERS || hasRegion[peerId])
+			return false;
+
+		hasRegion[peerId] = true;
+		peers[i] = peerId;
+	}
+
+	// Each boundary must lie right of the last one and inside the world, the
+	// comparisons are written so a NaN boundary fails them
+	double lowerBound = _world.GetWorldMin().x();
+
+	for (unsigned i = 0; i < boundaries.size(); ++i)
+	{
+		if (!message.Read(boundaries[i]) || !(boundaries[i] > lowerBound && boundaries[i] < _world.GetWorldMax().x()))
+			return false;
+
+		lowerBound = boundaries[i];
+	}
+
+	regionMap.Create(_world.GetWorldMin(), _world.GetWorldMax());
+	regionMap.SetRegions(peers, boundaries);
+
+	return true;
+}
+
+void ObjectExchange::ApplyRegionMap(const RegionMap& regionMap)
+{
+	_world.SetRegionMap(regionMap);
+	_worldThread.SetNumPeers(regionMap.GetNumRegions());
+}
+
+void ObjectExchange::MapNetworkId(unsigned networkId, Physics::PhysicsObject* object)
+{
+	if (networkId >= _objectsByNetworkId.size())
+	{
+		_objectsByNetworkId.resize(networkId + 1);
+		_lastReceivedObjectState.resize(networkId + 1);
+	}
+
+	_objectsByNetworkId[networkId] = object->GetHandle();
+
+	unsigned handleIndex = object->GetHandle()._index;
+
+	if (handleIndex >= _networkIdsByHandle.size())
+	{
+		_networkIdsByHandle.resize(handleIndex + 1, INVALID_NETWORK_ID);
+	}
+
+	_networkIdsByHandle[handleIndex] = networkId;
+}
+
+Physics::PhysicsObject* ObjectExchange::GetObjectByNetworkId(unsigned networkId)
+{
+	if (networkId >= _objectsByNetworkId.size())
+		return NULL;
+
+	return _world.GetObject(_objectsByNetworkId[networkId]);
+}
+
+unsigned ObjectExchange::GetNetworkId(Physics::PhysicsObject* object)
+{
+	unsigned handleIndex = object->GetHandle()._index;
+
+	if (handleIndex >= _networkIdsByHandle.size())
+		return INVALID_NETWORK_ID;
+
+	unsigned networkId = _networkIdsByHandle[handleIndex];
+
+	// The handle slot may have been reused by an object added since the ids were mapped
+	if (networkId == INVALID_NETWORK_ID || GetObjectByNetworkId(networkId) != object)
+		return INVALID_NETWORK_ID;
+
+	return networkId;
+}
+
+void ObjectExchange::ReceiveState(TcpSocket& socket, UdpSocket& snapshotSocket)
+{
+	ReceiveSnapshots(snapshotSocket);
+
+	MessageView message;
 
 	while (socket.Receive(message))
 	{
@@ -81,13 +337,25 @@ void ObjectExchange::ReceiveState(TcpSocket& socket)
 			return;
 		}
 
-		if (messageType == OBJECT_UPDATES)
+		if (messageType == OBJECT_MIGRATION)
 		{
-			HandleUpdateMessage(socket, message);
+			HandleMigrationMessage(socket, message);
 		}
-		else if (messageType == OBJECT_MIGRATION)
+		else if (messageType == PEER_REGIONS)
 		{
-			HandleMigrationMessage(socket, message);
+			HandleRegionMessage(socket, message);
+		}
+		else if (messageType == PEER_LOAD)
+		{
+			HandleLoadMessage(socket, message);
+		}
+		else if (messageType == CONTACT_IMPULSES)
+		{
+			HandleImpulseMessage(socket, message);
+		}
+		else if (messageType == SNAPSHOT_PORT)
+		{
+			HandleSnapshotPortMessage(socket, message);
 		}
 		else
 		{
@@ -98,21 +366,28 @@ void ObjectExchange::ReceiveState(TcpSocket& socket)
 	}
 }
 
-void ObjectExchange::HandleUpdateMessage(TcpSocket& socket, Message& message)
+void ObjectExchange::HandleMigrationMessage(TcpSocket& socket, MessageView& message)
 {
-	// If this is the first update message of a batch
-	if (_updateData._objectsReceived.size() == 0)
+	Threading::ScopedLock lock (_exchangeMutex);
+
+	ObjectMigration migration;
+	unsigned char type;
+
+	while(message.Read(type))
 	{
-		unsigned numObjects = 0;
-		float xMin, yMin, xMax, yMax;
+		migration.type = (eRequestType)type;
 
-		bool valid = true;
+		bool valid = type <= OBJECT_OWNER_CHANGED;
+		valid &= message.Read(migration.objectId);
+
+		migration.ownerId = 0;
 
-		valid &= message.Read(numObjects);
-		valid &= message.Read(xMin);
-		valid &= message.Read(yMin);
-		valid &= message.Read(xMax);
-		valid &= message.Read(yMax);
+		if (migration.type == OBJECT_OWNER_CHANGED)
+		{
+			unsigned char ownerId = 0;
+			valid &= message.Read(ownerId) && ownerId < RegionMap::MAX_PEERS;
+			migration.ownerId = ownerId;
+		}
 
 		if (!valid)
 		{
@@ -120,230 +395,556 @@ void ObjectExchange::HandleUpdateMessage(TcpSocket& socket, Message& message)
 			return;
 		}
 
-		_updateData._peerBoundsReceived = AABB(Vector2d(xMin, yMin), Vector2d(xMax, yMax));
+		_objectMigrationIn.push_back(migration);
+	}
+}
+
+void ObjectExchange::HandleRegionMessage(TcpSocket& socket, MessageView& message)
+{
+	RegionMap regionMap;
 
-		_updateData._objectsReceived.resize(numObjects);
-		_updateData._objectsRead = 0;
+	if (!ReadRegionMap(message, regionMap))
+	{
+		socket.Close();
+		return;
 	}
 
+	Threading::ScopedLock lock(_exchangeMutex);
+
+	_regionMapReceived = regionMap;
+	_regionMapChanged = true;
+}
+
+void ObjectExchange::HandleLoadMessage(TcpSocket& socket, MessageView& message)
+{
+	float stepTime;
 
-	while(_updateData._objectsRead < _updateData._objectsReceived.size())
+	if (!message.Read(stepTime) || !(stepTime >= 0))
 	{
-		ObjectState& object = _updateData._objectsReceived[_updateData._objectsRead];
+		socket.Close();
+		return;
+	}
 
-		// If message doesn't contain another id wait for next message
-		if (!message.Read(object.id))
-		{
-			break;
-		}
+	Threading::ScopedLock lock(_exchangeMutex);
+
+	_remoteStepTime = stepTime;
+	_hasRemoteStepTime = true;
+}
+
+void ObjectExchange::HandleImpulseMessage(TcpSocket& socket, MessageView& message)
+{
+	Threading::ScopedLock lock(_exchangeMutex);
+
+	ObjectImpulse impulse;
+
+	while (message.Read(impulse.objectId))
+	{
+		float vx, vy, px, py;
 
 		bool valid = true;
-		valid &= message.Read(object.x);
-		valid &= message.Read(object.y);
-		valid &= message.Read(object.vx);
-		valid &= message.Read(object.vy);
 
-		// If malformed object
+		valid &= message.Read(vx);
+		valid &= message.Read(vy);
+		valid &= message.Read(px);
+		valid &= message.Read(py);
+
 		if (!valid)
 		{
 			socket.Close();
 			return;
 		}
 
-		_updateData._objectsRead++;
-	}
+		impulse.velocity = Vector2r((Real)vx, (Real)vy);
+		impulse.position = Vector2r((Real)px, (Real)py);
 
-	if (_updateData._objectsRead == _updateData._objectsReceived.size())
-	{
-		Threading::ScopedLock lock(_exchangeMutex);
+		_impulsesIn.push_back(impulse);
+	}
+}
 
-		_updateData._objectsReceived.swap(_updateData._objectsUpdate);
-		std::swap(_updateData._peerBoundsReceived, _updateData._peerBoundsUpdate);
-		_updateData._objectsReceived.clear();
-		_updateData._objectsRead = 0;
+void ObjectExchange::HandleSnapshotPortMessage(TcpSocket& socket, MessageView& message)
+{
+	unsigned short port;
 
-		_timeout.Start();
+	if (!message.Read(port))
+	{
+		socket.Close();
+		return;
 	}
+
+	_snapshotAddress = _remoteAddress;
+	_snapshotAddress.SetPort(port);
+	_hasSnapshotAddress = true;
 }
 
-void ObjectExchange::HandleMigrationMessage(TcpSocket& socket, Message& message)
+void ObjectExchange::ReceiveSnapshots(UdpSocket& socket)
 {
-	Threading::ScopedLock lock (_exchangeMutex);
-
-	ObjectMigration migration;
+	Address address;
+	MessageView packet;
 
-	while(message.Read(migration.type))
+	while (socket.RecieveFrom(address, packet))
 	{
-		if (!message.Read(migration.objectId))
+		// The socket may still hold packets sent by a previous peer
+		if (_hasSnapshotAddress && address == _snapshotAddress)
 		{
-			socket.Close();
-			return;
+			HandleSnapshotPacket(packet);
 		}
-		
-		_objectMigrationIn.push_back(migration);
 	}
 }
 
-void ObjectExchange::SendState(TcpSocket& socket)
+void ObjectExchange::HandleSnapshotPacket(MessageView& packet)
 {
-	// Try to send waiting messages messages
-	while (_sendData._messagesSent < _sendData._sendingState.size())
-	{
+	eMessageType messageType;
+	unsigned sequence = 0;
+	unsigned ack = 0;
+	unsigned ackBits = 0;
+	unsigned frame = 0;
+	unsigned short numPackets = 0;
+	float time = 0;
+	float echoTime = 0;
+	unsigned char numViews = 0;
+	unsigned short numObjects = 0;
+
+	bool valid = true;
+
+	valid &= packet.Read(messageType) && messageType == OBJECT_UPDATES;
+	valid &= packet.Read(sequence);
+	valid &= packet.Read(ack);
+	valid &= packet.Read(ackBits);
+	valid &= packet.Read(frame);
+	valid &= packet.Read(numPackets) && numPackets > 0;
+	valid &= packet.Read(time);
+	valid &= packet.Read(echoTime);
+	valid &= packet.Read(numViews);
+
+	if (!valid)
+		return;
 
-		// If sending would block, give up for now
-		if (!socket.Send(_sendData._sendingState[_sendData._messagesSent]))
-		{
-			return;
-		}
-		
-		 _sendData._messagesSent++;
-	}
+	_updateData._viewsReceived.resize(numViews);
 
-	// If complete frame sent
-	if (_sendData._messagesSent == _sendData._sendingState.size())
+	for (unsigned i = 0; i < numViews && valid; ++i)
 	{
-		_sendData._messagesSent = 0;
+		unsigned char peerId;
+		float xMin, yMin, xMax, yMax;
 
-		Threading::ScopedLock lock(_exchangeMutex);
-		
-		// Replace the most recent state with the one we just finished sending
-		_sendData._newState.swap(_sendData._sendingState);
+		valid &= packet.Read(peerId);
+		valid &= packet.Read(xMin);
+		valid &= packet.Read(yMin);
+		valid &= packet.Read(xMax);
+		valid &= packet.Read(yMax);
+
+		_updateData._viewsReceived[i].peerId = peerId;
+		_updateData._viewsReceived[i].bounds = AABB(Vector2d(xMin, yMin), Vector2d(xMax, yMax));
 	}
 
-	{
-		Threading::ScopedLock lock(_exchangeMutex);
-		if (_objectMigrationOut.size() != 0)
-		{
-			Message message;
-			message.Append(OBJECT_MIGRATION);
-			
-			const int objectStride = sizeof(eRequestType) + sizeof(unsigned);
-			
-			unsigned migrationSent = 0;
+	valid &= packet.Read(numObjects);
 
-			for (unsigned i = 0; i < _objectMigrationOut.size(); ++i)
-			{
-				if (message.Size() + objectStride >= Message::MAX_BUFFER_SIZE)
-				{
-					if (!socket.Send(message))
-					{
-						_objectMigrationOut.erase(_objectMigrationOut.begin(), _objectMigrationOut.begin() + migrationSent);
-						return;
-					}
-
-					message.Clear();
-					message.Append(OBJECT_MIGRATION);
-					migrationSent = i;
-				}
+	if (!valid)
+		return;
 
-				message.Append(_objectMigrationOut[i].type);
-				message.Append(_objectMigrationOut[i].objectId);
-			}
+	_updateData._recordsReceived.resize(numObjects);
+	_updateData._objectsReceived.resize(numObjects);
 
-			if (migrationSent != _objectMigrationOut.size())
-			{
-				if (socket.Send(message))
-				{
-					_objectMigrationOut.clear();
-				}
-			}
-		}
+	unsigned lastId = 0;
+
+	// Packets with a record whose baseline we no longer hold are dropped
+	// without being acknowledged, their objects are sent again
+	for (unsigned i = 0; i < numObjects; ++i)
+	{
+		ObjectSnapshot& record = _updateData._recordsReceived[i];
+
+		if (!ReadObjectRecord(packet, sequence, record, lastId))
+			return;
+
+		_updateData._objectsReceived[i].id = record.id;
+		Dequantise(record.state, _updateData._objectsReceived[i]);
 	}
-}
 
-void ObjectExchange::ExchangeUpdatesWithWorld()
-{
-	Threading::ScopedLock lock (_exchangeMutex);
-	
-	StoreNewPositionUpdates();
+	bool latest = sequence > _updateData._sequence;
 
-	ProcessReceivedPositionUpdates();
+	if (!RecordReceivedSequence(sequence))
+		return;
 
-	ProcessOwnershipRequests();
+	ReceivedPacket& received = _updateData._receivedPackets[sequence % SENT_PACKET_HISTORY];
+	received.sequence = sequence;
+	received.objects.swap(_updateData._recordsReceived);
 
-	ProcessOwnershipConfirmations();
-}
+	ProcessAcks(ack, ackBits);
 
-void ObjectExchange::GatherInitialisationData()
-{
-	unsigned numObjects = _world.GetNumObjects();
-	_initialisationDataOut._messagesSent = 0;
-	const int objectStride = sizeof(unsigned) * 2 + sizeof(double) * 5;
+	double now = _clock.GetTime();
 
-	_lastReceivedObjectState.resize(_world.GetNumObjects());
+	if (latest)
+	{
+		_updateData._remoteTime = time;
+		_updateData._remoteTimeArrival = now;
+		_updateData._hasRemoteTime = true;
+	}
 
-	Message message;
-	message.Append(numObjects);
+	Threading::ScopedLock lock(_exchangeMutex);
 
-	for (unsigned i = 0; i < numObjects; ++i)
+	// The echo is one of our own time stamps moved on by how long the remote
+	// peer held it, so the time since is the round trip of a packet
+	if (latest && echoTime >= 0)
 	{
-		// If another object can't fit into the message, add it onto the list
-		// and start building another message
-		if (message.Size() + objectStride > Message::MAX_BUFFER_SIZE)
-		{
-			_initialisationDataOut._messages.push_back(message);
-			message.Clear();
-		}
+		double age = Util::Max((now - echoTime) * 0.5, 0.0);
 
-		Physics::PhysicsObject* object = _worldThread._world->GetObject(i);
+		_latency = _hasLatency ? _latency + (age - _latency) * LATENCY_SMOOTHING : age;
+		_hasLatency = true;
+	}
 
-		message.Append(object->GetSerializationType());
-		message.Append(object->GetPosition().x());
-		message.Append(object->GetPosition().y());
-		message.Append(object->GetVelocity().x());
-		message.Append(object->GetVelocity().y());
-		message.Append(object->GetColor().To32BitColor());
-		message.Append(object->GetMass());
+	// Objects are only held once every packet of a frame has arrived, so a lost
+	// packet doesn't hold the objects it carried
+	FrameProgress& progress = _updateData._frameProgress[frame % FRAME_HISTORY];
 
-		_lastReceivedObjectState[i].position = object->GetPosition();
-		_lastReceivedObjectState[i].velocity = object->GetVelocity();
+	if (frame > progress.frame)
+	{
+		progress.frame = frame;
+		progress.packetsReceived = 0;
 	}
 
-	if (message.Size() != sizeof(unsigned short))
+	if (frame == progress.frame && ++progress.packetsReceived == numPackets)
 	{
-		_initialisationDataOut._messages.push_back(message);
+		_updateData._completeFrame = Util::Max(_updateData._completeFrame, frame);
 	}
 
-	_sendData._messagesSent = 0;
-}
+	// Views are sent in the first packet of each frame
+	if (numViews > 0 && frame >= _updateData._viewsFrame)
+	{
+		_updateData._viewsUpdate = _updateData._viewsReceived;
+		_updateData._viewsFrame = frame;
+	}
 
-void ObjectExchange::SendInitialisationData(TcpSocket& socket)
-{
-	while (_initialisationDataOut._messagesSent < _initialisationDataOut._messages.size())
+	for (unsigned i = 0; i < numObjects; ++i)
 	{
-		// If sending would block, give up for now
-		if (!socket.Send(_initialisationDataOut._messages[_initialisationDataOut._messagesSent]))
-		{
-			return;
-		}
-		
-		 _initialisationDataOut._messagesSent++;
+		const ObjectState& object = _updateData._objectsReceived[i];
+
+		// Ids come from the datagram, only objects we were given are updated
+		if (object.id >= _objectsByNetworkId.size())
+			continue;
+
+		if (object.id >= _updateData._objectFrames.size())
+			_updateData._objectFrames.resize(_objectsByNetworkId.size(), 0);
+
+		if (frame < _updateData._objectFrames[object.id])
+			continue;
+
+		_updateData._objectFrames[object.id] = frame;
+		_updateData._objectsUpdate.push_back(object);
 	}
-}
 
-bool ObjectExchange::InitialisationSent()
-{
-	return _initialisationDataOut._messagesSent == _initialisationDataOut._messages.size();
+	_updateData._frameArrival = now;
+
+	_timeout.Start();
 }
 
-void ObjectExchange::ReceiveInitialisationData(TcpSocket& socket)
+bool ObjectExchange::RecordReceivedSequence(unsigned sequence)
 {
-	Message message;
+	unsigned& latest = _updateData._sequence;
+	unsigned& bits = _updateData._ackBits;
+
+	if (sequence > latest)
+	{
+		unsigned shift = sequence - latest;
+
+		// Bit i is the packet i + 1 before the latest
+		bits = shift < ACK_BITS ? bits << shift : 0;
+
+		if (latest != 0 && shift <= ACK_BITS)
+			bits |= 1u << (shift - 1);
+
+		latest = sequence;
+		return true;
+	}
+
+	unsigned age = latest - sequence;
+
+	if (age == 0 || age > ACK_BITS || (bits & (1u << (age - 1))) != 0)
+		return false;
+
+	bits |= 1u << (age - 1);
+	return true;
+}
+
+void ObjectExchange::ProcessAcks(unsigned ack, unsigned ackBits)
+{
+	if (ack == 0)
+		return;
+
+	AcknowledgePacket(ack);
+
+	for (unsigned i = 0; i < ACK_BITS && i + 1 < ack; ++i)
+	{
+		if ((ackBits & (1u << i)) != 0)
+			AcknowledgePacket(ack - i - 1);
+	}
+}
+
+void ObjectExchange::AcknowledgePacket(unsigned sequence)
+{
+	SentPacket& packet = _sendData._sentPackets[sequence % SENT_PACKET_HISTORY];
+
+	// Already acknowledged, or the entry has been reused
+	if (packet.sequence != sequence)
+		return;
+
+	for (unsigned i = 0; i < packet.objects.size(); ++i)
+	{
+		const ObjectSnapshot& object = packet.objects[i];
+		ReplicationBaseline& baseline = _sendData._baselines[object.id];
+
+		// Packets may be acknowledged out of order
+		if (sequence > baseline.sequence)
+		{
+			baseline.state = object.state;
+			baseline.sequence = sequence;
+			baseline.acknowledged = true;
+		}
+	}
+
+	packet.sequence = 0;
+}
+
+void ObjectExchange::SendState(TcpSocket& socket, UdpSocket& snapshotSocket)
+{
+	bool snapshotReady = false;
+
+	{
+		Threading::ScopedLock lock(_exchangeMutex);
+
+		// Take the most recent snapshot, any older ones were never sent
+		if (_sendData._snapshotReady && _hasSnapshotAddress)
+		{
+			_sendData._newSnapshot.swap(_sendData._sendingSnapshot);
+			_sendData._newViews.swap(_sendData._sendingViews);
+			_sendData._sendingSnapshotTime = _sendData._newSnapshotTime;
+			_sendData._snapshotReady = false;
+			snapshotReady = true;
+		}
+	}
+
+	// Only the network thread touches the sending snapshot and baselines. Snapshots
+	// are never held back by the connection, a lost packet's objects are sent
+	// again in the next frame
+	if (snapshotReady)
+	{
+		SendSnapshot(snapshotSocket);
+	}
+
+	// Nothing more is queued until everything queued has been sent, so a slow
+	// connection batches messages rather than falling behind
+	if (!socket.HasQueuedData())
+	{
+		Threading::ScopedLock lock(_exchangeMutex);
+
+		if (!_snapshotPortSent)
+		{
+			Message message;
+			message.Append(SNAPSHOT_PORT);
+			message.Append(snapshotSocket.GetPort());
+			socket.Queue(message);
+
+			_snapshotPortSent = true;
+		}
+
+		if (_regionMessageQueued)
+		{
+			socket.Queue(_regionMessageOut);
+			_regionMessageQueued = false;
+		}
+
+		// The session master balances the regions using the load of every peer
+		if (!_relayUpdates && _loadReportTimer.GetTime() > LOAD_REPORT_INTERVAL)
+		{
+			Message message;
+			message.Append(PEER_LOAD);
+			message.Append((float)_stepTime);
+			socket.Queue(message);
+
+			_loadReportTimer.Start();
+		}
+
+		if (_objectMigrationOut.size() != 0)
+		{
+			Message message;
+			message.Reserve(sizeof(eMessageType) + _objectMigrationOut.size() * MAX_MIGRATION_RECORD_SIZE);
+			message.Append(OBJECT_MIGRATION);
+
+			// Every migration made since the last send goes in a single message
+			for (unsigned i = 0; i < _objectMigrationOut.size(); ++i)
+			{
+				message.Append((unsigned char)_objectMigrationOut[i].type);
+				message.Append(_objectMigrationOut[i].objectId);
+
+				if (_objectMigrationOut[i].type == OBJECT_OWNER_CHANGED)
+					message.Append((unsigned char)_objectMigrationOut[i].ownerId);
+			}
+
+			socket.Queue(message);
+			_objectMigrationOut.clear();
+		}
+
+		if (_impulsesOut.size() != 0)
+		{
+			Message message;
+			message.Reserve(sizeof(eMessageType) + _impulsesOut.size() * (sizeof(unsigned) + sizeof(float) * 4));
+			message.Append(CONTACT_IMPULSES);
+
+			for (unsigned i = 0; i < _impulsesOut.size(); ++i)
+			{
+				message.Append(_impulsesOut[i].objectId);
+				message.Append((float)_impulsesOut[i].velocity.x());
+				message.Append((float)_impulsesOut[i].velocity.y());
+				message.Append((float)_impulsesOut[i].position.x());
+				message.Append((float)_impulsesOut[i].position.y());
+			}
+
+			socket.Queue(message);
+			_impulsesOut.clear();
+		}
+	}
+
+	// Everything queued goes out in as few writes as the socket allows
+	socket.Flush();
+}
+
+void ObjectExchange::ExchangeUpdatesWithWorld()
+{
+	Threading::ScopedLock lock (_exchangeMutex);
+
+	if (_regionMapChanged)
+	{
+		ApplyRegionMap(_regionMapReceived);
+		_regionMapChanged = false;
+	}
+	
+	StoreNewPositionUpdates();
+	StoreContactImpulses();
+
+	ProcessReceivedPositionUpdates();
+	ProcessContactImpulses();
+
+	ProcessOwnershipRequests();
+
+	ProcessOwnershipConfirmations();
+}
+
+void ObjectExchange::GatherInitialisationData()
+{
+	unsigned numObjects = _world.GetNumObjects();
+	_initialisationDataOut._messagesQueued = 0;
+
+	// Our handle indices become the network ids
+	_objectsByNetworkId.clear();
+	_networkIdsByHandle.clear();
+	_lastReceivedObjectState.clear();
+
+	for (unsigned i = 0; i < numObjects; ++i)
+	{
+		Physics::PhysicsObject* object = _worldThread._world->GetObject(i);
+
+		unsigned networkId = object->GetHandle()._index;
+		MapNetworkId(networkId, object);
+
+		_lastReceivedObjectState[networkId].position = object->GetPosition();
+		_lastReceivedObjectState[networkId].velocity = object->GetVelocity();
+	}
+
+	// The remote peer is told its id and the regions of the session first
+	Message message;
+	message.Append(_remotePeerId);
+	message.Append(_peerId);
+	AppendRegionMap(message, _world.GetRegionMap());
+	message.Append(numObjects);
+
+	for (unsigned i = 0; i < numObjects; ++i)
+	{
+		Physics::PhysicsObject* object = _worldThread._world->GetObject(i);
+
+		// Parts are written straight after the blobby which owns them
+		if (object->GetParent() != NULL)
+			continue;
+
+		AppendInitialisationRecord(message, object);
+
+		if (object->GetSerializationType() == Physics::OBJECT_BLOBBY)
+		{
+			Physics::BlobbyObject* blobby = static_cast<Physics::BlobbyObject*>(object);
+
+			for (int j = 0; j < blobby->GetNumParts(); ++j)
+			{
+				AppendInitialisationRecord(message, blobby->GetPart(j));
+			}
+		}
+	}
+
+	_initialisationDataOut._messages.push_back(Message());
+	_initialisationDataOut._messages.back().Swap(message);
+}
+
+void ObjectExchange::AppendInitialisationRecord(Message& message, Physics::PhysicsObject* object)
+{
+	message.Append(object->GetSerializationType());
+	message.Append(GetNetworkId(object));
+	message.Append((double)object->GetPosition().x());
+	message.Append((double)object->GetPosition().y());
+	message.Append((double)object->GetVelocity().x());
+	message.Append((double)object->GetVelocity().y());
+	message.Append(object->GetColor().To32BitColor());
+	message.Append((double)object->GetMass());
+	message.Append(object->GetOwnerId());
+
+	if (object->GetSerializationType() == Physics::OBJECT_BLOBBY)
+	{
+		Physics::BlobbyObject* blobby = static_cast<Physics::BlobbyObject*>(object);
+
+		message.Append((unsigned)blobby->GetNumParts());
+		message.Append((double)blobby->GetStiffness());
+	}
+}
+
+void ObjectExchange::SendInitialisationData(TcpSocket& socket)
+{
+	// Updates are queued behind the initialisation data, so it only has to be queued
+	while (_initialisationDataOut._messagesQueued < _initialisationDataOut._messages.size())
+	{
+		socket.Queue(_initialisationDataOut._messages[_initialisationDataOut._messagesQueued]);
+		_initialisationDataOut._messagesQueued++;
+	}
+
+	socket.Flush();
+}
+
+bool ObjectExchange::InitialisationSent()
+{
+	return _initialisationDataOut._messagesQueued == _initialisationDataOut._messages.size();
+}
+
+void ObjectExchange::ReceiveInitialisationData(TcpSocket& socket)
+{
+	MessageView message;
 	while (socket.Receive(message) && socket.IsOpen())
 	{
 		if (_initialisationDataIn._objects.size() == 0)
 		{
 			int objectsToRead;
-			if (!message.Read(objectsToRead))
+			bool valid = true;
+
+			valid &= message.Read(_initialisationDataIn._peerId);
+			valid &= message.Read(_initialisationDataIn._remotePeerId);
+			valid &= ReadRegionMap(message, _initialisationDataIn._regionMap);
+			valid &= message.Read(objectsToRead);
+
+			valid &= _initialisationDataIn._peerId < RegionMap::MAX_PEERS && _initialisationDataIn._remotePeerId < RegionMap::MAX_PEERS;
+			valid &= objectsToRead >= 0 && objectsToRead <= MAX_INITIALISATION_OBJECTS;
+
+			if (!valid)
 			{
 				socket.Close();
 				return;
 			}
 
 			_initialisationDataIn._objectsRead = 0;
+			_initialisationDataIn._partsExpected = 0;
 			_initialisationDataIn._objects.resize(objectsToRead);
-
-			_lastReceivedObjectState.resize(objectsToRead);
 		}
 
 		while(_initialisationDataIn._objectsRead < _initialisationDataIn._objects.size() 
@@ -360,15 +961,46 @@ void ObjectExchange::ReceiveInitialisationData(TcpSocket& socket)
 			// Reading object type was successul so continue to read remainder of object
 			else
 			{
-				assert(objectInit.objectType != 0);
 				bool valid = true;
 
+				// Part records must directly follow their blobby, one for each part
+				if (objectInit.objectType == Physics::OBJECT_BLOBBY_PART)
+				{
+					valid &= _initialisationDataIn._partsExpected > 0;
+					_initialisationDataIn._partsExpected--;
+				}
+				else
+				{
+					valid &= _initialisationDataIn._partsExpected == 0;
+					valid &= objectInit.objectType == Physics::OBJECT_BOX
+						|| objectInit.objectType == Physics::OBJECT_TRIANGLE
+						|| objectInit.objectType == Physics::OBJECT_BLOBBY;
+				}
+
+				valid &= message.Read(objectInit.id);
 				valid &= message.Read(objectInit.x);
 				valid &= message.Read(objectInit.y);
 				valid &= message.Read(objectInit.vx);
 				valid &= message.Read(objectInit.vy);
 				valid &= message.Read(objectInit.color);
 				valid &= message.Read(objectInit.mass);
+				valid &= message.Read(objectInit.ownerId);
+
+				objectInit.numParts = 0;
+				objectInit.stiffness = 0;
+
+				if (objectInit.objectType == Physics::OBJECT_BLOBBY)
+				{
+					valid &= message.Read(objectInit.numParts);
+					valid &= message.Read(objectInit.stiffness);
+
+					valid &= objectInit.numParts >= Physics::BlobbyObject::MIN_NUM_PARTS
+						&& objectInit.numParts <= Physics::BlobbyObject::MAX_NUM_PARTS;
+
+					_initialisationDataIn._partsExpected = objectInit.numParts;
+				}
+
+				valid &= objectInit.ownerId < RegionMap::MAX_PEERS;
 
 				if (!valid)
 				{
@@ -382,6 +1014,13 @@ void ObjectExchange::ReceiveInitialisationData(TcpSocket& socket)
 
 		if (_initialisationDataIn._objects.size() == _initialisationDataIn._objectsRead)
 		{
+			// The last blobby is missing some of its parts
+			if (_initialisationDataIn._partsExpected != 0)
+			{
+				socket.Close();
+				return;
+			}
+
 			Threading::ScopedLock lock (_exchangeMutex);
 			_initialisationDataIn._initialisationReceived = true;
 			return;
@@ -398,7 +1037,26 @@ void ObjectExchange::ExchangeInitialisation()
 {
 	Threading::ScopedLock lock (_exchangeMutex);
 
-	_world.ClearObjects();
+	SetPeerIds(_initialisationDataIn._peerId, _initialisationDataIn._remotePeerId);
+	ApplyRegionMap(_initialisationDataIn._regionMap);
+
+	// If the world already holds the same objects, such as when rejoining a
+	// session, update them in place rather than rebuilding the world
+	bool reuseObjects = InitialisationMatchesWorld();
+
+	if (!reuseObjects)
+	{
+		_world.ClearObjects();
+	}
+
+	_objectsByNetworkId.clear();
+	_networkIdsByHandle.clear();
+	_lastReceivedObjectState.clear();
+
+	// The blobby whose part records are currently being read
+	Physics::BlobbyObject* blobby = NULL;
+	int blobbyPart = 0;
+	int objectIndex = 0;
 
 	for (unsigned i = 0; i < _initialisationDataIn._objects.size(); ++i)
 	{
@@ -408,141 +1066,737 @@ void ObjectExchange::ExchangeInitialisation()
 		switch (objectInit.objectType)
 		{
 		case Physics::OBJECT_BOX:
-			object = _world.AddBox();
+			object = reuseObjects ? _world.GetObject(objectIndex++) : _world.AddBox();
 			break;
 
 		case Physics::OBJECT_TRIANGLE:
-			object = _world.AddTriangle();
+			object = reuseObjects ? _world.GetObject(objectIndex++) : _world.AddTriangle();
 			break;
 
 		case Physics::OBJECT_BLOBBY:
-			object = _world.AddBlobbyObject();
+			// The parts are created with the blobby object, the records following
+			// this one are applied to them
+			if (reuseObjects)
+			{
+				// In the world the parts come before their blobby
+				objectIndex += objectInit.numParts;
+				blobby = static_cast<Physics::BlobbyObject*>(_world.GetObject(objectIndex++));
+			}
+			else
+			{
+				blobby = _world.AddBlobbyObject(objectInit.numParts, objectInit.stiffness);
+			}
+
+			blobbyPart = 0;
+			object = blobby;
+			break;
 
-			// When we find a blobby object it should be preceded by a sequence of blobby parts
-			// which are created with the blobby object and so need to be updated
-			for (int j = 0; j < 16; j++)
+		case Physics::OBJECT_BLOBBY_PART:
+			if (blobby != NULL && blobbyPart < blobby->GetNumParts())
 			{
-				const ObjectInitialisation& blobbyPartInit = _initialisationDataIn._objects[i-Physics::BlobbyObject::NUM_PARTS+j];
-				assert(blobbyPartInit.objectType == Physics::OBJECT_BLOBBY_PART);
-				
-				Physics::PhysicsObject* blobbyPart = _world.GetObject(_world.GetNumObjects() - Physics::BlobbyObject::NUM_PARTS + j - 1);
-				assert(blobbyPart->GetSerializationType() == Physics::OBJECT_BLOBBY_PART);
-
-				blobbyPart->SetPosition(Vector2d(blobbyPartInit.x, blobbyPartInit.y));
-				blobbyPart->SetVelocity(Vector2d(blobbyPartInit.vx, blobbyPartInit.vy));
-				blobbyPart->SetMass(blobbyPartInit.mass);
-				blobbyPart->SetColor(Color(objectInit.color));
+				object = blobby->GetPart(blobbyPart);
+				blobbyPart++;
 			}
 			break;
 		}
 
+		// ReceiveInitialisationData rejects part records that don't belong to a
+		// blobby, so only a world mismatch when reusing objects leaves this NULL
 		if (object != NULL)
 		{
-			object->SetPosition(Vector2d(objectInit.x, objectInit.y));
-			object->SetVelocity(Vector2d(objectInit.vx, objectInit.vy));
-			object->SetMass(objectInit.mass);
+			object->SetPosition(Vector2r(Vector2d(objectInit.x, objectInit.y)));
+			object->SetVelocity(Vector2r(Vector2d(objectInit.vx, objectInit.vy)));
+			object->SetMass((Real)objectInit.mass);
 			object->SetColor(Color(objectInit.color));
-			object->UpdateShape(*_worldThread._world);
+			object->SetOwnerId(objectInit.ownerId);
+
+			MapNetworkId(objectInit.id, object);
+
+			_lastReceivedObjectState[objectInit.id].position = object->GetPosition();
+			_lastReceivedObjectState[objectInit.id].velocity = object->GetVelocity();
+		}
+	}
+
+	_initialisationDataIn._objects.clear();
+}
+
+bool ObjectExchange::InitialisationMatchesWorld()
+{
+	const std::vector<ObjectInitialisation>& objects = _initialisationDataIn._objects;
+
+	if ((int)objects.size() != _world.GetNumObjects())
+		return false;
+
+	int objectIndex = 0;
+
+	for (unsigned i = 0; i < objects.size(); ++i)
+	{
+		const ObjectInitialisation& objectInit = objects[i];
+
+		// Parts are checked along with their blobby
+		if (objectInit.objectType == Physics::OBJECT_BLOBBY_PART)
+			continue;
+
+		if (objectInit.objectType == Physics::OBJECT_BLOBBY)
+		{
+			objectIndex += objectInit.numParts;
+
+			if (objectIndex >= _world.GetNumObjects())
+				return false;
+
+			Physics::PhysicsObject* object = _world.GetObject(objectIndex);
+
+			if (object->GetSerializationType() != Physics::OBJECT_BLOBBY)
+				return false;
+
+			Physics::BlobbyObject* blobby = static_cast<Physics::BlobbyObject*>(object);
+
+			if (blobby->GetNumParts() != (int)objectInit.numParts || blobby->GetStiffness() != objectInit.stiffness)
+				return false;
+
+			// Removing objects can move parts away from their blobby
+			for (int j = 0; j < blobby->GetNumParts(); ++j)
+			{
+				if (blobby->GetPart(j)->GetId() != objectIndex - blobby->GetNumParts() + j)
+					return false;
+			}
+		}
+		else if (_world.GetObject(objectIndex)->GetSerializationType() != objectInit.objectType)
+		{
+			return false;
+		}
+
+		objectIndex++;
+	}
+
+	return true;
+}
+
+void ObjectExchange::FindInterestingObjects()
+{
+	_sendData._interestingObjects.assign(_world.GetNumObjects(), false);
+
+	const RegionMap& regionMap = _world.GetRegionMap();
+	const Vector2d margin(INTEREST_MARGIN, INTEREST_MARGIN);
+
+	for (unsigned i = 0; i < regionMap.GetNumRegions(); ++i)
+	{
+		unsigned peerId = regionMap.GetPeer(i);
+
+		// The session master passes our updates on to every other peer
+		if (_relayUpdates ? peerId != _remotePeerId : peerId == _peerId)
+			continue;
+
+		AABB region = regionMap.GetRegionBounds(i);
+		_world.MarkObjectsInArea(AABB(region.Min() - margin, region.Max() + margin), _sendData._interestingObjects);
+
+		// Objects the peer can see are kept smooth even when far from its region
+		AABB view;
+		if (_world.GetPeerBounds(peerId, view))
+			_world.MarkObjectsInArea(view, _sendData._interestingObjects);
+	}
+}
+
+void ObjectExchange::FindHaloObjects()
+{
+	_updateData._haloObjects.assign(_world.GetNumObjects(), false);
+
+	const RegionMap& regionMap = _world.GetRegionMap();
+	const Vector2d margin(INTEREST_MARGIN, INTEREST_MARGIN);
+
+	for (unsigned i = 0; i < regionMap.GetNumRegions(); ++i)
+	{
+		if (regionMap.GetPeer(i) != _peerId)
+			continue;
+
+		AABB region = regionMap.GetRegionBounds(i);
+		_world.MarkObjectsInArea(AABB(region.Min() - margin, region.Max() + margin), _updateData._haloObjects);
+	}
+}
+
+void ObjectExchange::StoreNewPositionUpdates()
+{
+	_sendData._newSnapshot.clear();
+	_sendData._newViews.clear();
+
+	_stepTime = _worldThread.GetSolveTime();
+
+	PeerView view;
+	view.peerId = _peerId;
+	_world.GetClientBounds(view.bounds);
+	_sendData._newViews.push_back(view);
+
+	// The session master passes on the views of the other peers
+	if (_relayUpdates)
+	{
+		for (unsigned i = 0; i < RegionMap::MAX_PEERS; ++i)
+		{
+			view.peerId = i;
+
+			if (i != _peerId && i != _remotePeerId && _world.GetPeerBounds(i, view.bounds))
+				_sendData._newViews.push_back(view);
+		}
+	}
+
+	FindInterestingObjects();
+	_sendData._newSnapshotTime = _clock.GetTime();
+
+	ObjectSnapshot snapshot;
+
+	// Objects are captured in network id order so ids can be sent as gaps.
+	// Objects added since initialisation are unknown to the remote peer
+	for (unsigned i = 0; i < _objectsByNetworkId.size(); ++i)
+	{
+		Physics::PhysicsObject* object = GetObjectByNetworkId(i);
+
+		if (object == NULL || !SendsUpdatesFor(object))
+			continue;
+
+		snapshot.interesting = _sendData._interestingObjects[object->GetId()];
+
+		snapshot.id = i;
+		Quantise(object->GetPosition(), object->GetVelocity(), snapshot.state);
+		_sendData._newSnapshot.push_back(snapshot);
+
+		_lastReceivedObjectState[i].position = object->GetPosition();
+		_lastReceivedObjectState[i].velocity = object->GetVelocity();
+	}
+
+	_sendData._snapshotReady = true;
+}
+
+void ObjectExchange::StoreContactImpulses()
+{
+	const Physics::ContactImpulseList& impulses = _world.GetContactImpulses();
+
+	// Impulses go to the peer which owns the object, through the session master
+	for (unsigned i = 0; i < impulses.size(); ++i)
+	{
+		Physics::PhysicsObject* object = _world.GetObject(impulses[i]._object);
+
+		if (!ReceivesUpdatesFor(object))
+			continue;
+
+		ObjectImpulse impulse;
+		impulse.objectId = GetNetworkId(object);
+		impulse.velocity = impulses[i]._velocity;
+		impulse.position = impulses[i]._position;
+
+		if (impulse.objectId == INVALID_NETWORK_ID)
+			continue;
+
+		_impulsesOut.push_back(impulse);
+
+		SentImpulse sent;
+		sent.impulse = impulse;
+		sent.time = _clock.GetTime();
+		_impulsesSent.push_back(sent);
+	}
+}
+
+void ObjectExchange::SendSnapshot(UdpSocket& socket)
+{
+	const std::vector<ObjectSnapshot>& snapshot = _sendData._sendingSnapshot;
+	std::vector<ReplicationBaseline>& baselines = _sendData._baselines;
+
+	_sendData._frame++;
+	_sendData._changedObjects.clear();
+
+	if (!snapshot.empty() && snapshot.back().id >= baselines.size())
+	{
+		ReplicationBaseline unsent = { { { 0, 0, 0, 0 } }, 0, false, 0 };
+		baselines.resize(snapshot.back().id + 1, unsent);
+	}
+
+	const int tolerance[QuantisedState::NUM_COMPONENTS] =
+	{
+		POSITION_TOLERANCE, POSITION_TOLERANCE, VELOCITY_TOLERANCE, VELOCITY_TOLERANCE,
+	};
+
+	// Find the objects which have moved far enough from the state the remote peer acknowledged
+	for (unsigned i = 0; i < snapshot.size(); ++i)
+	{
+		ReplicationBaseline& baseline = baselines[snapshot[i].id];
+
+		// Objects we have just started sending have been moved by another peer
+		// since the remote peer acknowledged them, so are sent even if they are
+		// deferred until a packet holding them is acknowledged
+		if (baseline.ownedFrame == 0 || baseline.ownedFrame + 1 != _sendData._frame)
+		{
+			baseline.sequence = _sendData._sequence;
+			baseline.acknowledged = false;
+		}
+
+		bool changed = !baseline.acknowledged;
+
+		// Far objects are spread over the frames by id, rather than all being
+		// sent together. Frames are counted as they are sent, snapshots the
+		// network thread didn't get to in time would skip some ids' turns
+		bool deferred = !snapshot[i].interesting && (_sendData._frame + snapshot[i].id) % FAR_UPDATE_INTERVAL != 0;
+
+		if (deferred && !changed)
+			continue;
+
+		for (int c = 0; c < QuantisedState::NUM_COMPONENTS && !changed; ++c)
+		{
+			int delta = (int)snapshot[i].state.components[c] - (int)baseline.state.components[c];
+			changed = abs(delta) > tolerance[c];
+		}
+
+		if (changed)
+		{
+			_sendData._changedObjects.push_back(i);
+		}
+	}
+
+	for (unsigned i = 0; i < snapshot.size(); ++i)
+	{
+		baselines[snapshot[i].id].ownedFrame = _sendData._frame;
+	}
+
+	const std::vector<PeerView>& views = _sendData._sendingViews;
+
+	// The remote peer's time stamp is echoed back moved on by how long we have held it
+	float echoTime = -1;
+
+	if (_updateData._hasRemoteTime)
+		echoTime = (float)(_updateData._remoteTime + _clock.GetTime() - _updateData._remoteTimeArrival);
+
+	// Records are counted at their largest size, so the packets needed are
+	// known before the first is sent. The first packet also holds the views
+	const unsigned recordSpace = MAX_SNAPSHOT_PACKET_SIZE - SNAPSHOT_HEADER_SIZE;
+	const unsigned firstCapacity = (recordSpace - views.size() * VIEW_RECORD_SIZE) / MAX_OBJECT_RECORD_SIZE;
+	const unsigned capacity = recordSpace / MAX_OBJECT_RECORD_SIZE;
+	const unsigned numChanged = _sendData._changedObjects.size();
+
+	unsigned numPackets = 1;
+
+	if (numChanged > firstCapacity)
+		numPackets += (numChanged - firstCapacity + capacity - 1) / capacity;
+
+	unsigned next = 0;
+
+	// Every frame sends at least one packet, which carries our view and acks
+	do
+	{
+		unsigned sequence = ++_sendData._sequence;
+		SentPacket& sent = _sendData._sentPackets[sequence % SENT_PACKET_HISTORY];
+		sent.sequence = sequence;
+		sent.objects.clear();
+
+		Message packet;
+		packet.Reserve(MAX_SNAPSHOT_PACKET_SIZE);
+
+		packet.Append(OBJECT_UPDATES);
+		packet.Append(sequence);
+		packet.Append(_updateData._sequence);
+		packet.Append(_updateData._ackBits);
+		packet.Append(_sendData._frame);
+		packet.Append((unsigned short)numPackets);
+		packet.Append((float)_sendData._sendingSnapshotTime);
+		packet.Append(echoTime);
+
+		// Views are only sent with the first packet of the frame
+		unsigned numViews = next == 0 ? views.size() : 0;
+		packet.Append((unsigned char)numViews);
+
+		for (unsigned i = 0; i < numViews; ++i)
+		{
+			const AABB& bounds = views[i].bounds;
+			packet.Append((unsigned char)views[i].peerId);
+			packet.Append((float)bounds.Min().x());
+			packet.Append((float)bounds.Min().y());
+			packet.Append((float)bounds.Max().x());
+			packet.Append((float)bounds.Max().y());
+		}
+
+		unsigned space = next == 0 ? firstCapacity : capacity;
+		unsigned numObjects = Util::Min<unsigned>(space, numChanged - next);
+		packet.Append((unsigned short)numObjects);
+
+		unsigned lastId = 0;
+
+		for (unsigned i = 0; i < numObjects; ++i)
+		{
+			const ObjectSnapshot& object = snapshot[_sendData._changedObjects[next++]];
+
+			AppendObjectRecord(packet, object, sequence, lastId);
+			sent.objects.push_back(object);
+		}
+
+		socket.SendTo(_snapshotAddress, packet);
+
+	} while (next < numChanged);
+}
+
+void ObjectExchange::AppendObjectRecord(Message& message, const ObjectSnapshot& object, unsigned sequence, unsigned& lastId)
+{
+	const ReplicationBaseline& baseline = _sendData._baselines[object.id];
+
+	// The remote peer keeps the states from its last SENT_PACKET_HISTORY packets
+	bool hasBaseline = baseline.acknowledged && sequence - baseline.sequence < SENT_PACKET_HISTORY;
+
+	unsigned char flags = 0;
+	int delta[QuantisedState::NUM_COMPONENTS];
+
+	// Only components which differ from the baseline are sent, as an 8 bit
+	// delta if they are close enough and otherwise in full
+	for (int c = 0; c < QuantisedState::NUM_COMPONENTS; ++c)
+	{
+		delta[c] = hasBaseline ? (int)object.state.components[c] - (int)baseline.state.components[c] : 0;
+
+		if (!hasBaseline || delta[c] != 0)
+			flags |= 1 << (COMPONENT_PRESENT_SHIFT + c);
+
+		if (hasBaseline && delta[c] != 0 && delta[c] >= -128 && delta[c] <= 127)
+			flags |= 1 << (COMPONENT_DELTA_SHIFT + c);
+	}
+
+	message.Append(flags);
+
+	unsigned gap = object.id - lastId;
+
+	if (gap < ID_GAP_ESCAPE)
+	{
+		message.Append((unsigned short)gap);
+	}
+	else
+	{
+		message.Append((unsigned short)ID_GAP_ESCAPE);
+		message.Append(object.id);
+	}
+
+	lastId = object.id;
+
+	if (flags != FULL_RECORD_FLAGS)
+	{
+		message.Append((unsigned char)(sequence - baseline.sequence));
+	}
+
+	for (int c = 0; c < QuantisedState::NUM_COMPONENTS; ++c)
+	{
+		if ((flags & (1 << (COMPONENT_DELTA_SHIFT + c))) != 0)
+			message.Append((signed char)delta[c]);
+		else if ((flags & (1 << (COMPONENT_PRESENT_SHIFT + c))) != 0)
+			message.Append(object.state.components[c]);
+	}
+}
+
+bool ObjectExchange::ReadObjectRecord(MessageView& message, unsigned sequence, ObjectSnapshot& record, unsigned& lastId)
+{
+	bool valid = true;
+
+	unsigned char flags = 0;
+	valid &= message.Read(flags);
+
+	unsigned short gap = 0;
+	valid &= message.Read(gap);
+
+	if (valid && gap == ID_GAP_ESCAPE)
+	{
+		valid &= message.Read(record.id);
+	}
+	else
+	{
+		record.id = lastId + gap;
+	}
+
+	// Ids must be ascending within a packet
+	valid &= record.id >= lastId;
+
+	if (valid && flags != FULL_RECORD_FLAGS)
+	{
+		unsigned char offset = 0;
+		valid &= message.Read(offset);
+		valid &= offset > 0 && FindReceivedState(sequence - offset, record.id, record.state);
+	}
+
+	for (int c = 0; c < QuantisedState::NUM_COMPONENTS && valid; ++c)
+	{
+		if ((flags & (1 << (COMPONENT_DELTA_SHIFT + c))) != 0)
+		{
+			signed char delta;
+			valid &= message.Read(delta);
+			record.state.components[c] = (unsigned short)(record.state.components[c] + delta);
+		}
+		else if ((flags & (1 << (COMPONENT_PRESENT_SHIFT + c))) != 0)
+		{
+			valid &= message.Read(record.state.components[c]);
 		}
 	}
 
-	_initialisationDataIn._objects.clear();
-	_updateData._objectsRead = 0;
+	if (!valid)
+		return false;
+
+	lastId = record.id;
+
+	return true;
+}
+
+bool ObjectExchange::FindReceivedState(unsigned sequence, unsigned id, QuantisedState& state) const
+{
+	const ReceivedPacket& packet = _updateData._receivedPackets[sequence % SENT_PACKET_HISTORY];
+
+	if (packet.sequence != sequence)
+		return false;
+
+	ObjectSnapshot key;
+	key.id = id;
+
+	std::vector<ObjectSnapshot>::const_iterator found = std::lower_bound(packet.objects.begin(), packet.objects.end(), key, SnapshotIdLess);
+
+	if (found == packet.objects.end() || found->id != id)
+		return false;
+
+	state = found->state;
+	return true;
+}
+
+bool ObjectExchange::SnapshotIdLess(const ObjectSnapshot& a, const ObjectSnapshot& b)
+{
+	return a.id < b.id;
+}
+
+void ObjectExchange::Quantise(const Vector2r& position, const Vector2r& velocity, QuantisedState& state) const
+{
+	const Vector2d& worldMin = _world.GetWorldMin();
+	const Vector2d& worldMax = _world.GetWorldMax();
+
+	double value[QuantisedState::NUM_COMPONENTS] =
+	{
+		(position.x() - worldMin.x()) / (worldMax.x() - worldMin.x()),
+		(position.y() - worldMin.y()) / (worldMax.y() - worldMin.y()),
+		(velocity.x() + MAX_REPLICATED_SPEED) / (2 * MAX_REPLICATED_SPEED),
+		(velocity.y() + MAX_REPLICATED_SPEED) / (2 * MAX_REPLICATED_SPEED),
+	};
+
+	// Velocities faster than the replicated range are clamped
+	for (int c = 0; c < QuantisedState::NUM_COMPONENTS; ++c)
+	{
+		state.components[c] = (unsigned short)(Util::Clamp(value[c], 0.0, 1.0) * QUANTISED_MAX + 0.5);
+	}
+}
+
+void ObjectExchange::Dequantise(const QuantisedState& state, ObjectState& object) const
+{
+	const Vector2d& worldMin = _world.GetWorldMin();
+	const Vector2d& worldMax = _world.GetWorldMax();
+
+	double value[QuantisedState::NUM_COMPONENTS];
+
+	for (int c = 0; c < QuantisedState::NUM_COMPONENTS; ++c)
+	{
+		value[c] = (double)state.components[c] / QUANTISED_MAX;
+	}
+
+	object.x = worldMin.x() + value[QuantisedState::X] * (worldMax.x() - worldMin.x());
+	object.y = worldMin.y() + value[QuantisedState::Y] * (worldMax.y() - worldMin.y());
+	object.vx = (value[QuantisedState::VX] * 2 - 1) * MAX_REPLICATED_SPEED;
+	object.vy = (value[QuantisedState::VY] * 2 - 1) * MAX_REPLICATED_SPEED;
+}
+
+bool ObjectExchange::ReceivesUpdatesFor(Physics::PhysicsObject* object)
+{
+	// The session master passes on the objects of every other peer
+	if (_relayUpdates)
+		return object->GetOwnerId() == _remotePeerId;
+
+	return object->GetOwnerId() != _peerId;
+}
+
+bool ObjectExchange::SendsUpdatesFor(Physics::PhysicsObject* object)
+{
+	if (_relayUpdates)
+		return object->GetOwnerId() != _remotePeerId;
+
+	return object->GetOwnerId() == _peerId;
 }
 
-void ObjectExchange::StoreNewPositionUpdates()
+void ObjectExchange::ChangeOwner(Physics::PhysicsObject* object, unsigned networkId, unsigned ownerId)
 {
-	_sendData._newState.clear();
+	object->SetOwnerId(ownerId);
 
-	int numObjects = _worldThread._world->GetNumObjects();
-
-	// TODO: cache this somewhere
-	int numObjectsOwned = 0;
-	for (int i = 0; i < numObjects; ++i)
+	// Every migration goes through the session master, which tells the other peers
+	if (_relayUpdates)
 	{
-		if (_peerId == _world.GetObject(i)->GetOwnerId())
-		{
-			numObjectsOwned++;
-		}
+		ObjectMigration change;
+		change.type = OBJECT_OWNER_CHANGED;
+		change.objectId = networkId;
+		change.ownerId = ownerId;
+
+		_ownershipChanges.push_back(change);
 	}
+}
 
-	const int objectStride = sizeof(unsigned) * 1 + sizeof(double) * 4;
+bool ObjectExchange::ShouldRequest(const RegionMap& regionMap, const Vector2d& position)
+{
+	Vector2d band(MIGRATION_HYSTERESIS, 0);
 
-	Message message;
-	message.Append(OBJECT_UPDATES);
-	message.Append(numObjectsOwned);
+	// Regions are vertical strips, so the object is clear of the boundaries
+	// if the points either side of it are in the same region
+	unsigned left = regionMap.GetPeerForPoint(position - band);
+	unsigned right = regionMap.GetPeerForPoint(position + band);
 
-	AABB clientBounds;
-	_world.GetClientBounds(clientBounds);
+	// The session master takes the objects which have left the remote peer's region
+	if (_relayUpdates)
+		return left != _remotePeerId && right != _remotePeerId;
 
-	message.Append((float)clientBounds.Min().x());
-	message.Append((float)clientBounds.Min().y());
-	message.Append((float)clientBounds.Max().x());
-	message.Append((float)clientBounds.Max().y());
+	return left == _peerId && right == _peerId;
+}
 
-	int sent = 0;
-	int appended = 0;
-	for (int i = 0; i < numObjects; ++i)
-	{
-		// If another object can't fit into the message, add it onto the list
-		// and start building another message
-		if (message.Size() + objectStride > Message::MAX_BUFFER_SIZE)
-		{
-			_sendData._newState.push_back(message);
-			assert(message.Size() != 6);
-			sent = appended;
-			message.Clear();
-			message.Append(OBJECT_UPDATES);
-		}
+bool ObjectExchange::CanRequest(unsigned networkId)
+{
+	return networkId >= _requestRetryTimes.size() || _clock.GetTime() >= _requestRetryTimes[networkId];
+}
 
-		Physics::PhysicsObject* object = _world.GetObject(i);
+void ObjectExchange::RequestObject(unsigned networkId)
+{
+	if (networkId >= _requestRetryTimes.size())
+		_requestRetryTimes.resize(networkId + 1, 0);
 
-		if (object->GetOwnerId() == _peerId)
-		{
-			message.Append(i);
-			message.Append(object->GetPosition().x());
-			message.Append(object->GetPosition().y());
-			message.Append(object->GetVelocity().x());
-			message.Append(object->GetVelocity().y());
+	_requestRetryTimes[networkId] = _clock.GetTime() + REQUEST_TIMEOUT;
+
+	ObjectMigration migration;
+	migration.type = OBJECT_REQUEST;
+	migration.objectId = networkId;
+	migration.ownerId = 0;
 
-			_lastReceivedObjectState[i].position = object->GetPosition();
-			_lastReceivedObjectState[i].velocity = object->GetVelocity();
+	_objectMigrationOut.push_back(migration);
+}
 
-			appended++;
-		}
+void ObjectExchange::ProcessReceivedPositionUpdates()
+{
+	for (unsigned i = 0; i < _updateData._viewsUpdate.size(); ++i)
+	{
+		if (_updateData._viewsUpdate[i].peerId != _peerId)
+			_world.SetPeerBounds(_updateData._viewsUpdate[i].peerId, _updateData._viewsUpdate[i].bounds);
 	}
 
-	// If there are some objects left over that don't make a complete message, send it
-	if (sent != numObjectsOwned)
+	_updateData._viewsUpdate.clear();
+
+	if (_updateData._objectsUpdate.size() == 0)
 	{
-		_sendData._newState.push_back(message);
-		assert(message.Size() != 6);
+		HoldUnsentObjects();
+		return;
 	}
-}
 
-void ObjectExchange::ProcessReceivedPositionUpdates()
-{
-	_world.SetPeerBounds(_updateData._peerBoundsUpdate);
+	// Objects which may touch ours are moved on by the age of the frame, so our
+	// contacts are solved against where the owner has them now
+	FindHaloObjects();
+	double frameAge = _latency + _clock.GetTime() - _updateData._frameArrival;
+	Real age = (Real)(frameAge * _world.GetSimSpeed());
+
+	// Impulses sent before this reached the owner before the frame was taken
+	double includedTime = _clock.GetTime() - frameAge - _latency;
+
+	while (!_impulsesSent.empty() && _impulsesSent.front().time <= includedTime)
+	{
+		_impulsesSent.pop_front();
+	}
+
+	_updateData._updatedObjects.assign(_objectsByNetworkId.size(), false);
 
 	// Process position updates
 	for (unsigned i = 0; i < _updateData._objectsUpdate.size(); ++i)
 	{
-		// TODO: check object is not owned by us first?
 		const ObjectState& objectState = _updateData._objectsUpdate[i];
-		Physics::PhysicsObject* object = _world.GetObject(objectState.id);
+		Physics::PhysicsObject* object = GetObjectByNetworkId(objectState.id);
+
+		// The object may have been removed, or the update may have been sent
+		// before we took ownership of it
+		if (object == NULL || !ReceivesUpdatesFor(object))
+			continue;
 
-		Vector2d position (objectState.x, objectState.y);
-		Vector2d velocity (objectState.vx, objectState.vy);
+		Vector2r position (Vector2d(objectState.x, objectState.y));
+		Vector2r velocity (Vector2d(objectState.vx, objectState.vy));
 		
-		object->SetPosition(position);
+		if (_updateData._haloObjects[object->GetId()])
+		{
+			object->SetPosition(MulAdd(position, velocity, age));
+		}
+		else
+		{
+			object->SetPosition(position);
+		}
+
 		object->SetVelocity(velocity);
 
 		_lastReceivedObjectState[objectState.id].position = position;
 		_lastReceivedObjectState[objectState.id].velocity = velocity;
+
+		_updateData._updatedObjects[objectState.id] = true;
+	}
+
+	for (unsigned i = 0; i < _impulsesSent.size(); ++i)
+	{
+		const ObjectImpulse& impulse = _impulsesSent[i].impulse;
+
+		if (!_updateData._updatedObjects[impulse.objectId])
+			continue;
+
+		Physics::PhysicsObject* object = GetObjectByNetworkId(impulse.objectId);
+		object->SetVelocity(object->GetVelocity() + impulse.velocity);
+		object->SetPosition(object->GetPosition() + impulse.position);
 	}
 
 	// Clear these updates to be sure we don't apply them again
 	_updateData._objectsUpdate.clear();
+
+	HoldUnsentObjects();
+}
+
+void ObjectExchange::HoldUnsentObjects()
+{
+	// The remote peer stops sending objects which have come to rest, if we kept
+	// integrating them they would fall with nothing beneath them, as we don't
+	// solve the contacts of objects we don't own
+	for (unsigned i = 0; i < _objectsByNetworkId.size(); ++i)
+	{
+		Physics::PhysicsObject* object = GetObjectByNetworkId(i);
+
+		if (object == NULL || !ReceivesUpdatesFor(object))
+			continue;
+
+		unsigned frame = i < _updateData._objectFrames.size() ? _updateData._objectFrames[i] : 0;
+
+		// Objects in a later frame which is still arriving are moving
+		if (frame >= _updateData._completeFrame)
+		{
+			object->SetHeld(false);
+		}
+		else if (!object->IsHeld())
+		{
+			// Undo the integration since the object was last sent
+			object->SetPosition(_lastReceivedObjectState[i].position);
+			object->SetVelocity(_lastReceivedObjectState[i].velocity);
+			object->SetHeld(true);
+		}
+	}
+}
+
+void ObjectExchange::ProcessContactImpulses()
+{
+	for (unsigned i = 0; i < _impulsesIn.size(); ++i)
+	{
+		const ObjectImpulse& impulse = _impulsesIn[i];
+		Physics::PhysicsObject* object = GetObjectByNetworkId(impulse.objectId);
+
+		if (object == NULL)
+			continue;
+
+		if (object->GetOwnerId() == _peerId)
+		{
+			object->SetVelocity(object->GetVelocity() + impulse.velocity);
+			object->SetPosition(object->GetPosition() + impulse.position);
+		}
+		// The session master passes on impulses for objects owned by the other peers
+		else if (_relayUpdates)
+		{
+			_forwardedImpulses.push_back(impulse);
+		}
+	}
+
+	_impulsesIn.clear();
 }
 
 void ObjectExchange::ProcessOwnershipConfirmations()
@@ -550,32 +1804,55 @@ void ObjectExchange::ProcessOwnershipConfirmations()
 	// Take ownership of objects we received confirmation for
 	for (unsigned i = 0; i < _objectMigrationIn.size(); ++i)
 	{
-		Physics::PhysicsObject* object = _world.GetObject(_objectMigrationIn[i].objectId);
+		ObjectMigration& migration = _objectMigrationIn[i];
+		Physics::PhysicsObject* object = GetObjectByNetworkId(migration.objectId);
 
-		if (_objectMigrationIn[i].type == OBJECT_REQUEST)
+		if (object == NULL)
 		{
-			unsigned otherId = 0;
-			if (_peerId == 0) otherId = 1;
-
-			// Acknowledge migration request of object can migrate or the object
-			// does not have the spring attached
-			if (object->CanMigrate() && object != _world.GetSelectedObject())
+			// Deny requests for removed objects so the remote peer stops asking
+			if (migration.type == OBJECT_REQUEST)
+			{
+				migration.type = OBJECT_REQUEST_DENY;
+				_objectMigrationOut.push_back(migration);
+			}
+		}
+		else if (migration.type == OBJECT_REQUEST)
+		{
+			// Acknowledge migration request if we own the object, it can migrate
+			// and it does not have the spring attached. Objects owned by another
+			// peer are passed on by the session master once it has them
+			if (object->GetOwnerId() == _peerId && object->CanMigrate() && object != _world.GetSelectedObject())
 			{
-				object->SetOwnerId(otherId);
+				ChangeOwner(object, migration.objectId, _remotePeerId);
 			
-				_objectMigrationIn[i].type = OBJECT_REQUEST_ACK;
-				_objectMigrationOut.push_back(_objectMigrationIn[i]);
+				migration.type = OBJECT_REQUEST_ACK;
+				_objectMigrationOut.push_back(migration);
 			}
 			else
 			{
-				_objectMigrationIn[i].type = OBJECT_REQUEST_DENY;
-				_objectMigrationOut.push_back(_objectMigrationIn[i]);
+				migration.type = OBJECT_REQUEST_DENY;
+				_objectMigrationOut.push_back(migration);
 			}
 
 		}
-		else if (_objectMigrationIn[i].type == OBJECT_REQUEST_ACK)
+		else if (migration.type == OBJECT_REQUEST_ACK)
+		{
+			ChangeOwner(object, migration.objectId, _peerId);
+
+			if (migration.objectId < _requestRetryTimes.size())
+				_requestRetryTimes[migration.objectId] = 0;
+		}
+		else if (migration.type == OBJECT_REQUEST_DENY)
+		{
+			if (migration.objectId < _requestRetryTimes.size())
+				_requestRetryTimes[migration.objectId] = _clock.GetTime() + DENIED_RETRY_INTERVAL;
+		}
+		else if (migration.type == OBJECT_OWNER_CHANGED)
 		{
-			object->SetOwnerId(_peerId);
+			// A change giving us the object arrives after its acknowledgement,
+			// and one taking away an object we own is out of date
+			if (object->GetOwnerId() != _peerId && migration.ownerId != _peerId)
+				object->SetOwnerId(migration.ownerId);
 		}
 	}
 
@@ -584,24 +1861,34 @@ void ObjectExchange::ProcessOwnershipConfirmations()
 
 void ObjectExchange::ProcessOwnershipRequests()
 {
-	ObjectMigration migration;
-	migration.type = OBJECT_REQUEST;
-
-	// Make requests for any object in our side of the world
-	for (int i = 0; i < _world.GetNumObjects(); ++i)
+	const RegionMap& regionMap = _world.GetRegionMap();
+
+	// Make requests for any object the remote peer sends us which is in our
+	// region. The session master also requests objects which have left the
+	// region of the remote peer, so it can pass them on to the peer whose
+	// region they have entered. Each object is only requested once until
+	// its request is answered.
+	// Each tick's batch carries on searching from where the last one stopped,
+	// so a boundary moving past many objects hands them over a batch at a time
+	int numObjects = _world.GetNumObjects();
+	int numRequests = 0;
+
+	for (int n = 0; n < numObjects && numRequests < MAX_REQUESTS_PER_TICK; ++n)
 	{
+		int i = (_requestCursor + n) % numObjects;
+
 		Physics::PhysicsObject* object = _world.GetObject(i);
-		if (object->GetOwnerId() != _peerId)
+		unsigned networkId = GetNetworkId(object);
+
+		if (networkId != INVALID_NETWORK_ID && ReceivesUpdatesFor(object) && CanRequest(networkId)
+			&& ShouldRequest(regionMap, Vector2d(object->GetPosition())))
 		{
-			if ((_peerId == 1 && object->GetPosition().x() > 0) || _peerId == 0 && object->GetPosition().x() < 0)
-			{
-				// Don't queue more than 500 requests
-				if (_objectMigrationOut.size() > 500)
-					return;
+			RequestObject(networkId);
 
-				migration.objectId = i;
-				_objectMigrationOut.push_back(migration);
-			}
+			numRequests++;
+
+			if (numRequests == MAX_REQUESTS_PER_TICK)
+				_requestCursor = (i + 1) % numObjects;
 		}
 	}
 
@@ -610,10 +1897,11 @@ void ObjectExchange::ProcessOwnershipRequests()
 	// If an object that doesn't belong to is is picked up, request it
 	if (object != NULL)
 	{
-		if (object->GetOwnerId() != _peerId)
+		unsigned networkId = GetNetworkId(object);
+
+		if (networkId != INVALID_NETWORK_ID && ReceivesUpdatesFor(object) && CanRequest(networkId))
 		{
-			migration.objectId = object->GetId();
-			_objectMigrationOut.push_back(migration);
+			RequestObject(networkId);
 		}
 	}
 }
@@ -633,10 +1921,11 @@ unsigned NetworkController::ThreadMain()
 {
 	while(!_shutDown)
 	{
-		// TODO: implement timer to control tickrate
 		DoTick();
 
-		Sleep(1);
+		// Sleep until a socket is ready or there is new state to send
+		WatchSockets(_poller);
+		_poller.Wait(MAX_WAIT_MILLISECONDS);
 	}
 
 	// Do one more tick after shutdown so that controller 
@@ -660,19 +1949,33 @@ void NetworkController::SetLastMessage(const std::string& message)
 	_message = message;
 }
 
+void NetworkController::Wake()
+{
+	_poller.Wake();
+}
+
 void NetworkController::Shutdown()
 {
 	_shutDown = true;
+	Wake();
 
 	_shutdownEvent.Wait();
 }
 
-SessionMasterController::SessionMasterController(GameWorldThread& worldThread) :
-	_tcpListenSocket(TCPLISTEN_PORT),
-	_worldThread(worldThread),
+SessionMasterController::ClientSlot::ClientSlot(GameWorldThread& worldThread, unsigned peerId) :
+	_objectExchange(worldThread, true),
 	_state(LISTENING_CLIENT),
-	_objectExchange(worldThread, 0),
 	_hadPeerConnected(false)
+{
+	_objectExchange.SetPeerIds(0, peerId);
+
+	_snapshotSocket.Bind(0);
+	_snapshotSocket.SetBlocking(false);
+}
+
+SessionMasterController::SessionMasterController(GameWorldThread& worldThread) :
+	_tcpListenSocket(TCPLISTEN_PORT),
+	_worldThread(worldThread)
 {
 	_broadcastListenSocket.Bind(BROADCAST_PORT);
 	_broadcastListenSocket.SetBlocking(false);
@@ -682,70 +1985,186 @@ SessionMasterController::SessionMasterController(GameWorldThread& worldThread) :
 	_broadcastReplyMessage.Append(BROADCAST_REPLY_STRING);
 	_broadcastReplyMessage.Append(TCPLISTEN_PORT);
 
+	// We are peer 0, each other peer id has a slot
+	for (unsigned i = 1; i < RegionMap::MAX_PEERS; ++i)
+	{
+		_clients.push_back(new ClientSlot(worldThread, i));
+	}
+
 	SetLastMessage("Session Created, press L to leave session");
 }
 
+SessionMasterController::~SessionMasterController()
+{
+	for (unsigned i = 0; i < _clients.size(); ++i)
+	{
+		delete _clients[i];
+	}
+}
+
 void SessionMasterController::ExchangeState()
 {
 	Threading::ScopedLock lock(_stateChangeMutex);
 
-	// Make a copy of the world state to send to the client
-	if (_state == WAIT_ON_INITIALISATION_GATHER)
+	bool peersChanged = false;
+
+	for (unsigned i = 0; i < _clients.size(); ++i)
 	{
-		_objectExchange.GatherInitialisationData();
+		ClientSlot& client = *_clients[i];
+
+		if (client._state == WAIT_ON_INITIALISATION_GATHER)
+		{
+			peersChanged = true;
+		}
+		else if (client._state == DROPPING_CLIENT)
+		{
+			client._objectExchange.ReloadLastKnownPosition();
+			client._objectExchange.ReleaseRemoteObjects();
+
+			client._state = LISTENING_CLIENT;
+			peersChanged = true;
+		}
+	}
 
+	// The regions are divided before the initialisation data is gathered, so
+	// new clients are sent the regions which include them
+	if (peersChanged)
+	{
 		UpdatePeerId();
+	}
+	else
+	{
+		RebalanceRegions();
+	}
+
+	for (unsigned i = 0; i < _clients.size(); ++i)
+	{
+		ClientSlot& client = *_clients[i];
+
+		// Make a copy of the world state to send to the client
+		if (client._state == WAIT_ON_INITIALISATION_GATHER)
+		{
+			client._objectExchange.GatherInitialisationData();
 
-		// We are now ready to accept the client
-		_state = ACCEPTING_CLIENT;
+			// We are now ready to accept the client
+			client._state = ACCEPTING_CLIENT;
+		}
+		// For now synchronise all objects
+		else if (client._state == SYNCHRONISE_CLIENT)
+		{
+			client._objectExchange.ExchangeUpdatesWithWorld();
+		}
 	}
-	// For now synchronise all objects
-	else if (_state == SYNCHRONISE_CLIENT)
+
+	ForwardOwnershipChanges();
+	ForwardContactImpulses();
+
+	Wake();
+}
+
+void SessionMasterController::ForwardOwnershipChanges()
+{
+	for (unsigned i = 0; i < _clients.size(); ++i)
 	{
-		_objectExchange.ExchangeUpdatesWithWorld();
+		_clients[i]->_objectExchange.TakeOwnershipChanges(_ownershipChanges);
 	}
-	else if (_state == DROPPING_CLIENT)
+
+	if (_ownershipChanges.size() == 0)
+		return;
+
+	// Clients being accepted may have been sent an owner which has since changed,
+	// the changes are sent after their initialisation data
+	for (unsigned i = 0; i < _clients.size(); ++i)
 	{
-		_objectExchange.ReloadLastKnownPosition();
+		if (_clients[i]->_state == ACCEPTING_CLIENT || _clients[i]->_state == SYNCHRONISE_CLIENT)
+			_clients[i]->_objectExchange.NotifyOwnershipChanges(_ownershipChanges);
+	}
 
-		UpdatePeerId();
-		_state = LISTENING_CLIENT;
+	_ownershipChanges.clear();
+}
+
+void SessionMasterController::ForwardContactImpulses()
+{
+	for (unsigned i = 0; i < _clients.size(); ++i)
+	{
+		_clients[i]->_objectExchange.TakeForwardedImpulses(_forwardedImpulses);
+	}
+
+	if (_forwardedImpulses.size() == 0)
+		return;
+
+	for (unsigned i = 0; i < _clients.size(); ++i)
+	{
+		if (_clients[i]->_state == SYNCHRONISE_CLIENT)
+			_clients[i]->_objectExchange.ForwardImpulses(_forwardedImpulses);
 	}
+
+	_forwardedImpulses.clear();
 }
 
 void SessionMasterController::DoTick()
 {
-	// If something caused the client to disconnect, listen for a new client
-	if (_state != LISTENING_CLIENT && !_clientSocket.IsOpen())
+	DoAcceptHostTick();
+
+	for (unsigned i = 0; i < _clients.size(); ++i)
 	{
-		_state = LISTENING_CLIENT;
+		ClientSlot& client = *_clients[i];
+
+		switch(client._state)
+		{
+		case ACCEPTING_CLIENT:
+			SendSessionInitialization(client);
+			break;
+
+		case SYNCHRONISE_CLIENT:
+			DoPeerConnectedTick(client);
+			break;
+		}
+
+		// If we lost a client
+		if (client._hadPeerConnected && 
+			(_shutDown || !client._socket.IsOpen() || client._objectExchange.Timeout()))
+		{
+			Threading::ScopedLock lock(_stateChangeMutex);
+			client._hadPeerConnected = false;
+			client._state = DROPPING_CLIENT;
+			client._socket.Close();
+
+			std::stringstream ss;
+			ss << "Peer " << client._objectExchange.GetRemotePeerId() << " disconnected/timed out";
+
+			SetLastMessage(ss.str());
+		}
 	}
+}
 
-	switch(_state)
-	{
-	case LISTENING_CLIENT:
-		DoAcceptHostTick();
-		break;
+void SessionMasterController::WatchSockets(Networking::Poller& poller)
+{
+	poller.Watch(_broadcastListenSocket);
 
-	case ACCEPTING_CLIENT:
-		SendSessionInitialization();
-		break;
+	// Connections are left waiting while every slot is in use
+	if (GetListeningClient() != NULL)
+		poller.Watch(_tcpListenSocket);
 
-	case SYNCHRONISE_CLIENT:
-		DoPeerConnectedTick();
-		break;
+	for (unsigned i = 0; i < _clients.size(); ++i)
+	{
+		if (_clients[i]->_state == ACCEPTING_CLIENT || _clients[i]->_state == SYNCHRONISE_CLIENT)
+			poller.Watch(_clients[i]->_socket);
+
+		if (_clients[i]->_state == SYNCHRONISE_CLIENT)
+			poller.Watch(_clients[i]->_snapshotSocket);
 	}
+}
 
-	// If we lost a client
-	if (_shutDown || 
-		(_hadPeerConnected && (!_clientSocket.IsOpen() || _objectExchange.Timeout())))
+SessionMasterController::ClientSlot* SessionMasterController::GetListeningClient()
+{
+	for (unsigned i = 0; i < _clients.size(); ++i)
 	{
-		Threading::ScopedLock lock(_stateChangeMutex);
-		_hadPeerConnected = false;
-		_state = DROPPING_CLIENT;
-		_clientSocket.Close();
-		SetLastMessage("Peer disconnected/timed out");
+		if (_clients[i]->_state == LISTENING_CLIENT)
+			return _clients[i];
 	}
+
+	return NULL;
 }
 
 void SessionMasterController::DoAcceptHostTick()
@@ -753,18 +2172,20 @@ void SessionMasterController::DoAcceptHostTick()
 	Message message;
 	Address address;
 
-	// Reply to broadcasts
+	ClientSlot* client = GetListeningClient();
+
+	// Reply to broadcasts while there is room for another client
 	while(_broadcastListenSocket.RecieveFrom(address, message))
 	{
 		std::string broadcastString;
-		if (message.Read(broadcastString) && broadcastString == BROADCAST_STRING)
+		if (client != NULL && message.Read(broadcastString) && broadcastString == BROADCAST_STRING)
 		{
 			_broadcastListenSocket.SendTo(address, _broadcastReplyMessage);
 		}
 	}
 
 	// Accept an incoming connection request
-	if (_tcpListenSocket.Accept(_clientSocket, address))
+	if (client != NULL && _tcpListenSocket.Accept(client->_socket, address))
 	{
 		Threading::ScopedLock lock(_stateChangeMutex);
 
@@ -773,57 +2194,125 @@ void SessionMasterController::DoAcceptHostTick()
 
 		SetLastMessage(ss.str());
 
-		_clientSocket.SetBlocking(false);
-		_hadPeerConnected = true;
-		_objectExchange.Reset();
-		_state = WAIT_ON_INITIALISATION_GATHER;
+		client->_socket.SetBlocking(false);
+		client->_hadPeerConnected = true;
+		client->_objectExchange.Reset();
+		client->_objectExchange.SetRemoteAddress(address);
+		client->_state = WAIT_ON_INITIALISATION_GATHER;
 	}
 
 }
 
-void SessionMasterController::SendSessionInitialization()
+void SessionMasterController::SendSessionInitialization(ClientSlot& client)
 {
-	_objectExchange.SendInitialisationData(_clientSocket);
+	client._objectExchange.SendInitialisationData(client._socket);
 
-	if (_objectExchange.InitialisationSent())
+	if (client._objectExchange.InitialisationSent())
 	{
-		_state = SYNCHRONISE_CLIENT;
+		client._state = SYNCHRONISE_CLIENT;
 	}
 }
 
 
-void SessionMasterController::DoPeerConnectedTick()
+void SessionMasterController::DoPeerConnectedTick(ClientSlot& client)
 {
-	_objectExchange.SendState(_clientSocket);
-	_objectExchange.ReceiveState(_clientSocket);
+	client._objectExchange.SendState(client._socket, client._snapshotSocket);
+	client._objectExchange.ReceiveState(client._socket, client._snapshotSocket);
 }
 
 void SessionMasterController::UpdatePeerId()
 {
-	if (_clientSocket.IsOpen())
+	// Every client which has been accepted is given a region, in peer id order
+	std::vector<unsigned> peers(1, 0);
+
+	for (unsigned i = 0; i < _clients.size(); ++i)
 	{
-		_worldThread.SetPeerId(0);
-		_worldThread.SetNumPeers(2);
-		_worldThread._world->SetOtherPeerId(1);
+		if (_clients[i]->_state != LISTENING_CLIENT && _clients[i]->_state != DROPPING_CLIENT)
+			peers.push_back(_clients[i]->_objectExchange.GetRemotePeerId());
 	}
-	else
+
+	RegionMap regionMap = _worldThread._world->GetRegionMap();
+	regionMap.Divide(peers);
+
+	_worldThread.SetPeerId(0);
+	_worldThread.SetNumPeers(peers.size());
+
+	ShareRegionMap(regionMap);
+
+	_rebalanceTimer.Start();
+}
+
+void SessionMasterController::ShareRegionMap(const RegionMap& regionMap)
+{
+	_worldThread._world->SetRegionMap(regionMap);
+
+	for (unsigned i = 0; i < _clients.size(); ++i)
 	{
-		_worldThread.SetPeerId(0);
-		_worldThread.SetNumPeers(1);
-		_worldThread._world->SetPeerBounds(AABB(Vector2d(0, 0), Vector2d(0, 0)));
-		_worldThread._world->SetOtherPeerId(-1);
+		if (_clients[i]->_state == ACCEPTING_CLIENT || _clients[i]->_state == SYNCHRONISE_CLIENT)
+			_clients[i]->_objectExchange.QueueRegionMap(regionMap);
+	}
+}
+
+void SessionMasterController::RebalanceRegions()
+{
+	if (_rebalanceTimer.GetTime() < REBALANCE_INTERVAL)
+		return;
+
+	_rebalanceTimer.Start();
+
+	World& world = *_worldThread._world;
+	RegionMap regionMap = world.GetRegionMap();
+
+	if (regionMap.GetNumRegions() < 2)
+		return;
+
+	// Nothing is moved until every peer has reported its load
+	std::vector<double> stepTimes(regionMap.GetNumRegions());
+
+	for (unsigned i = 0; i < regionMap.GetNumRegions(); ++i)
+	{
+		unsigned peerId = regionMap.GetPeer(i);
+
+		if (peerId == 0)
+		{
+			stepTimes[i] = _worldThread.GetSolveTime();
+		}
+		else
+		{
+			ClientSlot& client = *_clients[peerId - 1];
+
+			if (client._state != SYNCHRONISE_CLIENT || !client._objectExchange.GetRemoteStepTime(stepTimes[i]))
+				return;
+		}
+	}
+
+	// We hold the latest position of every object, so the objects in each
+	// region can be counted here rather than reported by the peers
+	std::vector<double> objectPositions(world.GetNumObjects());
+
+	for (int i = 0; i < world.GetNumObjects(); ++i)
+	{
+		objectPositions[i] = world.GetObject(i)->GetPosition().x();
+	}
+
+	if (regionMap.Rebalance(objectPositions, stepTimes))
+	{
+		ShareRegionMap(regionMap);
 	}
 }
 
 WorkerController::WorkerController(GameWorldThread& worldThread) :
 	_worldThread(worldThread),
 	_state(FINDING_HOST),
-	_objectExchange(worldThread, 1),
+	_objectExchange(worldThread, false),
 	_hadPeerConnected(false)
 {
 	_broadcastSocket.SetBlocking(false);
 	_broadcastMessage.Append(BROADCAST_STRING);
 
+	_snapshotSocket.Bind(0);
+	_snapshotSocket.SetBlocking(false);
+
 	SetLastMessage("Attempting to find session");
 }
 
@@ -862,27 +2351,49 @@ void WorkerController::DoTick()
 	}
 }
 
+void WorkerController::WatchSockets(Networking::Poller& poller)
+{
+	switch(_state)
+	{
+	case FINDING_HOST:
+		poller.Watch(_broadcastSocket);
+		break;
+
+	// Received data isn't read while waiting for the world to be initialised
+	case RECEIVING_INITIALISATION:
+		poller.Watch(_serverSocket);
+		break;
+
+	case SYNCHRONISE_CLIENT:
+		poller.Watch(_serverSocket);
+		poller.Watch(_snapshotSocket);
+		break;
+	}
+}
+
 void WorkerController::UpdatePeerId()
 {
+	// The session master gives us our id and the regions with the initialisation data
 	if (_state != FINDING_HOST)
 	{
-		_worldThread.SetPeerId(1);
-		_worldThread.SetNumPeers(2);
-		_worldThread._world->SetOtherPeerId(0);
+		_worldThread.SetPeerId(_objectExchange.GetPeerId());
 	}
 	else
 	{
+		RegionMap regionMap = _worldThread._world->GetRegionMap();
+		regionMap.Divide(std::vector<unsigned>(1, 0));
+
+		_worldThread._world->SetRegionMap(regionMap);
+		_worldThread._world->ClearPeerBounds();
 		_worldThread.SetPeerId(0);
 		_worldThread.SetNumPeers(1);
-		_worldThread._world->SetPeerBounds(AABB(Vector2d(0, 0), Vector2d(0, 0)));
-		_worldThread._world->SetOtherPeerId(-1);
 	}
 }
 
 void WorkerController::DoConnectedTick()
 {
-	_objectExchange.SendState(_serverSocket);
-	_objectExchange.ReceiveState(_serverSocket);
+	_objectExchange.SendState(_serverSocket, _snapshotSocket);
+	_objectExchange.ReceiveState(_serverSocket, _snapshotSocket);
 }
 
 void WorkerController::DoFindHostTick()
@@ -927,6 +2438,7 @@ void WorkerController::DoFindHostTick()
 			_serverSocket.SetBlocking(false);
 			_hadPeerConnected = true;
 			_objectExchange.Reset();
+			_objectExchange.SetRemoteAddress(serverAddress);
 			_state = RECEIVING_INITIALISATION;
 		}
 		else
@@ -996,4 +2508,6 @@ void WorkerController::ExchangeState()
 		_state = FINDING_HOST;
 		UpdatePeerId();
 	}
+
+	Wake();
 }
@@ -7,17 +7,33 @@
 #include "Threading.h"
 #include "AABB.h"
 #include "Timer.h"
+#include "ObjectPool.h"
+#include "Precision.h"
+#include "RegionMap.h"
 #include <vector>
 #include <queue>
+#include <deque>
 
 class GameWorldThread;
 class World;
 
+namespace Physics
+{
+	class PhysicsObject;
+}
+
 
 enum eMessageType
 {
+	// Object updates are the only message sent over UDP
 	OBJECT_UPDATES = 0,
 	OBJECT_MIGRATION = 1,
+	PEER_REGIONS = 2,
+	PEER_LOAD = 3,
+	CONTACT_IMPULSES = 4,
+
+	// Sent when synchronisation starts, the port updates should be sent to
+	SNAPSHOT_PORT = 5,
 };
 
 enum eRequestType
@@ -25,23 +41,37 @@ enum eRequestType
 	OBJECT_REQUEST = 0,
 	OBJECT_REQUEST_ACK = 1,
 	OBJECT_REQUEST_DENY = 2,
+
+	// Sent by the session master to tell the other peers an object has moved
+	// to or from a peer, followed by the id of the new owner
+	OBJECT_OWNER_CHANGED = 3,
 };
 
 struct ObjectMigration
 {
 	eRequestType type;
 	unsigned objectId;
+
+	// Only sent with OBJECT_OWNER_CHANGED
+	unsigned ownerId;
 };
 
 struct ObjectInitialisation
 {
 	unsigned objectType;
+	unsigned id;
 	double x;
 	double y;
 	double vx;
 	double vy;
 	int color;
 	double mass;
+	unsigned ownerId;
+
+	// Only sent for blobby objects, the blobby record is followed by one
+	// record for each of its parts
+	unsigned numParts;
+	double stiffness;
 };
 
 struct ObjectState
@@ -53,10 +83,91 @@ struct ObjectState
 	double vy;
 };
 
+// The view bounds of a peer, sent with each frame of updates
+struct PeerView
+{
+	unsigned peerId;
+	AABB bounds;
+};
+
+// The half of a contact solved by one peer which belongs to an object owned
+// by another, sent to the owner which adds it to the object
+struct ObjectImpulse
+{
+	unsigned objectId;
+	Vector2r velocity;
+	Vector2r position;
+};
+
+struct SentImpulse
+{
+	ObjectImpulse impulse;
+	double time;
+};
+
 struct PositionVelocity
 {
-	Vector2d position;
-	Vector2d velocity;
+	Vector2r position;
+	Vector2r velocity;
+};
+
+// Position and velocity quantised to 16 bits per component, positions
+// across the world bounds and velocities across +/- MAX_REPLICATED_SPEED
+struct QuantisedState
+{
+	enum { X, Y, VX, VY, NUM_COMPONENTS };
+
+	unsigned short components[NUM_COMPONENTS];
+};
+
+struct ObjectSnapshot
+{
+	unsigned id;
+	QuantisedState state;
+
+	// Objects far from the remote peer are only sent every few frames, the
+	// snapshot still holds them to keep track of which objects are sent
+	bool interesting;
+};
+
+// The last state of an object the remote peer has acknowledged receiving. An
+// object is sent in every frame until the remote peer acknowledges a state
+// close to its current one
+struct ReplicationBaseline
+{
+	QuantisedState state;
+
+	// The packet the state was acknowledged in. Packets up to this one are
+	// ignored when they are acknowledged
+	unsigned sequence;
+	bool acknowledged;
+
+	// The last frame the object was owned by the sending peer in, 0 if never
+	unsigned ownedFrame;
+};
+
+// How many of the packets of a frame have been received
+struct FrameProgress
+{
+	unsigned frame;
+	unsigned packetsReceived;
+};
+
+// The objects sent in a packet, kept until the packet is acknowledged
+struct SentPacket
+{
+	// 0 once the packet has been acknowledged
+	unsigned sequence;
+	std::vector<ObjectSnapshot> objects;
+};
+
+// The states received in a packet, in id order, which the records of later
+// packets may be encoded against
+struct ReceivedPacket
+{
+	// 0 if no packet has been received into the entry
+	unsigned sequence;
+	std::vector<ObjectSnapshot> objects;
 };
 
 class ObjectExchange
@@ -64,10 +175,28 @@ class ObjectExchange
 
 public:
 
-	ObjectExchange(GameWorldThread& worldThread, unsigned peerId);
+	static const unsigned INVALID_NETWORK_ID = 0xFFFFFFFF;
+
+	// Peers exchange updates with the session master only. The session master
+	// relays the updates it receives from each peer on to the others, other
+	// peers only send updates for the objects they own
+	ObjectExchange(GameWorldThread& worldThread, bool relayUpdates);
+
+	// Our peer id and the id of the peer at the other end of the connection.
+	// Peers other than the session master are given their id with the
+	// initialisation data
+	void SetPeerIds(unsigned peerId, unsigned remotePeerId);
+	unsigned GetPeerId() const;
+	unsigned GetRemotePeerId() const;
+
+	// The address of the remote peer's connection, updates are sent over UDP
+	// to the port it gives on this address. Should be called after Reset
+	void SetRemoteAddress(const Networking::Address& address);
 
-	void SendState(Networking::TcpSocket& socket);
-	void ReceiveState(Networking::TcpSocket& socket);
+	// Object updates are sent and received on the snapshot socket, everything
+	// else which must arrive goes over the connection
+	void SendState(Networking::TcpSocket& socket, Networking::UdpSocket& snapshotSocket);
+	void ReceiveState(Networking::TcpSocket& socket, Networking::UdpSocket& snapshotSocket);
 
 	void ExchangeUpdatesWithWorld();
 
@@ -86,13 +215,105 @@ public:
 
 	void ReloadLastKnownPosition();
 
+	// Takes ownership of the objects owned by the remote peer, once it has left
+	void ReleaseRemoteObjects();
+
+	// Should be called whenever the session master changes the region map
+	void QueueRegionMap(const RegionMap& regionMap);
+
+	// The session master takes the ownership changes made through each exchange
+	// and sends them to the peers at the end of every other exchange
+	void TakeOwnershipChanges(std::vector<ObjectMigration>& changes);
+	void NotifyOwnershipChanges(const std::vector<ObjectMigration>& changes);
+
+	// Peers other than the session master report their step time to it, returns
+	// false until the remote peer has made a report
+	bool GetRemoteStepTime(double& stepTime);
+
+	// The session master passes on contact impulses for objects it doesn't own,
+	// each exchange only sends the impulses for objects its remote peer owns
+	void TakeForwardedImpulses(std::vector<ObjectImpulse>& impulses);
+	void ForwardImpulses(const std::vector<ObjectImpulse>& impulses);
+
 private:
 
-	void HandleUpdateMessage(Networking::TcpSocket& socket, Networking::Message& message);
-	void HandleMigrationMessage(Networking::TcpSocket& socket, Networking::Message& message);
+	void HandleMigrationMessage(Networking::TcpSocket& socket, Networking::MessageView& message);
+	void HandleRegionMessage(Networking::TcpSocket& socket, Networking::MessageView& message);
+	void HandleLoadMessage(Networking::TcpSocket& socket, Networking::MessageView& message);
+	void HandleImpulseMessage(Networking::TcpSocket& socket, Networking::MessageView& message);
+	void HandleSnapshotPortMessage(Networking::TcpSocket& socket, Networking::MessageView& message);
+
+	// Malformed packets, and packets too old to be acknowledged, are dropped
+	void ReceiveSnapshots(Networking::UdpSocket& socket);
+	void HandleSnapshotPacket(Networking::MessageView& packet);
+
+	// Returns false if the packet is a duplicate or too old to be acknowledged
+	bool RecordReceivedSequence(unsigned sequence);
+
+	// The remote peer acknowledges its latest packet, and each of the ACK_BITS
+	// packets before it which has its bit set
+	void ProcessAcks(unsigned ack, unsigned ackBits);
+	void AcknowledgePacket(unsigned sequence);
+
+	void AppendRegionMap(Networking::Message& message, const RegionMap& regionMap);
+	bool ReadRegionMap(Networking::MessageView& message, RegionMap& regionMap);
+	void ApplyRegionMap(const RegionMap& regionMap);
+
+	void AppendInitialisationRecord(Networking::Message& message, Physics::PhysicsObject* object);
+	bool InitialisationMatchesWorld();
+
+	// Objects are identified on the wire by the handle index they had on the peer
+	// which sent the initialisation data, which doesn't change when other objects
+	// are removed. Returns NULL if the object has been removed
+	void MapNetworkId(unsigned networkId, Physics::PhysicsObject* object);
+	Physics::PhysicsObject* GetObjectByNetworkId(unsigned networkId);
+	unsigned GetNetworkId(Physics::PhysicsObject* object);
+
+	// Marks the objects near the regions or views of the peers the remote peer
+	// sends our updates to, the other objects are sent at a reduced rate
+	void FindInterestingObjects();
+
+	// Marks the objects near our own region, which may touch the objects we
+	// simulate and so are moved on to the time they are received
+	void FindHaloObjects();
 
 	void StoreNewPositionUpdates();
+	void StoreContactImpulses();
+
+	// Sends the objects which have changed from the state the remote peer last
+	// acknowledged, split into as many packets as they need
+	void SendSnapshot(Networking::UdpSocket& socket);
+	// Records are encoded against the state of the object the remote peer last
+	// acknowledged, when it still holds the packet the state was sent in
+	void AppendObjectRecord(Networking::Message& message, const ObjectSnapshot& snapshot, unsigned sequence, unsigned& lastId);
+	bool ReadObjectRecord(Networking::MessageView& message, unsigned sequence, ObjectSnapshot& record, unsigned& lastId);
+
+	// Finds the state of an object received in one of the last SENT_PACKET_HISTORY packets
+	bool FindReceivedState(unsigned sequence, unsigned id, QuantisedState& state) const;
+	static bool SnapshotIdLess(const ObjectSnapshot& a, const ObjectSnapshot& b);
+
+	void Quantise(const Vector2r& position, const Vector2r& velocity, QuantisedState& state) const;
+	void Dequantise(const QuantisedState& state, ObjectState& object) const;
+
+	// Whether the remote peer sends updates for an object, or we send them to it
+	bool ReceivesUpdatesFor(Physics::PhysicsObject* object);
+	bool SendsUpdatesFor(Physics::PhysicsObject* object);
+
+	void ChangeOwner(Physics::PhysicsObject* object, unsigned networkId, unsigned ownerId);
+
+	// Whether an object at the position should be requested from the remote
+	// peer. Objects within MIGRATION_HYSTERESIS of a region boundary stay with
+	// their owner, so objects resting on a boundary don't keep changing hands
+	bool ShouldRequest(const RegionMap& regionMap, const Vector2d& position);
+
+	// Returns false if a request for the object is waiting for a reply, or
+	// was denied too recently to be made again
+	bool CanRequest(unsigned networkId);
+	void RequestObject(unsigned networkId);
+
 	void ProcessReceivedPositionUpdates();
+	void HoldUnsentObjects();
+	void ProcessContactImpulses();
 	void ProcessOwnershipConfirmations();
 	void ProcessOwnershipRequests();
 
@@ -100,25 +321,125 @@ private:
 
 	std::vector<ObjectMigration> _objectMigrationOut;
 	std::vector<ObjectMigration> _objectMigrationIn;
+	std::vector<ObjectMigration> _ownershipChanges;
+
+	std::vector<ObjectImpulse> _impulsesOut;
+	std::vector<ObjectImpulse> _impulsesIn;
+	std::vector<ObjectImpulse> _forwardedImpulses;
+
+	// Impulses sent too recently to be included in the remote peer's updates,
+	// which are added again to the states received for their objects
+	std::deque<SentImpulse> _impulsesSent;
+
+	Networking::Message _regionMessageOut;
+	bool _regionMessageQueued;
+
+	RegionMap _regionMapReceived;
+	bool _regionMapChanged;
 
+	// Our step time captured by the simulation thread, and the last step time
+	// reported by the remote peer. Only the time spent solving the contacts of
+	// owned objects is counted, see GameWorldThread::GetSolveTime
+	double _stepTime;
+	double _remoteStepTime;
+	bool _hasRemoteStepTime;
+	Timer _loadReportTimer;
+
+	// The object the next batch of ownership requests starts searching from
+	int _requestCursor;
+
+	// The time each object can next be requested, indexed by network id
+	std::vector<double> _requestRetryTimes;
+
+	Networking::Address _remoteAddress;
+	Networking::Address _snapshotAddress;
+	bool _hasSnapshotAddress;
+	bool _snapshotPortSent;
+
+	// Frames are stamped with the time their snapshot was taken. Each peer echoes
+	// the last time it received, which gives the age of a frame when it arrives
+	Timer _clock;
+	double _latency;
+	bool _hasLatency;
+
+	// Indexed by network id
 	std::vector<PositionVelocity> _lastReceivedObjectState;
+	std::vector<Physics::ObjectHandle> _objectsByNetworkId;
+
+	// Indexed by handle index
+	std::vector<unsigned> _networkIdsByHandle;
 
 	struct
 	{
-		std::vector<Networking::Message> _newState;
-		std::vector<Networking::Message> _sendingState;
-		unsigned _messagesSent;
+		// Owned objects captured by the simulation thread, encoded against
+		// the baselines by the network thread when the previous frame is sent
+		std::vector<ObjectSnapshot> _newSnapshot;
+		std::vector<ObjectSnapshot> _sendingSnapshot;
+		std::vector<PeerView> _newViews;
+		std::vector<PeerView> _sendingViews;
+		double _newSnapshotTime;
+		double _sendingSnapshotTime;
+		bool _snapshotReady;
+
+		std::vector<ReplicationBaseline> _baselines;
+		std::vector<unsigned> _changedObjects;
+		unsigned _frame;
+
+		// Indexed by sequence modulo SENT_PACKET_HISTORY
+		std::vector<SentPacket> _sentPackets;
+		unsigned _sequence;
+
+		// Indexed by object id
+		std::vector<bool> _interestingObjects;
 
 	} _sendData;
 
+	// Frames which haven't finished arriving are given up on once this many
+	// newer frames have started
+	static const unsigned FRAME_HISTORY = 4;
+
 	struct
 	{
-		unsigned _objectsRead;
+		std::vector<ObjectSnapshot> _recordsReceived;
 		std::vector<ObjectState> _objectsReceived;
 		std::vector<ObjectState> _objectsUpdate;
 
-		AABB _peerBoundsReceived;
-		AABB _peerBoundsUpdate;
+		// Indexed by sequence modulo SENT_PACKET_HISTORY
+		std::vector<ReceivedPacket> _receivedPackets;
+
+		std::vector<PeerView> _viewsReceived;
+		std::vector<PeerView> _viewsUpdate;
+		unsigned _viewsFrame;
+
+		// The latest packet received, and a bit for each of the packets before it
+		unsigned _sequence;
+		unsigned _ackBits;
+
+		// The frame of the latest state received for each object, indexed by
+		// network id. Packets may arrive out of order, older states are dropped
+		std::vector<unsigned> _objectFrames;
+
+		// The latest frame every packet of has arrived. Objects left out of it
+		// haven't changed since they were last sent, or are far from our
+		// region, and are held
+		unsigned _completeFrame;
+
+		// Indexed by frame modulo FRAME_HISTORY
+		FrameProgress _frameProgress[FRAME_HISTORY];
+
+		// The time stamp of the latest packet, and when it arrived
+		double _remoteTime;
+		double _remoteTimeArrival;
+		bool _hasRemoteTime;
+
+		// When the last of the states waiting to be applied arrived
+		double _frameArrival;
+
+		// Indexed by network id
+		std::vector<bool> _updatedObjects;
+
+		// Indexed by object id
+		std::vector<bool> _haloObjects;
 
 	} _updateData;
 	
@@ -126,7 +447,7 @@ private:
 	struct 
 	{
 		std::vector<Networking::Message> _messages;
-		unsigned _messagesSent;
+		unsigned _messagesQueued;
 
 	} _initialisationDataOut;
 
@@ -135,18 +456,90 @@ private:
 	{
 		unsigned _objectsRead;
 		std::vector<ObjectInitialisation> _objects;
+
+		// Part records still expected after the last blobby record
+		unsigned _partsExpected;
 		bool _initialisationReceived;
 
+		unsigned _peerId;
+		unsigned _remotePeerId;
+		RegionMap _regionMap;
+
 	} _initialisationDataIn;
 
 	World& _world;
 	GameWorldThread& _worldThread;
 
 	unsigned _peerId;
+	unsigned _remotePeerId;
+	bool _relayUpdates;
 
 	Timer _timeout;
 
 	static const double RECV_TIMEOUT;
+	static const double LOAD_REPORT_INTERVAL;
+
+	// Objects needing to migrate are requested a batch at a time, so moving a
+	// region boundary doesn't hand every object over at once
+	static const int MAX_REQUESTS_PER_TICK = 32;
+
+	static const double MIGRATION_HYSTERESIS;
+
+	// Requests are always answered, the timeout only covers replies lost when
+	// a peer leaves. Denied objects are requested again after the retry interval
+	static const double REQUEST_TIMEOUT;
+	static const double DENIED_RETRY_INTERVAL;
+
+	// Initialisation data claiming more objects than this is rejected
+	static const int MAX_INITIALISATION_OBJECTS = 1 << 16;
+
+	// Type byte, network id and owner byte
+	static const int MAX_MIGRATION_RECORD_SIZE = sizeof(unsigned char) * 2 + sizeof(unsigned);
+
+	static const double MAX_REPLICATED_SPEED;
+	static const unsigned QUANTISED_MAX = 0xFFFF;
+
+	// Objects are only sent once a component has moved more than this many
+	// quantisation steps from the state last sent for it
+	static const int POSITION_TOLERANCE = 2;
+	static const int VELOCITY_TOLERANCE = 8;
+
+	// Objects within this distance of a peer's region are sent every frame,
+	// objects further away are sent every FAR_UPDATE_INTERVAL frames
+	static const double INTEREST_MARGIN;
+	static const unsigned FAR_UPDATE_INTERVAL = 8;
+
+	static const double LATENCY_SMOOTHING;
+
+	// Ids are sent as the gap from the previous id, this gap is followed by the full id
+	static const unsigned short ID_GAP_ESCAPE = 0xFFFF;
+
+	// Records start with a flag for each component which is sent, and for each
+	// which is sent as an 8 bit delta. Records which aren't sent in full are
+	// followed by how many packets before their own the baseline was sent in
+	static const int COMPONENT_PRESENT_SHIFT = 0;
+	static const int COMPONENT_DELTA_SHIFT = 4;
+	static const unsigned char FULL_RECORD_FLAGS = (1 << QuantisedState::NUM_COMPONENTS) - 1;
+
+	// Flags, id gap, full id, baseline offset and every component in full
+	static const int MAX_OBJECT_RECORD_SIZE = sizeof(unsigned char) + sizeof(unsigned short) + sizeof(unsigned)
+		+ sizeof(unsigned char) + sizeof(unsigned short) * QuantisedState::NUM_COMPONENTS;
+
+	static const unsigned MAX_SNAPSHOT_PACKET_SIZE = Networking::UdpSocket::MAX_DATAGRAM_SIZE - Networking::Message::MAX_VARINT_SIZE;
+
+	// Message type, sequence, ack, ack bits, frame, packets in the frame, time
+	// stamp, echo, view count and object count
+	static const unsigned SNAPSHOT_HEADER_SIZE = sizeof(eMessageType) + sizeof(unsigned) * 4
+		+ sizeof(unsigned short) + sizeof(float) * 2 + sizeof(unsigned char) + sizeof(unsigned short);
+
+	// Peer id and bounds
+	static const unsigned VIEW_RECORD_SIZE = sizeof(unsigned char) + sizeof(float) * 4;
+
+	static const unsigned ACK_BITS = 32;
+
+	// Packets which aren't acknowledged by the time their entry is reused are
+	// treated as lost, their objects have been sent again by then
+	static const unsigned SENT_PACKET_HISTORY = 64;
 };
 
 class NetworkController : public Threading::Thread
@@ -172,10 +565,22 @@ protected:
 
 	virtual void DoTick() = 0;
 
-	bool _shutDown;
+	// Only sockets which the next tick will read or write should be watched,
+	// otherwise the wait returns straight away
+	virtual void WatchSockets(Networking::Poller& poller) = 0;
+
+	// Makes the network thread tick, call when there is new state to send
+	void Wake();
+
+	volatile bool _shutDown;
 
 private:
 
+	// Longest time between ticks, for broadcasts and timeouts
+	static const int MAX_WAIT_MILLISECONDS = 50;
+
+	Networking::Poller _poller;
+
 	Threading::Mutex _messageMutex;
 	Threading::Event _shutdownEvent;
 
@@ -191,42 +596,67 @@ class SessionMasterController : public NetworkController
 public:
 
 	SessionMasterController(GameWorldThread& worldThread);
+	~SessionMasterController();
 	void ExchangeState();
 
 protected:
 
 	void DoTick();
+	void WatchSockets(Networking::Poller& poller);
 
 private:
 
+	enum eState
+	{
+		LISTENING_CLIENT,
+		WAIT_ON_INITIALISATION_GATHER,
+		ACCEPTING_CLIENT,
+		SYNCHRONISE_CLIENT,
+		DROPPING_CLIENT,
+	};
+
+	// Each client has a slot with a fixed peer id, a slot which is listening
+	// can be given to the next client to connect
+	struct ClientSlot
+	{
+		ClientSlot(GameWorldThread& worldThread, unsigned peerId);
+
+		Networking::TcpSocket _socket;
+		Networking::UdpSocket _snapshotSocket;
+		ObjectExchange _objectExchange;
+		volatile eState _state;
+		bool _hadPeerConnected;
+	};
+
 	void DoAcceptHostTick();
-	void DoPeerConnectedTick();
+	void DoPeerConnectedTick(ClientSlot& client);
 	void UpdatePeerId();
-	void SendSessionInitialization();
+	void SendSessionInitialization(ClientSlot& client);
+	void ForwardOwnershipChanges();
+	void ForwardContactImpulses();
+
+	// Moves the region boundaries to balance the step times of the peers
+	void RebalanceRegions();
+	void ShareRegionMap(const RegionMap& regionMap);
+
+	ClientSlot* GetListeningClient();
 
 	Networking::UdpSocket _broadcastListenSocket;
 	Networking::TcpListener _tcpListenSocket;
 
-	Networking::TcpSocket _clientSocket;
 	Networking::Message _broadcastReplyMessage;
 
 	GameWorldThread& _worldThread;
 	Threading::Mutex _stateChangeMutex;
 
-	enum eState
-	{
-		LISTENING_CLIENT,
-		WAIT_ON_INITIALISATION_GATHER,
-		ACCEPTING_CLIENT,
-		SYNCHRONISE_CLIENT,
-		DROPPING_CLIENT,
-	};
-
-	volatile eState _state;
+	// Slot i holds the client with peer id i + 1
+	std::vector<ClientSlot*> _clients;
 
-	ObjectExchange _objectExchange;
+	std::vector<ObjectMigration> _ownershipChanges;
+	std::vector<ObjectImpulse> _forwardedImpulses;
 
-	bool _hadPeerConnected;
+	Timer _rebalanceTimer;
+	static const double REBALANCE_INTERVAL;
 };
 
 class WorkerController : public NetworkController
@@ -240,6 +670,7 @@ public:
 protected:
 
 	void DoTick();
+	void WatchSockets(Networking::Poller& poller);
 
 private:
 
@@ -255,6 +686,7 @@ private:
 	Networking::UdpSocket _broadcastSocket;
 	Networking::Message _broadcastMessage;
 	Networking::TcpSocket _serverSocket;
+	Networking::UdpSocket _snapshotSocket;
 
 	GameWorldThread& _worldThread;
 
@@ -4,19 +4,32 @@
 
 #include <iostream>
 #include <cassert>
+#include <cstring>
+
+#ifndef _WIN32
+#include <sys/uio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#endif
 
 using namespace Networking;
 
 int System::INSTANCE_COUNT = 0;
+
+#ifdef _WIN32
 WSADATA WSA_DATA;
+#endif
 
 System::System()
 {
 	if (INSTANCE_COUNT == 0)
 	{
+#ifdef _WIN32
 		int r = WSAStartup(MAKEWORD(2, 2), &WSA_DATA);
 
 		assert(r == 0);
+#endif
 
 		INSTANCE_COUNT++;
 	}
@@ -26,38 +39,79 @@ System::~System()
 {
 	INSTANCE_COUNT--;
 
+#ifdef _WIN32
 	if (INSTANCE_COUNT == 0)
 		WSACleanup();
+#endif
 }
 
 void System::PrintLastError()
 {
+#ifdef _WIN32
 	std::cout << WSAGetLastError() << std::endl;
+#else
+	std::cout << errno << std::endl;
+#endif
+}
+
+bool System::LastErrorWouldBlock()
+{
+#ifdef _WIN32
+	return WSAGetLastError() == WSAEWOULDBLOCK;
+#else
+	return errno == EWOULDBLOCK || errno == EAGAIN || errno == EINTR;
+#endif
+}
+
+void System::CloseSocket(SOCKET socket)
+{
+#ifdef _WIN32
+	closesocket(socket);
+#else
+	close(socket);
+#endif
+}
+
+void System::SetBlocking(SOCKET socket, bool blocking)
+{
+#ifdef _WIN32
+	u_long arg = !blocking;
+	int r = ioctlsocket(socket, FIONBIO, &arg);
+#else
+	int flags = fcntl(socket, F_GETFL, 0);
+	int r = fcntl(socket, F_SETFL, blocking ? (flags & ~O_NONBLOCK) : (flags | O_NONBLOCK));
+#endif
+
+	if (r == SOCKET_ERROR)
+	{
+		PrintLastError();
+	}
 }
 
 Message::Message() :
-	_size(0),
-	_readLocation(2)
+	_buffer(MAX_VARINT_SIZE),
+	_readLocation(MAX_VARINT_SIZE)
 {
-	AllocateSizePrefix();
 }
 
 void Message::Append(const void* buffer, unsigned size)
 {
-	assert(_size + size <= MAX_BUFFER_SIZE);
-	memcpy_s(_size + _buffer, size, buffer, size);
-	_size += (unsigned short)size;
+	const char* data = (const char*)buffer;
+	_buffer.insert(_buffer.end(), data, data + size);
 }
 
 bool Message::Read(void* data, unsigned size)
 {
-	if (_readLocation + size > _size)
+	if (_readLocation + size > _buffer.size())
 	{
 		return false;
 	}
 
-	memcpy_s(data, size, _buffer+_readLocation, size);
-	_readLocation += (unsigned short)size;
+	if (size != 0)
+	{
+		memcpy(data, &_buffer[_readLocation], size);
+		_readLocation += size;
+	}
 
 	return true;
 }
@@ -65,15 +119,27 @@ bool Message::Read(void* data, unsigned size)
 
 void Message::Clear()
 {
-	_readLocation = sizeof(unsigned short);
-	_size = sizeof(unsigned short);
+	// Keeps the capacity so reused messages don't allocate
+	_buffer.resize(MAX_VARINT_SIZE);
+	_readLocation = MAX_VARINT_SIZE;
+}
+
+void Message::Reserve(unsigned size)
+{
+	_buffer.reserve(MAX_VARINT_SIZE + size);
+}
+
+void Message::Swap(Message& message)
+{
+	_buffer.swap(message._buffer);
+	std::swap(_readLocation, message._readLocation);
 }
 
 bool Message::ReadString(std::string& string, unsigned short length)
 {
-	int end = _readLocation + length;
+	unsigned end = _readLocation + length;
 
-	if (end > _size)
+	if (end > _buffer.size())
 	{
 		return false;
 	}
@@ -88,24 +154,96 @@ bool Message::ReadString(std::string& string, unsigned short length)
 	return true;
 }
 
-void Message::AllocateSizePrefix()
+const char* Message::Data() const
+{
+	// The prefix is written into the end of the space reserved for it
+	char prefix[MAX_VARINT_SIZE];
+	unsigned prefixSize = EncodeVarint(Size(), prefix);
+	unsigned prefixStart = MAX_VARINT_SIZE - prefixSize;
+
+	memcpy(&_buffer[prefixStart], prefix, prefixSize);
+
+	return &_buffer[prefixStart];
+}
+
+unsigned Message::WireSize() const
 {
-	unsigned short size = 0;
-	Append(size);
+	char prefix[MAX_VARINT_SIZE];
+
+	return EncodeVarint(Size(), prefix) + Size();
+}
+
+unsigned Message::Size() const
+{
+	return _buffer.size() - MAX_VARINT_SIZE;
+}
+
+unsigned Message::EncodeVarint(unsigned value, char* out)
+{
+	unsigned size = 0;
+
+	while (value >= 0x80)
+	{
+		out[size++] = (char)(value | 0x80);
+		value >>= 7;
+	}
+
+	out[size++] = (char)value;
+
+	return size;
 }
 
-char* Message::Data() const
+int Message::DecodeVarint(const char* data, unsigned size, unsigned& value)
 {
-	*(unsigned short*)_buffer = _size;
+	value = 0;
 
-	return _buffer;
+	for (unsigned i = 0; i < MAX_VARINT_SIZE; ++i)
+	{
+		if (i >= size)
+			return 0;
+
+		unsigned char byte = (unsigned char)data[i];
+		value |= (unsigned)(byte & 0x7F) << (7 * i);
+
+		if ((byte & 0x80) == 0)
+			return i + 1;
+	}
+
+	return -1;
+}
+
+MessageView::MessageView() :
+	_data(NULL),
+	_size(0),
+	_readLocation(0)
+{
 }
 
-short Message::Size() const
+MessageView::MessageView(const char* data, unsigned size) :
+	_data(data),
+	_size(size),
+	_readLocation(0)
+{
+}
+
+unsigned MessageView::Size() const
 {
 	return _size;
 }
 
+bool MessageView::ReadString(std::string& string, unsigned short length)
+{
+	if (_readLocation + length > _size)
+	{
+		return false;
+	}
+
+	string.assign(_data + _readLocation, length);
+	_readLocation += length;
+
+	return true;
+}
+
 Address::Address()
 {
 }
@@ -120,6 +258,11 @@ void Address::SetPort(unsigned short port)
 	_addr.sin_port = htons(port);
 }
 
+bool Address::operator==(const Address& address) const
+{
+	return _addr.sin_addr.s_addr == address._addr.sin_addr.s_addr && _addr.sin_port == address._addr.sin_port;
+}
+
 std::ostream& Address::Write(std::ostream& out) const
 {
 	out << inet_ntoa(_addr.sin_addr) << ":" << ntohs(_addr.sin_port);
@@ -142,15 +285,16 @@ UdpSocket::~UdpSocket()
 {
 	if (_socket != INVALID_SOCKET)
 	{
-		closesocket(_socket);
+		System::CloseSocket(_socket);
 	}
 }
 
 void UdpSocket::Bind(unsigned short port)
 {
 	sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
 	addr.sin_family = AF_INET;
-	addr.sin_addr.S_un.S_addr = INADDR_ANY;
+	addr.sin_addr.s_addr = INADDR_ANY;
 	addr.sin_port = htons(port);
 
 	int r = bind(_socket, (sockaddr*)&addr, sizeof(addr));
@@ -158,17 +302,29 @@ void UdpSocket::Bind(unsigned short port)
 	_bound = r != SOCKET_ERROR;
 }
 
+unsigned short UdpSocket::GetPort() const
+{
+	sockaddr_in addr;
+	socklen_t s = sizeof(addr);
+
+	if (getsockname(_socket, (sockaddr*)&addr, &s) == SOCKET_ERROR)
+		return 0;
+
+	return ntohs(addr.sin_port);
+}
+
 void UdpSocket::Broadcast(Message& message, unsigned short port)
 {
 	sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
 	addr.sin_family = AF_INET;
 	addr.sin_port = htons(port);
-	addr.sin_addr.S_un.S_addr = htonl(INADDR_BROADCAST);
+	addr.sin_addr.s_addr = htonl(INADDR_BROADCAST);
 
-	BOOL opt = TRUE;
+	int opt = 1;
 	setsockopt(_socket, SOL_SOCKET, SO_BROADCAST, (char*)&opt, sizeof(opt));
 
-	int r = sendto(_socket, message.Data(), message.Size(), 0, (sockaddr*)&addr, sizeof(addr));
+	int r = sendto(_socket, message.Data(), message.WireSize(), 0, (sockaddr*)&addr, sizeof(addr));
 
 	if (r == SOCKET_ERROR)
 	{
@@ -178,44 +334,73 @@ void UdpSocket::Broadcast(Message& message, unsigned short port)
 
 bool UdpSocket::RecieveFrom(Address& address, Message& message)
 {
-	sockaddr_in addr;
-	int s = sizeof(addr);
-	char buffer[Message::MAX_BUFFER_SIZE];
+	const char* body;
+	unsigned size;
+
+	if (!ReceiveDatagram(address, body, size))
+		return false;
 
-	int r = recvfrom(_socket, buffer, Message::MAX_BUFFER_SIZE, 0, (sockaddr*)&addr, &s);
+	message.Clear();
+	message.Append(body, size);
+
+	return true;
+}
 
-	if (r != SOCKET_ERROR)
+bool UdpSocket::RecieveFrom(Address& address, MessageView& message)
+{
+	const char* body;
+	unsigned size;
+
+	if (!ReceiveDatagram(address, body, size))
+		return false;
+
+	message = MessageView(body, size);
+
+	return true;
+}
+
+bool UdpSocket::ReceiveDatagram(Address& address, const char*& body, unsigned& size)
+{
+	for (;;)
 	{
-		message.Clear();
+		sockaddr_in addr;
+		socklen_t s = sizeof(addr);
 
-		unsigned short messageSize = *(unsigned short*)buffer;
+		int r = recvfrom(_socket, _receiveBuffer, MAX_DATAGRAM_SIZE, 0, (sockaddr*)&addr, &s);
 
-		if (messageSize <= Message::MAX_BUFFER_SIZE)
+		if (r == SOCKET_ERROR)
+		{
+			if (!System::LastErrorWouldBlock())
+			{
+				System::PrintLastError();
+			}
+
+			return false;
+		}
+
+		unsigned messageSize;
+		int prefixSize = Message::DecodeVarint(_receiveBuffer, r, messageSize);
+
+		if (prefixSize > 0 && messageSize <= (unsigned)(r - prefixSize))
 		{
 			address = Address(addr);
-			message.Append(buffer + sizeof(unsigned short), messageSize - sizeof(unsigned short));
+			body = _receiveBuffer + prefixSize;
+			size = messageSize;
 			return true;
 		}
 	}
-	else if (WSAGetLastError() != WSAEWOULDBLOCK)
-	{
-		System::PrintLastError();
-	}
-
-	return false;
 }
 
 void UdpSocket::SetBlocking(bool blocking)
 {
-	u_long arg = !blocking;
-	ioctlsocket(_socket, FIONBIO, &arg);
+	System::SetBlocking(_socket, blocking);
 }
 
 void UdpSocket::SendTo(Address& address, Message& message)
 {
-	int r = sendto(_socket, message.Data(), message.Size(), 0, (sockaddr*)&(address._addr), sizeof(address._addr));
+	int r = sendto(_socket, message.Data(), message.WireSize(), 0, (sockaddr*)&(address._addr), sizeof(address._addr));
 
-	if (r == SOCKET_ERROR)
+	if (r == SOCKET_ERROR && !System::LastErrorWouldBlock())
 	{
 		System::PrintLastError();
 	}
@@ -223,16 +408,18 @@ void UdpSocket::SendTo(Address& address, Message& message)
 
 TcpSocket::TcpSocket() :
 	_socket(INVALID_SOCKET),
+	_frontBytesSent(0),
 	_bytesRead(0),
 	_messageStart(0)
 {
 }
 
 TcpSocket::TcpSocket(Address& address) :
+	_frontBytesSent(0),
 	_bytesRead(0),
 	_messageStart(0)
 {
-	_socket = socket(AF_INET, INADDR_ANY, IPPROTO_TCP);
+	_socket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
 
 	if (_socket != INVALID_SOCKET)
 	{
@@ -246,68 +433,146 @@ TcpSocket::TcpSocket(Address& address) :
 	}
 }
 
-bool TcpSocket::Send(Message& message)
+void TcpSocket::Queue(Message& message)
 {
-	int r = send(_socket, message.Data(), message.Size(), 0);
+	_sendQueue.push_back(Message());
+	_sendQueue.back().Swap(message);
+}
 
-	if (r == SOCKET_ERROR)
+bool TcpSocket::Flush()
+{
+	while (!_sendQueue.empty() && IsOpen())
 	{
-		if (WSAGetLastError() != WSAEWOULDBLOCK)
+#ifdef _WIN32
+		WSABUF buffers[MAX_GATHER_MESSAGES];
+#else
+		iovec buffers[MAX_GATHER_MESSAGES];
+#endif
+		unsigned numBuffers = 0;
+
+		for (; numBuffers < MAX_GATHER_MESSAGES && numBuffers < _sendQueue.size(); ++numBuffers)
 		{
-			System::PrintLastError();
-			Close();
+			const Message& message = _sendQueue[numBuffers];
+
+			// The front message may have been partly sent already
+			unsigned offset = numBuffers == 0 ? _frontBytesSent : 0;
+
+#ifdef _WIN32
+			buffers[numBuffers].buf = (char*)message.Data() + offset;
+			buffers[numBuffers].len = message.WireSize() - offset;
+#else
+			buffers[numBuffers].iov_base = (char*)message.Data() + offset;
+			buffers[numBuffers].iov_len = message.WireSize() - offset;
+#endif
+		}
+
+#ifdef _WIN32
+		DWORD bytesSent = 0;
+		int r = WSASend(_socket, buffers, numBuffers, &bytesSent, 0, NULL, NULL);
+#else
+		msghdr header;
+		memset(&header, 0, sizeof(header));
+		header.msg_iov = buffers;
+		header.msg_iovlen = numBuffers;
+
+		// Report a closed connection as an error rather than raising SIGPIPE
+		ssize_t bytesSent = sendmsg(_socket, &header, MSG_NOSIGNAL);
+		int r = bytesSent < 0 ? SOCKET_ERROR : 0;
+#endif
+
+		if (r == SOCKET_ERROR)
+		{
+			if (!System::LastErrorWouldBlock())
+			{
+				System::PrintLastError();
+				Close();
+			}
+			return false;
+		}
+
+		_frontBytesSent += bytesSent;
+
+		while (!_sendQueue.empty() && _frontBytesSent >= _sendQueue.front().WireSize())
+		{
+			_frontBytesSent -= _sendQueue.front().WireSize();
+			_sendQueue.pop_front();
 		}
-		return false;
 	}
 
-	return true;
+	return _sendQueue.empty();
+}
+
+bool TcpSocket::HasQueuedData() const
+{
+	return !_sendQueue.empty();
 }
 
-bool TcpSocket::Receive(Message& message)
+bool TcpSocket::Receive(MessageView& message)
 {
-	// Edge case, we have 1 byte of a message in the middle of the buffer
-	if (_bytesRead == 1)
+	if (_buffer.size() < RECEIVE_SIZE)
 	{
-		_buffer[0] = _buffer[_messageStart];
-		_messageStart = 0;
+		_buffer.resize(RECEIVE_SIZE);
 	}
 
 	// Read at least one whole message
 	while(IsOpen())
 	{
-		unsigned expectedSize = Message::MAX_BUFFER_SIZE;
+		// Everything has been read so wrap back to the start, the previous
+		// message may have ended at the end of the buffer
+		if (_bytesRead == 0)
+		{
+			_messageStart = 0;
+		}
+
+		unsigned messageSize = 0;
+		int prefixSize = Message::DecodeVarint(&_buffer[0] + _messageStart, _bytesRead, messageSize);
+
+		if (prefixSize < 0 || messageSize > MAX_MESSAGE_SIZE)
+		{
+			Close();
+			return false;
+		}
+
+		unsigned wireSize = prefixSize + messageSize;
+
+		// If we already have a whole message, return a view of it. Nothing is
+		// written over it until the next call
+		if (prefixSize > 0 && _bytesRead >= wireSize)
+		{
+			message = MessageView(&_buffer[0] + _messageStart + prefixSize, messageSize);
+
+			_bytesRead -= wireSize;
+			_messageStart += wireSize;
 
-		// If we already have a whole message, return it
-		if (_bytesRead >= 2)
+			return true;
+		}
+
+		// Make sure the rest of the message fits after its start, and that
+		// there is a reasonable amount of space to receive into
+		unsigned required = _bytesRead + MIN_RECEIVE_SPACE;
+
+		if (prefixSize > 0 && wireSize > required)
+		{
+			required = wireSize;
+		}
+
+		if (_messageStart + required > _buffer.size())
 		{
-			expectedSize = *(unsigned short*)(_buffer + _messageStart);
+			memmove(&_buffer[0], &_buffer[0] + _messageStart, _bytesRead);
+			_messageStart = 0;
 
-			if (_bytesRead >= expectedSize)
+			if (required > _buffer.size())
 			{
-				message.Clear();
-				message.Append(_buffer + _messageStart + sizeof(unsigned short), 
-					expectedSize - sizeof(unsigned short));
-
-				_bytesRead -= expectedSize;
-
-				if (_bytesRead == 0)
-				{
-					_messageStart = 0;
-				}
-				else
-				{
-					_messageStart += expectedSize;
-				}
-
-				return true;
+				_buffer.resize(required);
 			}
 		}
 
-		int r = recv(_socket, _buffer + _messageStart + _bytesRead, expectedSize - _bytesRead, 0);
+		unsigned receiveStart = _messageStart + _bytesRead;
+		int r = recv(_socket, &_buffer[receiveStart], _buffer.size() - receiveStart, 0);
 
 		if (r == SOCKET_ERROR)
 		{
-			if (WSAGetLastError() !=  WSAEWOULDBLOCK)
+			if (!System::LastErrorWouldBlock())
 			{
 				System::PrintLastError();
 				Close();
@@ -315,6 +580,13 @@ bool TcpSocket::Receive(Message& message)
 			return false;
 		}
 
+		// The other end closed the connection
+		if (r == 0)
+		{
+			Close();
+			return false;
+		}
+
 		_bytesRead += r;
 	}
 
@@ -326,7 +598,14 @@ void TcpSocket::SetTimeout(unsigned int milliseconds)
 	if (_socket == INVALID_SOCKET)
 		return;
 
+#ifdef _WIN32
 	DWORD ms = milliseconds;
+#else
+	timeval ms;
+	ms.tv_sec = milliseconds / 1000;
+	ms.tv_usec = (milliseconds % 1000) * 1000;
+#endif
+
 	int r = setsockopt(_socket, SOL_SOCKET, SO_SNDTIMEO, (char*)&ms, sizeof(ms));
 
 	if (r == SOCKET_ERROR)
@@ -346,17 +625,21 @@ void TcpSocket::SetTimeout(unsigned int milliseconds)
 
 void TcpSocket::SetBlocking(bool blocking)
 {
-	u_long arg = !blocking;
-	ioctlsocket(_socket, FIONBIO, &arg);
+	System::SetBlocking(_socket, blocking);
 }
 
 void TcpSocket::Close()
 {
 	if (_socket != INVALID_SOCKET)
 	{
-		closesocket(_socket);
+		System::CloseSocket(_socket);
 		_socket = INVALID_SOCKET;
 	}
+
+	_sendQueue.clear();
+	_frontBytesSent = 0;
+	_bytesRead = 0;
+	_messageStart = 0;
 }
 
 bool TcpSocket::IsOpen()
@@ -366,21 +649,23 @@ bool TcpSocket::IsOpen()
 
 TcpSocket::TcpSocket(SOCKET socket) :
 	_socket(socket),
-	_messageStart(0),
-	_bytesRead(0)
+	_frontBytesSent(0),
+	_bytesRead(0),
+	_messageStart(0)
 {
 }
 
 TcpListener::TcpListener(unsigned short port)
 {
-	_socket = socket(AF_INET, INADDR_ANY, IPPROTO_TCP);
+	_socket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
 
 	if (_socket != INVALID_SOCKET)
 	{
 		sockaddr_in addr;
+		memset(&addr, 0, sizeof(addr));
 		addr.sin_family = AF_INET;
 		addr.sin_port = htons(port);
-		addr.sin_addr.S_un.S_addr = INADDR_ANY;
+		addr.sin_addr.s_addr = INADDR_ANY;
 
 		int r = bind(_socket, (sockaddr*)&addr, sizeof(addr));
 
@@ -402,14 +687,14 @@ TcpListener::~TcpListener()
 {
 	if (_socket != INVALID_SOCKET)
 	{
-		closesocket(_socket);
+		System::CloseSocket(_socket);
 	}
 }
 
 bool TcpListener::Accept(TcpSocket& socket, Address& address)
 {
 	sockaddr_in addr;
-	int size = sizeof(addr);
+	socklen_t size = sizeof(addr);
 	SOCKET s = accept(_socket, (sockaddr*)&addr, &size);  
 
 	socket = TcpSocket(s);
@@ -419,7 +704,7 @@ bool TcpListener::Accept(TcpSocket& socket, Address& address)
 		address = Address(addr);
 		return true;
 	}
-	else if (WSAGetLastError() != WSAEWOULDBLOCK)
+	else if (!System::LastErrorWouldBlock())
 	{
 		System::PrintLastError();
 	}
@@ -429,10 +714,97 @@ bool TcpListener::Accept(TcpSocket& socket, Address& address)
 
 void TcpListener::SetBlocking(bool blocking)
 {
-	u_long arg = !blocking;
-	int r = ioctlsocket(_socket, FIONBIO, &arg);
-	if (r == SOCKET_ERROR)
+	System::SetBlocking(_socket, blocking);
+}
+
+Poller::Poller()
+{
+	_wakeSocket = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+
+	// Bind to any free port on the loopback address, then find out which
+	memset(&_wakeAddress, 0, sizeof(_wakeAddress));
+	_wakeAddress.sin_family = AF_INET;
+	_wakeAddress.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	_wakeAddress.sin_port = 0;
+
+	socklen_t size = sizeof(_wakeAddress);
+
+	if (bind(_wakeSocket, (sockaddr*)&_wakeAddress, sizeof(_wakeAddress)) == SOCKET_ERROR ||
+		getsockname(_wakeSocket, (sockaddr*)&_wakeAddress, &size) == SOCKET_ERROR)
 	{
 		System::PrintLastError();
 	}
+
+	System::SetBlocking(_wakeSocket, false);
+}
+
+Poller::~Poller()
+{
+	if (_wakeSocket != INVALID_SOCKET)
+	{
+		System::CloseSocket(_wakeSocket);
+	}
+}
+
+void Poller::Watch(const UdpSocket& socket)
+{
+	Watch(socket._socket, POLLIN);
+}
+
+void Poller::Watch(const TcpListener& listener)
+{
+	Watch(listener._socket, POLLIN);
+}
+
+void Poller::Watch(const TcpSocket& socket)
+{
+	Watch(socket._socket, socket.HasQueuedData() ? POLLIN | POLLOUT : POLLIN);
+}
+
+void Poller::Watch(SOCKET socket, short events)
+{
+	if (socket == INVALID_SOCKET)
+		return;
+
+	pollfd watched;
+	watched.fd = socket;
+	watched.events = events;
+	watched.revents = 0;
+
+	_sockets.push_back(watched);
+}
+
+bool Poller::Wait(int milliseconds)
+{
+	Watch(_wakeSocket, POLLIN);
+
+#ifdef _WIN32
+	int r = WSAPoll(&_sockets[0], _sockets.size(), milliseconds);
+#else
+	int r = poll(&_sockets[0], _sockets.size(), milliseconds);
+#endif
+
+	if (r == SOCKET_ERROR && !System::LastErrorWouldBlock())
+	{
+		System::PrintLastError();
+	}
+
+	// Clear any wakes so the next wait blocks
+	if ((_sockets.back().revents & POLLIN) != 0)
+	{
+		char buffer[16];
+		while (recv(_wakeSocket, buffer, sizeof(buffer), 0) > 0)
+		{
+		}
+	}
+
+	_sockets.clear();
+
+	return r > 0;
+}
+
+void Poller::Wake()
+{
+	char wake = 0;
+	sendto(_wakeSocket, &wake, sizeof(wake), 0, (sockaddr*)&_wakeAddress, sizeof(_wakeAddress));
 }
\ No newline at end of file
@@ -2,9 +2,26 @@
 
 #pragma once
 
+#ifdef _WIN32
 #include <WinSock2.h>
+typedef int socklen_t;
+#else
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <poll.h>
+typedef int SOCKET;
+const SOCKET INVALID_SOCKET = -1;
+const int SOCKET_ERROR = -1;
+#endif
+
+#include "Uncopyable.h"
 #include <string>
+#include <vector>
+#include <deque>
 #include <iosfwd>
+#include <cstring>
 
 namespace Networking
 {
@@ -19,39 +36,83 @@ namespace Networking
 
 		static void PrintLastError();
 
+		// Hide the differences between WinSock and BSD sockets
+		static bool LastErrorWouldBlock();
+		static void CloseSocket(SOCKET socket);
+		static void SetBlocking(SOCKET socket, bool blocking);
+
 	private:
 
 		static int INSTANCE_COUNT;
 
 	};
 
+	// Messages grow to fit whatever is appended. On the wire each message is
+	// prefixed with the size of its body as a varint, space for the prefix is
+	// kept at the front of the buffer so sending doesn't need a copy
 	class Message
 	{
 
 	public:
 		Message();
 
-		char* Data() const;
-		short Size() const;
+		// The prefixed message as it is sent
+		const char* Data() const;
+		unsigned WireSize() const;
+
+		// The size of the body
+		unsigned Size() const;
 
 		void Clear();
+		void Reserve(unsigned size);
+		void Swap(Message& message);
 		void Append(const void* buffer, unsigned size);
 		template <typename T> void Append(const T& value);
 		template <typename T> bool Read(T& value);
 
-		static const int MAX_BUFFER_SIZE = 512;
+		// Writes value to out as 7 bits per byte, returns the number of bytes written
+		static unsigned EncodeVarint(unsigned value, char* out);
+
+		// Returns the number of bytes read, 0 if more data is needed or -1 if
+		// the data isn't a valid varint
+		static int DecodeVarint(const char* data, unsigned size, unsigned& value);
+
+		static const unsigned MAX_VARINT_SIZE = 5;
 
 	private:
 
 		bool Read(void* data, unsigned length);
 		bool ReadString(std::string& string, unsigned short length);
-		void AllocateSizePrefix();
-		mutable char _buffer[MAX_BUFFER_SIZE];
-		unsigned short _size;
-		unsigned short _readLocation;
+
+		mutable std::vector<char> _buffer;
+		unsigned _readLocation;
 		
 	};
 
+	// Reads a received message in place, without copying it out of the buffer
+	// it was received into. A view from a TcpSocket is only valid until the
+	// socket next receives
+	class MessageView
+	{
+
+	public:
+		MessageView();
+		MessageView(const char* data, unsigned size);
+
+		unsigned Size() const;
+
+		template <typename T> bool Read(T& value);
+
+	private:
+
+		bool ReadString(std::string& string, unsigned short length);
+
+		const char* _data;
+		unsigned _size;
+		unsigned _readLocation;
+
+	};
+
 #include "Message.inl"
 
 	class Address
@@ -59,6 +120,7 @@ namespace Networking
 		friend class UdpSocket;
 		friend class TcpSocket;
 		friend class TcpListener;
+		friend class Poller;
 
 	public:
 
@@ -67,6 +129,9 @@ namespace Networking
 
 		void SetPort(unsigned short port);
 
+		// Compares both the ip and port
+		bool operator==(const Address& address) const;
+
 		std::ostream& Write(std::ostream& out) const;
 
 	private:
@@ -78,36 +143,64 @@ namespace Networking
 
 	class UdpSocket
 	{
+		friend class Poller;
 
 	public:
 
+		// Larger datagrams are truncated when received, this keeps a datagram
+		// within a single ethernet frame
+		static const unsigned MAX_DATAGRAM_SIZE = 1400;
+
 		UdpSocket();
 		~UdpSocket();
 
+		// Port 0 binds to any free port
 		void Bind(unsigned short port);
+		unsigned short GetPort() const;
+
+		// Datagrams which can't be sent straight away are dropped
 		void SendTo(Address& address, Message& message);
 		bool RecieveFrom(Address& address, Message& message);
+
+		// Reads the datagram in place, the view is valid until the socket next receives
+		bool RecieveFrom(Address& address, MessageView& message);
 		void Broadcast(Message& message, unsigned short port);
 		void SetBlocking(bool blocking);
 
 	private:
 
+		// Receives the next datagram with a valid prefix into the receive buffer,
+		// skipping any without one
+		bool ReceiveDatagram(Address& address, const char*& body, unsigned& size);
+
 		SOCKET _socket;
 		bool _bound;
 
+		char _receiveBuffer[MAX_DATAGRAM_SIZE];
+
 	};
 
 	class TcpSocket
 	{
 		friend class TcpListener;
+		friend class Poller;
 
 	public:
 
 		TcpSocket();
 		TcpSocket(Address& address);
 
-		bool Send(Message& message);
-		bool Receive(Message& message);
+		// Takes the contents of the message and queues it to be sent, leaving
+		// the message empty
+		void Queue(Message& message);
+
+		// Sends as much of the queue as the socket will take in a single gather
+		// write, returns true if the queue has been completely sent
+		bool Flush();
+		bool HasQueuedData() const;
+
+		// The view is valid until Receive is called again
+		bool Receive(MessageView& message);
 
 		void SetTimeout(unsigned int milliseconds);
 
@@ -122,14 +215,32 @@ namespace Networking
 
 		SOCKET _socket;
 
-		char _buffer[Message::MAX_BUFFER_SIZE*2];
+		std::deque<Message> _sendQueue;
+		unsigned _frontBytesSent;
+
+		// Received data is parsed where it lands. The unread data starts at
+		// _messageStart and wraps back to the start of the buffer whenever it is
+		// all read. Messages are never split across the end of the buffer
+		std::vector<char> _buffer;
 		unsigned _bytesRead;
 		unsigned _messageStart;
 
+		// Larger messages are treated as corrupt and close the socket
+		static const unsigned MAX_MESSAGE_SIZE = 16 * 1024 * 1024;
+		static const unsigned RECEIVE_SIZE = 64 * 1024;
+
+		// When less space than this is left after the unread data, the unread
+		// data, which is part of a single message, is moved to the front
+		static const unsigned MIN_RECEIVE_SPACE = 8 * 1024;
+
+		// Messages sent by one gather write
+		static const unsigned MAX_GATHER_MESSAGES = 64;
+
 	};
 
 	class TcpListener
 	{
+		friend class Poller;
 
 	public:
 
@@ -145,6 +256,42 @@ namespace Networking
 
 	};
 
+	// Poller blocks a thread until one of the sockets it is watching can be
+	// read from or written to, or until Wake is called by another thread.
+	// Sockets are watched for a single Wait, so the sockets being waited on
+	// can change from one wait to the next. Uses poll, or WSAPoll on Windows
+	class Poller : public Uncopyable
+	{
+
+	public:
+
+		Poller();
+		~Poller();
+
+		void Watch(const UdpSocket& socket);
+		void Watch(const TcpListener& listener);
+
+		// Also waits for the socket to be writable while it has queued data
+		void Watch(const TcpSocket& socket);
+
+		// Returns false if the wait timed out
+		bool Wait(int milliseconds);
+
+		// Thread safe, makes the current wait, or the next one, return
+		void Wake();
+
+	private:
+
+		void Watch(SOCKET socket, short events);
+
+		std::vector<pollfd> _sockets;
+
+		// Wake sends a datagram to this loopback socket, which is always watched
+		SOCKET _wakeSocket;
+		sockaddr_in _wakeAddress;
+
+	};
+
 };
 
 
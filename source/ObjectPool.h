@@ -0,0 +1,128 @@
+// David Hart - 2012
+//
+// class ObjectPool
+//   ObjectPool hands out storage for objects of a single type from chunks which
+//   are allocated together and never released until the pool is destroyed.
+//   Freed objects are destroyed and their storage is put onto a free list to be
+//   reused by the next allocation, so once a pool has grown to the peak number
+//   of objects no more memory is allocated
+//
+// struct ObjectHandle
+//   Handles refer to an object through a slot in a table owned by the world. The
+//   generation of a slot is incremented whenever its object is destroyed, so a
+//   handle to a destroyed object can be detected even after the slot is reused
+
+#pragma once
+
+#include <vector>
+#include <cassert>
+#include <new>
+
+namespace Physics
+{
+	struct ObjectHandle
+	{
+		ObjectHandle() :
+			_index(-1),
+			_generation(0)
+		{
+		}
+
+		ObjectHandle(int index, unsigned generation) :
+			_index(index),
+			_generation(generation)
+		{
+		}
+
+		bool IsValid() const
+		{
+			return _index >= 0;
+		}
+
+		int _index;
+		unsigned _generation;
+	};
+
+	template <typename T> class ObjectPool
+	{
+
+	public:
+
+		static const int CHUNK_SIZE = 256;
+
+		ObjectPool() :
+			_numAllocated(0)
+		{
+		}
+
+		~ObjectPool()
+		{
+			// Objects must be freed before the pool is destroyed
+			assert(_numAllocated == 0);
+
+			for (unsigned i = 0; i < _chunks.size(); ++i)
+			{
+				delete [] _chunks[i];
+			}
+		}
+
+		// Returns uninitialised storage for one object, which should be constructed
+		// with placement new
+		void* Allocate()
+		{
+			if (_freeList.size() == 0)
+			{
+				AddChunk();
+			}
+
+			void* storage = _freeList.back();
+			_freeList.pop_back();
+			_numAllocated++;
+
+			return storage;
+		}
+
+		void Free(T* object)
+		{
+			assert(_numAllocated > 0);
+
+			object->~T();
+			_freeList.push_back(object);
+			_numAllocated--;
+		}
+
+		// Grows the pool so count objects can be allocated without allocating memory
+		void Reserve(int count)
+		{
+			while (_numAllocated + (int)_freeList.size() < count)
+			{
+				AddChunk();
+			}
+		}
+
+		inline int GetNumAllocated() const
+		{
+			return _numAllocated;
+		}
+
+	private:
+
+		void AddChunk()
+		{
+			char* chunk = new char[sizeof(T) * CHUNK_SIZE];
+			_chunks.push_back(chunk);
+
+			_freeList.reserve(_freeList.size() + CHUNK_SIZE);
+
+			// Push in reverse so objects are handed out in address order
+			for (int i = CHUNK_SIZE - 1; i >= 0; --i)
+			{
+				_freeList.push_back(chunk + sizeof(T) * i);
+			}
+		}
+
+		std::vector<char*> _chunks;
+		std::vector<void*> _freeList;
+		int _numAllocated;
+	};
+}
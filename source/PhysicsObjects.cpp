@@ -3,47 +3,46 @@
 #include "PhysicsObjects.h"
 #include "World.h"
 #include "ShapeBatch.h"
-#include "AABB.h"
 #include <algorithm>
 
 using namespace Physics;
 
 bool Contact::BoxBoxCollision(const PhysicsObject& a, const PhysicsObject& b)
 {
-	AABB abb(a.GetPosition() - Vector2d(0.5, 0.5), a.GetPosition() + Vector2d(0.5, 0.5));
-	AABB bbb(b.GetPosition() - Vector2d(0.5, 0.5), b.GetPosition() + Vector2d(0.5, 0.5));
-
-	if (abb.Intersects(bbb, _penetrationDistance, _contactNormal))
-	{
-		_static = false;
-		_velocityA = a.GetVelocity();
-		_massA = a.GetMass();
-		_velocityB = b.GetVelocity();
-		_massB = b.GetMass();
-
-		return true;
-	}
-
-	return false;
+	// Unit boxes overlap when their centres are closer than 1 on both axes
+	return Overlap(a.GetPosition() - b.GetPosition(), 1);
 }
 
 bool Contact::BoxPointCollision(const PhysicsObject& a, const PhysicsObject& b)
 {
-	AABB abb(a.GetPosition() - Vector2d(0.5, 0.5), a.GetPosition() + Vector2d(0.5, 0.5));
-	Vector2d point = b.GetPosition();
+	return Overlap(a.GetPosition() - b.GetPosition(), (Real)0.5);
+}
 
-	if (abb.Intersects(point, _penetrationDistance, _contactNormal))
-	{
-		_static = false;
-		_velocityA = a.GetVelocity();
-		_massA = a.GetMass();
-		_velocityB = b.GetVelocity();
-		_massB = b.GetMass();
+bool Contact::Overlap(const Vector2r& delta, Real overlapDistance)
+{
+	// Same test as AABB::Intersects, done in the simulation's precision
+	if (delta.x() == 0 && delta.y() == 0)
+		return false;
 
-		return true;
+	Real distanceX = abs(delta.x());
+	Real distanceY = abs(delta.y());
+
+	if (distanceX >= overlapDistance || distanceY >= overlapDistance)
+		return false;
+
+	// Push apart along the axis with the least overlap
+	if (distanceX < distanceY)
+	{
+		_penetrationDistance = (float)((overlapDistance - distanceY) / 2);
+		_normal = (unsigned char)(delta.y() > 0 ? NORMAL_POSITIVE_Y : NORMAL_NEGATIVE_Y);
+	}
+	else
+	{
+		_penetrationDistance = (float)((overlapDistance - distanceX) / 2);
+		_normal = (unsigned char)(delta.x() > 0 ? NORMAL_POSITIVE_X : NORMAL_NEGATIVE_X);
 	}
 
-	return false;
+	return true;
 }
 
 bool Contact::PointBoxCollision(const PhysicsObject& a, const PhysicsObject& b)
@@ -59,132 +58,76 @@ bool Contact::PointBoxCollision(const PhysicsObject& a, const PhysicsObject& b)
 
 void Contact::Reverse()
 {
-	_contactNormal = -_contactNormal;
-	std::swap(_velocityA, _velocityB);
-	std::swap(_massA, _massB);
-}
-
-FixedEndSpringConstraint::FixedEndSpringConstraint() :
-	_k(4),
-	_b(2)
-{
-}
-
-Vector2d FixedEndSpringConstraint::CalculateAcceleration(const State& state) const
-{
-	// TODO: Refactor into objectspace - worldspace function
-	Vector2d worldSpaceAttachmentPoint = state._position + _attachmentPoint;
-
-	Vector2d extension = worldSpaceAttachmentPoint - _endPoint;
-
-	return -_k * extension - _b * state._velocity;
-}
-
-void FixedEndSpringConstraint::SetFixedEndpoint(const Vector2d& position)
-{
-	_endPoint = position;
-}
-
-void FixedEndSpringConstraint::SetSpringConstant(double k)
-{
-	_k = k;
-}
-
-void FixedEndSpringConstraint::SetDampingConstant(double b)
-{
-	_b = b;
-}
-
-void FixedEndSpringConstraint::SetObjectSpaceAttachmentPoint(const Vector2d& position)
-{
-	_attachmentPoint = position;
-}
-
-Vector2d FixedEndSpringConstraint::GetAttachmentPoint()
-{
-	return _attachmentPoint;
-}
-
-LengthSpring::LengthSpring() :
-	_k(80),
-	_b(1.5),
-	_l(1)
-{
-}
-
-Vector2d LengthSpring::CalculateAcceleration(const State& state) const
-{
-	Vector2d direction = _object->GetPosition() - state._position;
-	double length = direction.length();
-
-	direction /= length;
-
-	double stretch = length - _l;
-
-	return (_k * direction * stretch - _b * direction * direction.dot(state._velocity - _object->GetVelocity())) / 2.0;
-}
-
-void LengthSpring::SetEndpoint(Physics::PhysicsObject* object)
-{
-	_object = object;
-}
-
-void LengthSpring::SetLength(double length)
-{
-	_l = length;
+	// Opposite normals differ only in the lowest bit
+	_normal ^= 1;
 }
 
-void LengthSpring::SetSpringConstant(double k)
+Vector2r Contact::GetNormal() const
 {
-	_k = k;
-}
+	static const Vector2r NORMALS[4] = 
+	{
+		Vector2r(1, 0),
+		Vector2r(-1, 0),
+		Vector2r(0, 1),
+		Vector2r(0, -1),
+	};
 
-void LengthSpring::SetDampingConstant(double b)
-{
-	_b = b;
+	return NORMALS[_normal];
 }
 
 PhysicsObject::PhysicsObject() :
+	_halfExtent(0),
 	_mass(1),
+	_firstContact(-1),
+	_lastContact(-1),
+	_numContacts(0),
+	_contactArena(0),
+	_constraintAcceleration(0),
+	_constraintStiffness(0),
+	_constraintDamping(0),
 	_ownerId(0),
+	_held(false),
 	_parent(NULL),
 	_id(-1)
 {
-	_contacts.reserve(MAX_CONTACTS);
-
 	SetColor(Color((float)Util::RandRange(0, 1), (float)Util::RandRange(0, 1), (float)Util::RandRange(0, 1), 1.0f));
 }
 
-void PhysicsObject::SetPosition(const Vector2d& position)
+void PhysicsObject::SetPosition(const Vector2r& position)
 {
 	_state._position = position;
 }
 
-Vector2d PhysicsObject::GetPosition() const
+Vector2r PhysicsObject::GetPosition() const
 {
 	return _state._position;
 }
 
-void PhysicsObject::SetVelocity(const Vector2d& velocity)
+void PhysicsObject::SetVelocity(const Vector2r& velocity)
 {
 	_state._velocity = velocity;
 }
 
-Vector2d PhysicsObject::GetVelocity() const
+Vector2r PhysicsObject::GetVelocity() const
 {
 	return _state._velocity;
 }
 
-double PhysicsObject::GetMass() const
+Real PhysicsObject::GetMass() const
 {
 	return _mass;
 }
 
-void PhysicsObject::SetMass(double mass)
+void PhysicsObject::SetMass(Real mass)
 {
 	_mass = mass;
 }
 
+Real PhysicsObject::GetHalfExtent() const
+{
+	return _halfExtent;
+}
+
 void PhysicsObject::SetColor(const Color& color)
 {
 	_color = color;
@@ -210,144 +153,178 @@ unsigned PhysicsObject::GetOwnerId()
 	return _ownerId;
 }
 
-void PhysicsObject::AddContact(const Contact& contact)
-{
-	_contacts.push_back(contact);
-	//assert(_contacts.size() <= MAX_CONTACTS);
-}
-
-void PhysicsObject::AddConstraint(const Constraint* constraint)
+void PhysicsObject::AddContact(Contact& contact, unsigned arenaId, ContactArena& arena)
 {
-	// Constraint should not already be in the list
-	assert(std::find(_constraints.begin(), _constraints.end(), constraint) == _constraints.end());
+	contact._next = -1;
+	arena.push_back(contact);
 
-	_constraints.push_back(constraint);	
-}
-
-void PhysicsObject::RemoveConstraint(const Constraint* constraint)
-{
-	std::vector<const Constraint*>::iterator it = std::find(_constraints.begin(), _constraints.end(), constraint);
+	int index = arena.size() - 1;
 
-	if (it != _constraints.end())
-		_constraints.erase(it);
+	// Append to the end of the list so contacts are solved in the order they were found
+	if (_firstContact < 0)
+	{
+		_firstContact = index;
+		_contactArena = (unsigned char)arenaId;
+	}
+	else
+	{
+		assert(_contactArena == arenaId);
+		arena[_lastContact]._next = index;
+	}
 
-	// There should be no more copies of the constraint in the list
-	assert(std::find(_constraints.begin(), _constraints.end(), constraint) == _constraints.end());
+	_lastContact = index;
+	_numContacts++;
 }
 
-void PhysicsObject::SolveContacts(World& world)
+void PhysicsObject::SolveContacts(World& world, unsigned threadId)
 {
-	ProcessCollisions(world);
+	if (_firstContact < 0)
+		return;
 
-	// Sort contacts by their normal projected onto the gravity vector
+	const ContactArena& arena = world.GetContactArena(_contactArena);
+
+	// Solve contacts in order of their normal projected onto the gravity vector
 	// This prevents collisions of objects on top causing lower objects to sink
 	// into each other and the ground, this implementation works for gravity down
 	// the y axis but a more general solution based on the forces acting on an object
-	// would be preferred
-	for (unsigned i = 0; i < _contacts.size(); ++i)
+	// would be preferred. Normals are axis aligned, so rather than sorting the
+	// contacts the list is walked once for each possible normal y
+	Real order[3] = { -1, 0, 1 };
+	if (_state._position.y() >= 80.0)
+		std::swap(order[0], order[2]);
+
+	Real elasticity = (Real)world.GetElasticity();
+	Real friction = (Real)world.GetFriction();
+	Real mass = GetMass();
+
+	for (int pass = 0; pass < 3; ++pass)
 	{
-		for (unsigned j = 0; j < _contacts.size() - i - 1; ++j)
+		for (int i = _firstContact; i >= 0; i = arena[i]._next)
 		{
-			if (_state._position.y() < 80.0)
-			{
-				if (_contacts[j+1]._contactNormal.y() < _contacts[j]._contactNormal.y())
-				{
-					std::swap(_contacts[j+1], _contacts[j]);
-				}
-			}
-			else
-			{
-				if (_contacts[j+1]._contactNormal.y() > _contacts[j]._contactNormal.y())
-				{
-					std::swap(_contacts[j+1], _contacts[j]);
-				}
-			}
-		}
-	}
+			const Contact& contact = arena[i];
+			Vector2r normal = contact.GetNormal();
 
+			if (normal.y() != order[pass])
+				continue;
 
-	double elasticity = world.GetElasticity();
-	double friction = world.GetFriction();
+			// The world boundary doesn't move and has no mass
+			Vector2r otherVelocity(0);
+			Real otherMass = 0;
+			bool otherPeer = false;
 
-	Vector2d originalPosition = _state._position;
+			if (contact._other >= 0)
+			{
+				PhysicsObject* other = world.GetObject(contact._other);
 
-	for (unsigned i = 0; i < _contacts.size(); ++i)
-	{
-		const Contact& contact = _contacts[i];
+				// The other peer solves this contact and sends us our half of it
+				if (other->GetOwnerId() < _ownerId)
+					continue;
 
-		Vector2d relVel = _state._velocity * contact._massA - contact._velocityB * contact._massB;
+				otherPeer = other->GetOwnerId() != _ownerId;
+				otherVelocity = world.GetCollisionVelocity(contact._other);
+				otherMass = other->GetMass();
+			}
 
-		// Apply friction
-		if (abs(_state._velocity.dot(contact._contactNormal)) > Util::EPSILON)
-		{
-			Vector2d tangent = contact._contactNormal.tangent();
-			double VdotT = tangent.dot(relVel) / GetMass();
-			_state._velocity -= tangent * VdotT * friction;
-		}
+			Vector2r velocityBefore = _state._velocity;
+
+			Vector2r relVel = _state._velocity * mass - otherVelocity * otherMass;
+
+			// Apply friction
+			if (abs(_state._velocity.dot(normal)) > Util::EPSILON)
+			{
+				Vector2r tangent = normal.tangent();
+				Real VdotT = tangent.dot(relVel) / mass;
+				_state._velocity.addScaled(tangent, -VdotT * friction);
+			}
 		
-		// Conservation of momentum
-		double relVeldotN = relVel.dot(contact._contactNormal);
-		if (relVeldotN < 0)
-		{
-			double normalImpulse = -((1.0 + elasticity) * contact._contactNormal.dot(relVel)) * (contact._massA / (contact._massA + contact._massB));
-			_state._velocity += contact._contactNormal * normalImpulse / GetMass();
-		}
+			// Conservation of momentum
+			Real relVeldotN = relVel.dot(normal);
+			if (relVeldotN < 0)
+			{
+				Real normalImpulse = -((1 + elasticity) * normal.dot(relVel)) * (mass / (mass + otherMass));
+				_state._velocity.addScaled(normal, normalImpulse / mass);
+			}
 
-		// Separate the objects
-		/*
-		double deltaDotNormal = (_state._position - originalPosition).dot(contact._contactNormal);
-		*/
+			// Stop objects above causing delta positions
+			if (normal.y() > 0)
+			{
+				_state._position += normal * Util::Max<Real>(contact._penetrationDistance * 2 / (Real)3, 0);
+			}
+			else
+			{
+				_state._position += normal * Util::Max<Real>(contact._penetrationDistance / (Real)3, 0);
+			}
 
-		// Stop objects above causing delta positions
-		if (contact._contactNormal.y() > 0)
-		{
-			_state._position += contact._contactNormal * Util::Max(contact._penetrationDistance * 2 / 3.0, 0.0);
-		}
-		else
-		{
-			_state._position += contact._contactNormal * Util::Max(contact._penetrationDistance / 3.0, 0.0);
+			// The other object takes the opposite change in momentum, and is moved
+			// out by the share it would have taken had it solved the contact itself
+			if (otherPeer)
+			{
+				ContactImpulse impulse;
+				impulse._object = contact._other;
+				impulse._velocity = (velocityBefore - _state._velocity) * (mass / otherMass);
+
+				if (normal.y() < 0)
+				{
+					impulse._position = -normal * Util::Max<Real>(contact._penetrationDistance * 2 / (Real)3, 0);
+				}
+				else
+				{
+					impulse._position = -normal * Util::Max<Real>(contact._penetrationDistance / (Real)3, 0);
+				}
+
+				world.AddContactImpulse(threadId, impulse);
+			}
 		}
 	}
 
-	_contacts.clear();
+	ClearContacts();
 }
 
-Vector2d PhysicsObject::CalculateAcceleration(const State& state, World& world) const
+Vector2r PhysicsObject::CalculateAcceleration(const State& state, World& world) const
 {
-	Vector2d acceleration(0);
+	Vector2r springAcceleration = _constraintAcceleration
+		- (state._position - _state._position) * _constraintStiffness
+		- (state._velocity - _state._velocity) * _constraintDamping;
 
-	for (unsigned i = 0; i < _constraints.size(); ++i)
-	{
-		acceleration += _constraints[i]->CalculateAcceleration(state);
-	}
-	
-	return acceleration + Vector2d(0, world.GetGravity()) /*- state._velocity*0.999*/; // Gravity and drag
+	return springAcceleration + Vector2r(0, (Real)world.GetGravity()) /*- state._velocity*0.999*/; // Gravity and drag
 }
 
-void PhysicsObject::Integrate(double deltaTime, World& world)
+void PhysicsObject::ClearContacts()
 {
-	_contacts.clear();
+	_firstContact = -1;
+	_lastContact = -1;
+	_numContacts = 0;
+}
+
+void PhysicsObject::Integrate(Real deltaTime, World& world)
+{
+	ClearContacts();
 
 	// Integrate using RK4 method
 	Derivative d;
 	Derivative a = EvaluateDerivative(_state, d, 0, world);
-    Derivative b = EvaluateDerivative(_state, a, deltaTime*0.5, world);
-    Derivative c = EvaluateDerivative(_state, b, deltaTime*0.5, world);
+    Derivative b = EvaluateDerivative(_state, a, deltaTime / 2, world);
+    Derivative c = EvaluateDerivative(_state, b, deltaTime / 2, world);
     d = EvaluateDerivative(_state, c, deltaTime, world);
 
 	Derivative derivative;
-	derivative._velocity = 1.0/6.0 * (a._velocity + 2.0*(b._velocity + c._velocity) + d._velocity);
-	derivative._acceleration = 1.0/6.0 * (a._acceleration + 2.0*(b._acceleration + c._acceleration) + d._acceleration);
+	const Real sixth = (Real)(1.0 / 6.0);
+	derivative._velocity = sixth * (a._velocity + (Real)2 * (b._velocity + c._velocity) + d._velocity);
+	derivative._acceleration = sixth * (a._acceleration + (Real)2 * (b._acceleration + c._acceleration) + d._acceleration);
+
+	_state._position.addScaled(derivative._velocity, deltaTime);
+	_state._velocity.addScaled(derivative._acceleration, deltaTime);
 
-	_state._position += derivative._velocity * deltaTime;
-	_state._velocity += derivative._acceleration * deltaTime;
+	_constraintAcceleration = Vector2r(0);
+	_constraintStiffness = 0;
+	_constraintDamping = 0;
 }
 
-Derivative PhysicsObject::EvaluateDerivative(const State& initialState, Derivative& derivative, double deltaTime, World& world)
+Derivative PhysicsObject::EvaluateDerivative(const State& initialState, Derivative& derivative, Real deltaTime, World& world)
 {
 	State state;
-	state._position = initialState._position + derivative._velocity * deltaTime;
-	state._velocity = initialState._velocity + derivative._acceleration * deltaTime;
+	state._position = MulAdd(initialState._position, derivative._velocity, deltaTime);
+	state._velocity = MulAdd(initialState._velocity, derivative._acceleration, deltaTime);
 
 	Derivative d;
 	d._velocity = state._velocity;
@@ -361,6 +338,16 @@ bool PhysicsObject::CanMigrate()
 	return _parent == NULL;
 }
 
+void PhysicsObject::SetHeld(bool held)
+{
+	_held = held;
+}
+
+bool PhysicsObject::IsHeld() const
+{
+	return _held;
+}
+
 void PhysicsObject::SetParent(PhysicsObject* parent)
 {
 	_parent = parent;
@@ -380,9 +367,28 @@ int PhysicsObject::GetId()
 {
 	return _id;
 }
-BoxObject::BoxObject(int quad) :
-	_quad(quad)
+
+void PhysicsObject::SetHandle(const ObjectHandle& handle)
+{
+	_handle = handle;
+}
+
+const ObjectHandle& PhysicsObject::GetHandle() const
+{
+	return _handle;
+}
+
+void PhysicsObject::ReleaseShapes(World&)
+{
+}
+
+void PhysicsObject::ShapeMoved(int, int)
+{
+}
+BoxObject::BoxObject(World& world) :
+	_quad(world.CreateQuad(this))
 {
+	_halfExtent = 0.5;
 }
 
 void BoxObject::UpdateShape(World& world)
@@ -396,50 +402,16 @@ void BoxObject::UpdateShape(World& world)
 	world.UpdateQuad(_quad, quad);
 }
 
-void BoxObject::ProcessCollisions(World& world)
+void BoxObject::ReleaseShapes(World& world)
 {
-	Contact contact;
-	//contact._relativeVelocity = GetVelocity();
-	contact._velocityA = GetVelocity();
-	contact._massA = GetMass();
-	contact._velocityB = Vector2d(0);
-	contact._massB = 0;
-	contact._static = true;
-	Vector2d position = GetPosition();
-
-	// top
-	if (position.y() > world.GetWorldMax().y() - 0.5)
-	{
-		contact._penetrationDistance = position.y() -  world.GetWorldMax().y() + 0.5;
-		contact._contactNormal = Vector2d(0, -1);
-		AddContact(contact);
-	}
-
-	// bottom
-	if (position.y() < world.GetWorldMin().y() + 0.5)
-	{
-		contact._penetrationDistance = world.GetWorldMin().y() - position.y() + 0.5;
-		contact._contactNormal = Vector2d(0, 1);
-		AddContact(contact);
-	}
-	
-	// left
-	if (position.x() > world.GetWorldMax().x() - 0.5)
-	{
-		contact._penetrationDistance = position.x() - world.GetWorldMax().x() + 0.5;
-		contact._contactNormal = Vector2d(-1, 0);
-		AddContact(contact);
-	}
-
-	// right
-	if (position.x() < world.GetWorldMin().x() + 0.5)
-	{
-		contact._penetrationDistance = world.GetWorldMin().x() - position.x() + 0.5;
-		contact._contactNormal = Vector2d(1, 0);
-		AddContact(contact);
-	}
+	world.RemoveQuad(_quad);
+	_quad = -1;
 }
 
+void BoxObject::ShapeMoved(int, int newIndex)
+{
+	_quad = newIndex;
+}
 
 unsigned int BoxObject::GetSerializationType()
 {
@@ -466,9 +438,10 @@ bool BoxObject::TestCollision(BlobbyPart& object, Contact& contact)
 	return contact.PointBoxCollision(object, *this);
 }
 
-TriangleObject::TriangleObject(int quad) :
-	_triangle(quad)
+TriangleObject::TriangleObject(World& world) :
+	_triangle(world.CreateTriangle(this))
 {
+	_halfExtent = 0.5;
 }
 
 void TriangleObject::UpdateShape(World& world)
@@ -482,48 +455,15 @@ void TriangleObject::UpdateShape(World& world)
 	world.UpdateTriangle(_triangle, t);
 }
 
-void TriangleObject::ProcessCollisions(World& world)
+void TriangleObject::ReleaseShapes(World& world)
 {
-	Contact contact;
-	//contact._relativeVelocity = GetVelocity();
-	contact._velocityA = GetVelocity();
-	contact._massA = GetMass();
-	contact._velocityB = Vector2d(0);
-	contact._massB = 0;
-	contact._static = true;
-	Vector2d position = GetPosition();
-
-	// top
-	if (position.y() > world.GetWorldMax().y() - 0.5)
-	{
-		contact._penetrationDistance = position.y() -  world.GetWorldMax().y() + 0.5;
-		contact._contactNormal = Vector2d(0, -1);
-		AddContact(contact);
-	}
-
-	// bottom
-	if (position.y() < world.GetWorldMin().y() + 0.5)
-	{
-		contact._penetrationDistance = world.GetWorldMin().y() - position.y() + 0.5;
-		contact._contactNormal = Vector2d(0, 1);
-		AddContact(contact);
-	}
-	
-	// left
-	if (position.x() > world.GetWorldMax().x() - 0.5)
-	{
-		contact._penetrationDistance = position.x() - world.GetWorldMax().x() + 0.5;
-		contact._contactNormal = Vector2d(-1, 0);
-		AddContact(contact);
-	}
+	world.RemoveTriangle(_triangle);
+	_triangle = -1;
+}
 
-	// right
-	if (position.x() < world.GetWorldMin().x() + 0.5)
-	{
-		contact._penetrationDistance = world.GetWorldMin().x() - position.x() + 0.5;
-		contact._contactNormal = Vector2d(1, 0);
-		AddContact(contact);
-	}
+void TriangleObject::ShapeMoved(int, int newIndex)
+{
+	_triangle = newIndex;
 }
 
 bool TriangleObject::TestCollision(PhysicsObject& object, Contact& contact)
@@ -560,47 +500,15 @@ unsigned BlobbyPart::GetSerializationType()
 	return OBJECT_BLOBBY_PART;
 }
 
-void BlobbyPart::ProcessCollisions(World& world)
+void BlobbyPart::Integrate(Real deltaTime, World& world)
 {
-	Contact contact;
-	contact._velocityA = GetVelocity();
-	contact._massA = GetMass();
-	contact._velocityB = Vector2d(0);
-	contact._massB = 0;
-	contact._static = true;
-	Vector2d position = GetPosition();
-
-	// top
-	if (position.y() > world.GetWorldMax().y())
-	{
-		contact._penetrationDistance = position.y() -  world.GetWorldMax().y();
-		contact._contactNormal = Vector2d(0, -1);
-		AddContact(contact);
-	}
-
-	// bottom
-	if (position.y() < world.GetWorldMin().y())
-	{
-		contact._penetrationDistance = world.GetWorldMin().y() - position.y();
-		contact._contactNormal = Vector2d(0, 1);
-		AddContact(contact);
-	}
-	
-	// left
-	if (position.x() > world.GetWorldMax().x())
+	if (GetParent() != NULL)
 	{
-		contact._penetrationDistance = position.x() - world.GetWorldMax().x();
-		contact._contactNormal = Vector2d(-1, 0);
-		AddContact(contact);
+		ClearContacts();
+		return;
 	}
 
-	// right
-	if (position.x() < world.GetWorldMin().x())
-	{
-		contact._penetrationDistance = world.GetWorldMin().x() - position.x();
-		contact._contactNormal = Vector2d(1, 0);
-		AddContact(contact);
-	}
+	PhysicsObject::Integrate(deltaTime, world);
 }
 
 bool BlobbyPart::TestCollision(PhysicsObject& object, Contact& contact)
@@ -624,69 +532,100 @@ bool BlobbyPart::TestCollision(BlobbyPart&, Contact&)
 	return false;
 }
 
-int BlobbyObject::GetPart(int i)
+const Real BlobbyObject::DEFAULT_STIFFNESS = 500;
+
+BlobbyObject::BlobbyObject(World& world, int numParts, Real stiffness) :
+	_radius(2.0),
+	_stiffness(stiffness)
 {
-	if (i < 0) i+= NUM_PARTS;
+	assert(numParts >= MIN_NUM_PARTS && numParts <= MAX_NUM_PARTS);
 
-	return i % NUM_PARTS;
-}
+	const Real angle = (Real)(2.0 * PI / numParts);
 
-BlobbyObject::BlobbyObject(World& world) :
-	_radius(2.0)
-{
-	double angle = 2.0 * PI / NUM_PARTS;
+	// Spring constants, the part to part springs get weaker as they get longer
+	const Real midK = stiffness * (Real)0.08;
+	const Real midB = (Real)0.75;
+	const Real partB = (Real)0.75;
+	const Real maxLength = _radius * 2;
+	const Real maxStrength = stiffness;
+	const Real minStrength = stiffness * (Real)0.2;
+
+	_parts.resize(numParts);
+	_triangles.resize(numParts);
 
-	for (int i = 0; i < NUM_PARTS; ++i)
+	_springs.AddParticle(this);
+
+	for (int i = 0; i < numParts; ++i)
 	{
-		_triangles[i] = world.CreateTriangle();
+		_triangles[i] = world.CreateTriangle(this);
 
 		_parts[i] = world.AddBlobbyPart();
 		_parts[i]->SetParent(this);
 		_parts[i]->SetMass(1.0);
 
-		_parts[i]->SetPosition(_state._position + _radius * Vector2d(sin(i * angle), cos(i * angle)));
+		_parts[i]->SetPosition(_state._position + _radius * Vector2r(sin(i * angle), cos(i * angle)));
+
+		_springs.AddParticle(_parts[i]);
 	}
-	int partId = 0;
-	for (int i = 0; i < NUM_PARTS; ++i)
-	{
-		_parts[i]->AddConstraint(_partToMid + i);
-		_partToMid[i].SetEndpoint(this);
-		_partToMid[i].SetLength(_radius);
 
-		AddConstraint(_midToPart+i);
-		_midToPart[i].SetLength(_radius);
-		_midToPart[i].SetEndpoint(_parts[i]);
-		//_midToPart[i].SetSpringConstant(250);
+	// Half the ring reaches every other part, going further would join pairs twice
+	const int neighbours = numParts <= FULL_MESH_PARTS ? numParts / 2 : std::min((int)NEIGHBOUR_SPRINGS, numParts / 2);
 
-		const double maxLength = _radius * 2;
-		const double maxStrength = 1000;
-		const double minStrength = 200;
+	for (int i = 0; i < numParts; ++i)
+	{
+		_springs.AddSpring(0, i + 1, _radius, midK, midB);
 
-		for (int j = 0; j < NUM_PARTS; j++)
+		for (int offset = 1; offset <= neighbours; ++offset)
 		{
-			if (i != j)
-			{
-				_partToParts[partId].SetEndpoint(_parts[j]);
-				double length = (_parts[j]->GetPosition() - _parts[i]->GetPosition()).length();
-
-				double strength = (1.0 - length / maxLength) * (maxStrength - minStrength) + minStrength;
-				_partToParts[partId].SetLength(length);
-				_partToParts[partId].SetSpringConstant(strength);
-				_parts[i]->AddConstraint(_partToParts + partId);
-				//_partToParts[partId].SetDampingConstant(2);
-				partId++;
-			}
+			int j = (i + offset) % numParts;
+
+			// Opposite parts of an even ring are reached from both sides
+			if (offset * 2 == numParts && j < i)
+				continue;
+
+			Real length = (_parts[j]->GetPosition() - _parts[i]->GetPosition()).length();
+			Real strength = (1 - length / maxLength) * (maxStrength - minStrength) + minStrength;
+
+			_springs.AddSpring(i + 1, j + 1, length, strength, partB);
 		}
 	}
 }
 
+int BlobbyObject::GetNumParts() const
+{
+	return _parts.size();
+}
+
+int BlobbyObject::GetNumSprings() const
+{
+	return _springs.GetNumSprings();
+}
+
+BlobbyPart* BlobbyObject::GetPart(int i)
+{
+	return _parts[i];
+}
+
+Real BlobbyObject::GetStiffness() const
+{
+	return _stiffness;
+}
+
+void BlobbyObject::Integrate(Real deltaTime, World& world)
+{
+	ClearContacts();
+
+	_springs.Integrate(deltaTime, world);
+}
+
 void BlobbyObject::UpdateShape(World& world)
 {
 	Color c = world.GetObjectColor(*this);
 	Triangle t;
 	t._color = c;
 	t._points[0] = Vector2f(GetPosition());
-	for (int i = 0; i < NUM_PARTS - 1; ++i)
+	const int numParts = GetNumParts();
+	for (int i = 0; i < numParts - 1; ++i)
 	{
 		t._points[2] = Vector2f(_parts[i]->GetPosition());
 		t._points[1] = Vector2f(_parts[i + 1]->GetPosition());
@@ -694,9 +633,34 @@ void BlobbyObject::UpdateShape(World& world)
 		world.UpdateTriangle(_triangles[i], t);
 	}
 
-	t._points[2] = Vector2f(_parts[NUM_PARTS - 1]->GetPosition());
+	t._points[2] = Vector2f(_parts[numParts - 1]->GetPosition());
 	t._points[1] = Vector2f(_parts[0]->GetPosition());
-	world.UpdateTriangle(_triangles[NUM_PARTS - 1], t);
+	world.UpdateTriangle(_triangles[numParts - 1], t);
+}
+
+void BlobbyObject::ReleaseShapes(World& world)
+{
+	// Take each triangle out of the list before removing it, the world may
+	// move one of the remaining triangles into its place
+	while (_triangles.size() > 0)
+	{
+		int triangle = _triangles.back();
+		_triangles.pop_back();
+
+		world.RemoveTriangle(triangle);
+	}
+}
+
+void BlobbyObject::ShapeMoved(int oldIndex, int newIndex)
+{
+	for (unsigned i = 0; i < _triangles.size(); ++i)
+	{
+		if (_triangles[i] == oldIndex)
+		{
+			_triangles[i] = newIndex;
+			return;
+		}
+	}
 }
 
 unsigned BlobbyObject::GetSerializationType()
@@ -704,12 +668,12 @@ unsigned BlobbyObject::GetSerializationType()
 	return OBJECT_BLOBBY;
 }
 
-void BlobbyObject::SetPosition(const Vector2d& position)
+void BlobbyObject::SetPosition(const Vector2r& position)
 {
 	// Move sub objects relative to main objects
-	for (int i = 0; i < NUM_PARTS; ++i)
+	for (unsigned i = 0; i < _parts.size(); ++i)
 	{
-		Vector2d delta = _parts[i]->GetPosition() - GetPosition();
+		Vector2r delta = _parts[i]->GetPosition() - GetPosition();
 		_parts[i]->SetPosition(position + delta);
 	}
 
@@ -718,7 +682,7 @@ void BlobbyObject::SetPosition(const Vector2d& position)
 
 void BlobbyObject::SetOwnerId(unsigned id)
 {
-	for (int i = 0; i < NUM_PARTS; ++i)
+	for (unsigned i = 0; i < _parts.size(); ++i)
 	{
 		_parts[i]->SetOwnerId(id);
 	}
@@ -745,4 +709,4 @@ bool BlobbyObject::TestCollision(TriangleObject&, Contact&)
 bool BlobbyObject::TestCollision(BlobbyPart&, Contact&)
 {
 	return false;
-}
\ No newline at end of file
+}
@@ -3,7 +3,10 @@
 #pragma once
 
 #include "Vector.h"
+#include "Precision.h"
 #include "Color.h"
+#include "SpringNetwork.h"
+#include "ObjectPool.h"
 #include <vector>
 #include <algorithm>
 
@@ -26,6 +29,17 @@ namespace Physics
 		OBJECT_BLOBBY_PART = 4,
 	};
 
+	// Contacts are always along one of the axes
+	enum eContactNormal
+	{
+		NORMAL_POSITIVE_X = 0,
+		NORMAL_NEGATIVE_X = 1,
+		NORMAL_POSITIVE_Y = 2,
+		NORMAL_NEGATIVE_Y = 3,
+	};
+
+	// A contact belongs to object A, which is the object it is added to. The
+	// contacts of an object are linked together through the arena holding them
 	struct Contact
 	{
 		bool BoxBoxCollision(const PhysicsObject& a, const PhysicsObject& b);
@@ -34,100 +48,78 @@ namespace Physics
 		bool PointBoxCollision(const PhysicsObject& a, const PhysicsObject& b);
 		void Reverse();
 
-		Vector2d _contactNormal;
-		double _penetrationDistance;
-		bool _static;
+		Vector2r GetNormal() const;
 
-		Vector2d _velocityA;
-		double _massA;
-		Vector2d _velocityB;
-		double _massB;
-	};
+		int _other; // Index of object B, or -1 for the world boundary
+		int _next; // Index of the object's next contact in the arena, or -1
+		float _penetrationDistance;
+		unsigned char _normal;
 
-	struct State
-	{
-		Vector2d _position;
-		Vector2d _velocity;
-	};
+	private:
 
-	struct Derivative
-	{
-		Vector2d _velocity;
-		Vector2d _acceleration;
+		// Tests whether two boxes are closer than overlapDistance on both axes,
+		// delta is the vector from the centre of b to the centre of a
+		bool Overlap(const Vector2r& delta, Real overlapDistance);
 	};
 
-	class Constraint
-	{
-
-	public:
-
-		virtual Vector2d CalculateAcceleration(const State& state) const = 0;
-
-	};
+	// Contacts found by one thread during a tick
+	typedef std::vector<Contact> ContactArena;
 
-	class FixedEndSpringConstraint : public Constraint
+	// The change a contact makes to an object owned by another peer. Contacts
+	// between objects of two peers are only solved by the peer with the lower
+	// id, which sends the other object's half of the contact to its owner
+	struct ContactImpulse
 	{
+		int _object;
+		Vector2r _velocity;
+		Vector2r _position;
+	};
 
-	public:
-
-		FixedEndSpringConstraint();
-
-		Vector2d CalculateAcceleration(const State& state) const;
-		void SetFixedEndpoint(const Vector2d& position);
-		void SetSpringConstant(double k);
-		void SetDampingConstant(double b);
-		void SetObjectSpaceAttachmentPoint(const Vector2d& position);
-		Vector2d GetAttachmentPoint();
-
-	private:
-		
-		Vector2d _endPoint;
-		Vector2d _attachmentPoint;
-		double _k, _b;
+	typedef std::vector<ContactImpulse> ContactImpulseList;
 
+	struct State
+	{
+		Vector2r _position;
+		Vector2r _velocity;
 	};
 
-	class LengthSpring : public Constraint
+	struct Derivative
 	{
-	public:
-
-		LengthSpring();
-
-		Vector2d CalculateAcceleration(const State& state) const;
-
-		void SetEndpoint(Physics::PhysicsObject* object);
-
-		void SetSpringConstant(double k);
-		void SetDampingConstant(double b);
-		void SetLength(double length);
-
-	private:
-
-		Physics::PhysicsObject* _object;
-		double _k, _b, _l;
+		Vector2r _velocity;
+		Vector2r _acceleration;
 	};
 
 	class PhysicsObject
 	{
 
+		friend class SpringNetwork;
+		friend class ConstraintSystem;
+
 	public:
 
 		PhysicsObject();
 
-		virtual void SetPosition(const Vector2d& position);
-		Vector2d GetPosition() const;
+		virtual void SetPosition(const Vector2r& position);
+		Vector2r GetPosition() const;
+
+		virtual void SetVelocity(const Vector2r& velocity);
+		Vector2r GetVelocity() const;
 
-		virtual void SetVelocity(const Vector2d& velocity);
-		Vector2d GetVelocity() const;
+		Real GetMass() const;
+		void SetMass(Real mass);
 
-		double GetMass() const;
-		void SetMass(double mass);
+		// Half the width of the object's bounding box, used for world boundary tests
+		Real GetHalfExtent() const;
 
-		virtual void Integrate(double deltaTime, World& world);
+		virtual void Integrate(Real deltaTime, World& world);
 
 		virtual void UpdateShape(World& world) = 0;
 
-		virtual void ProcessCollisions(World& world) = 0;
+		// Called when the object is removed from the world to free its shapes
+		virtual void ReleaseShapes(World& world);
+
+		// Called by the world when it moves one of the object's shapes to another index
+		virtual void ShapeMoved(int oldIndex, int newIndex);
 
 		// Double dispatch of object types
 		virtual bool TestCollision(PhysicsObject&, Contact&) = 0;
@@ -135,12 +127,11 @@ namespace Physics
 		virtual bool TestCollision(TriangleObject&, Contact&) = 0;
 		virtual bool TestCollision(BlobbyPart&, Contact&) = 0;
 
-		void AddContact(const Contact& contact);
-
-		void AddConstraint(const Constraint* constraint);
-		void RemoveConstraint(const Constraint* constraint);
+		// All of an object's contacts must be added to the same arena
+		void AddContact(Contact& contact, unsigned arenaId, ContactArena& arena);
 		
-		void SolveContacts(World& world);
+		// Impulses for objects owned by other peers are added to the thread's list
+		void SolveContacts(World& world, unsigned threadId);
 
 		void SetColor(const Color& color);
 		Color GetColor();
@@ -152,34 +143,58 @@ namespace Physics
 
 		bool CanMigrate();
 
+		// Objects owned by another peer are held at the last state it sent while
+		// it isn't sending updates for them, rather than being integrated
+		void SetHeld(bool held);
+		bool IsHeld() const;
+
+		// Contacts are cleared when the object is integrated or its contacts solved
+		void ClearContacts();
+
 		void SetParent(PhysicsObject* parent);
 		PhysicsObject* GetParent();
 		
 		void SetId(int id);
 		int GetId();
 
+		void SetHandle(const ObjectHandle& handle);
+		const ObjectHandle& GetHandle() const;
+
 	protected:
-		
+
 		State _state;
+		Real _halfExtent;
 
 	private:
 
-		virtual Vector2d CalculateAcceleration(const State& state, World& world) const;
+		virtual Vector2r CalculateAcceleration(const State& state, World& world) const;
+
+		virtual Derivative EvaluateDerivative(const State& initialState, Derivative& derivative, Real deltaTime, World& world);
 
-		virtual Derivative EvaluateDerivative(const State& initialState, Derivative& derivative, double deltaTime, World& world);
+		Real _mass;
 
-		double _mass;
+		// Contacts are linked through the arena of the thread that found them, so
+		// an object can hold any number of them
+		int _firstContact;
+		int _lastContact;
+		unsigned _numContacts;
+		unsigned char _contactArena;
 
-		static const int MAX_CONTACTS = 25;
-		std::vector<Contact> _contacts;
-		std::vector<const Constraint*> _constraints;
+		// Acceleration applied by springs in the constraint system at the start of
+		// the tick. The stiffness and damping, per unit mass, linearise the springs
+		// about that state so each integrator evaluation sees the restoring force
+		Vector2r _constraintAcceleration;
+		Real _constraintStiffness;
+		Real _constraintDamping;
 
 		Color _color;
 
 		unsigned _ownerId;
+		bool _held;
 
 		PhysicsObject* _parent;
 		int _id;
+		ObjectHandle _handle;
 	};
 
 	class BoxObject : public PhysicsObject
@@ -187,10 +202,11 @@ namespace Physics
 
 	public:
 
-		BoxObject(int quad);
+		BoxObject(World& world);
 
 		void UpdateShape(World& world);
-		void ProcessCollisions(World& world);
+		void ReleaseShapes(World& world);
+		void ShapeMoved(int oldIndex, int newIndex);
 		unsigned int GetSerializationType();
 
 		bool TestCollision(PhysicsObject&, Contact&);
@@ -209,10 +225,11 @@ namespace Physics
 
 	public:
 
-		TriangleObject(int triangle);
+		TriangleObject(World& world);
 
 		void UpdateShape(World& world);
-		void ProcessCollisions(World& world);
+		void ReleaseShapes(World& world);
+		void ShapeMoved(int oldIndex, int newIndex);
 
 		unsigned int GetSerializationType();
 
@@ -233,7 +250,9 @@ namespace Physics
 		BlobbyPart();
 		void UpdateShape(World& world);
 		unsigned GetSerializationType();
-		void ProcessCollisions(World& world);
+
+		// Parts with a parent are integrated by the parent's spring network
+		void Integrate(Real deltaTime, World& world);
 
 		bool TestCollision(PhysicsObject&, Contact&);
 		bool TestCollision(BoxObject&, Contact&);
@@ -246,18 +265,36 @@ namespace Physics
 
 	public:
 
-		BlobbyObject(World& world);
+		// The number of parts sets the resolution of the soft body, stiffness is the
+		// spring constant of the springs joining neighbouring parts
+		BlobbyObject(World& world, int numParts, Real stiffness);
 		
+		void Integrate(Real deltaTime, World& world);
 		void UpdateShape(World& world);
+		void ReleaseShapes(World& world);
+		void ShapeMoved(int oldIndex, int newIndex);
 		unsigned GetSerializationType();
 
-		static const int NUM_PARTS = 16;
+		static const int DEFAULT_NUM_PARTS = 16;
+		static const int MIN_NUM_PARTS = 3;
+		static const int MAX_NUM_PARTS = 128;
+
+		// Every pair of parts is joined by a spring in blobbies of up to
+		// FULL_MESH_PARTS parts. In larger blobbies each part is only joined to
+		// this many parts either side of it around the ring, so the number of
+		// springs grows linearly. Every part is also joined to the midpoint
+		static const int FULL_MESH_PARTS = DEFAULT_NUM_PARTS;
+		static const int NEIGHBOUR_SPRINGS = 4;
+		static const Real DEFAULT_STIFFNESS;
 
 		// Overrides to apply the same changes to sup parts
-		void SetPosition(const Vector2d& position);
-		//void SetVelocity(const Vector2d& velocity);
+		void SetPosition(const Vector2r& position);
+		//void SetVelocity(const Vector2r& velocity);
 
-		static int GetPart(int i);
+		int GetNumParts() const;
+		int GetNumSprings() const;
+		BlobbyPart* GetPart(int i);
+		Real GetStiffness() const;
 
 		void SetOwnerId(unsigned id);
 
@@ -268,17 +305,15 @@ namespace Physics
 
 	private:
 
-		BlobbyPart* _parts[NUM_PARTS];
-
-		LengthSpring _partToParts[NUM_PARTS * (NUM_PARTS - 1)];
-
-		LengthSpring _partToMid[NUM_PARTS];
-		LengthSpring _midToPart[NUM_PARTS];
+		std::vector<BlobbyPart*> _parts;
 
-		int _triangles[NUM_PARTS];
+		// Particle 0 is the midpoint, followed by each of the parts
+		SpringNetwork _springs;
 
+		std::vector<int> _triangles;
 
-		double _radius;
+		Real _radius;
+		Real _stiffness;
 
 	};
-}
\ No newline at end of file
+}
@@ -37,7 +37,8 @@ PhysicsWorkerThread::PhysicsWorkerThread() :
 	_delta(0),
 	_threadId(0),
 	_peerId(0),
-	_numPeers(1)
+	_numPeers(1),
+	_generateShapes(true)
 {
 }
 
@@ -63,13 +64,70 @@ void PhysicsWorkerThread::SetNumPeers(unsigned numPeers)
 
 void PhysicsWorkerThread::PhysicsStep()
 {
+	SolveConstraintForces();
+
 	Integrate();
 
+	ProjectConstraints();
+
 	BroadPhase();
 
 	DetectCollisions();
 
 	SolveCollisions();
+
+	if (_generateShapes)
+	{
+		GenerateShapes();
+	}
+}
+
+void PhysicsWorkerThread::SolveConstraintForces()
+{
+	_constraintForceStage.WaitForBegin();
+
+	// The number of batches is only read once the stage has begun, the stage is
+	// always begun at least once even when there are no batches
+	Physics::ConstraintSystem& constraints = _world->GetConstraints();
+	int numBatches = constraints.GetNumForceBatches();
+
+	for (int batch = 0; ; )
+	{
+		if (batch < numBatches)
+		{
+			constraints.SolveForceBatch(batch, _threadId, _numThreads, _peerId);
+		}
+
+		_constraintForceStage.Completed();
+
+		if (++batch >= numBatches)
+			break;
+
+		_constraintForceStage.WaitForBegin();
+	}
+}
+
+void PhysicsWorkerThread::ProjectConstraints()
+{
+	_constraintProjectionStage.WaitForBegin();
+
+	Physics::ConstraintSystem& constraints = _world->GetConstraints();
+	int numBatches = constraints.GetNumProjectionBatches();
+
+	for (int batch = 0; ; )
+	{
+		if (batch < numBatches)
+		{
+			constraints.SolveProjectionBatch(batch, _threadId, _numThreads, _peerId);
+		}
+
+		_constraintProjectionStage.Completed();
+
+		if (++batch >= numBatches)
+			break;
+
+		_constraintProjectionStage.WaitForBegin();
+	}
 }
 
 void PhysicsWorkerThread::Integrate()
@@ -84,7 +142,18 @@ void PhysicsWorkerThread::Integrate()
 
 	for (int i = minIndex; i <= maxIndex; i++)
 	{
-		_world->UpdateObject(i, delta);
+		Physics::PhysicsObject* object = _world->GetObject(i);
+
+		// Held objects stay at the state their owner last sent, with nothing to
+		// stop them falling through the objects beneath them if they were integrated
+		if (object->IsHeld() && object->GetOwnerId() != _peerId)
+		{
+			object->ClearContacts();
+		}
+		else
+		{
+			_world->UpdateObject(i, delta);
+		}
 	}
 
 	_integrationStage.Completed();
@@ -116,7 +185,7 @@ void PhysicsWorkerThread::DetectCollisions()
 	int minIndex = GetStartIndexForId(_threadId, _numThreads, _world->GetNumBucketsWide());
 	int maxIndex = GetEndIndexForId(_threadId, _numThreads, _world->GetNumBucketsWide());
 
-	_world->DetectCollisions(minIndex, maxIndex);
+	_world->DetectCollisions(minIndex, maxIndex, _threadId);
 
 	_detectCollisionStage.Completed();
 }
@@ -134,15 +203,25 @@ void PhysicsWorkerThread::SolveCollisions()
 
 		if (object->GetOwnerId() == _peerId)
 		{
-			object->SolveContacts(*_world);
+			object->SolveContacts(*_world, _threadId);
 		}
-
-		object->UpdateShape(*_world);
 	}
 
 	_solveCollisionStage.Completed();
 }
 
+void PhysicsWorkerThread::GenerateShapes()
+{
+	_generateShapesStage.WaitForBegin();
+
+	int minIndex = GetStartIndexForId(_threadId, _numThreads, _world->GetNumObjects());
+	int maxIndex = GetEndIndexForId(_threadId, _numThreads, _world->GetNumObjects());
+
+	_world->GenerateShapes(minIndex, maxIndex);
+
+	_generateShapesStage.Completed();
+}
+
 unsigned PhysicsWorkerThread::ThreadMain()
 {
 	while(!_haltPhysics)
@@ -202,9 +281,12 @@ int PhysicsWorkerThread::GetPeerEndIndex(unsigned count)
 	return peerStart + GetEndIndexForId(_threadId, _numThreads, peerEnd - peerStart);
 }
 
+const double GameWorldThread::SOLVE_TIME_SMOOTHING = 0.05;
+
 GameWorldThread::GameWorldThread() :
 	_tickCount(0),
 	_shuttingDown(false),
+	_solveTime(0),
 	_state(STATE_STANDALONE),
 	_networkController(NULL)
 {
@@ -296,16 +378,27 @@ void GameWorldThread::PhysicsStep()
 	double delta = _timer.GetTime() * _world->GetSimSpeed();
 	_timer.Start();
 
+	_world->PrepareWriteState();
 	_world->HandleUserInteraction();
 	
 	if (delta < 0) delta = 0;
 	SetStepDelta(delta);
+	SetGenerateShapes(_world->HasRenderer());
+
+	_world->GetConstraints().Prepare(_world->GetNumObjects());
+	_world->PrepareContacts(_numThreads);
+
+	// Workers solve spring constraints one batch at a time
+	SolveConstraintForces();
 
 	// Workers begin integration task
 	BeginIntegration();
 	PhysicsWorkerThread::Integrate();
 	JoinIntegration();
 
+	// Workers project joint constraints one batch at a time
+	ProjectConstraints();
+
 	// Workers begin broadphase task
 	BeginBroadphase();
 	PhysicsWorkerThread::BroadPhase();
@@ -316,11 +409,20 @@ void GameWorldThread::PhysicsStep()
 	PhysicsWorkerThread::DetectCollisions();
 	JoinDetectCollisions();
 
+	double solveStart = _timer.GetTime();
+
 	// Workers begin collision solve task
 	BeginSolveCollisions();
 	PhysicsWorkerThread::SolveCollisions();
 	JoinSolveCollisions();
 
+	_world->ApplyContactImpulses();
+
+	// Every other stage also works on the objects of the other peers, only the
+	// contact solve is limited to our own objects so its time follows our share
+	// of the world. The regions are balanced on it
+	_solveTime += (_timer.GetTime() - solveStart - _solveTime) * SOLVE_TIME_SMOOTHING;
+
 	{
 		Threading::ScopedLock lock(_stateChangeMutex);
 
@@ -337,6 +439,17 @@ void GameWorldThread::PhysicsStep()
 		}
 	}
 
+	// Shapes are generated after the network exchange so they include any
+	// objects or positions received this tick
+	if (_generateShapes)
+	{
+		BeginGenerateShapes();
+		PhysicsWorkerThread::GenerateShapes();
+		JoinGenerateShapes();
+	}
+
+	_world->UpdateSpatialIndex();
+
 	_world->SwapWriteState();
 
 	_tickCount++; // Record the step for performance measurement
@@ -382,6 +495,11 @@ unsigned GameWorldThread::TicksPerSec()
 	return _tickCount;
 }
 
+double GameWorldThread::GetSolveTime() const
+{
+	return _solveTime;
+}
+
 void GameWorldThread::SetStepDelta(double delta)
 {
 	_delta = delta;
@@ -397,6 +515,91 @@ double GameWorldThread::GetStepDelta()
 	return _delta;
 }
 
+void GameWorldThread::SetGenerateShapes(bool generateShapes)
+{
+	_generateShapes = generateShapes;
+
+	for (unsigned i = 0; i < _workers.size(); ++i)
+	{
+		_workers[i]->_generateShapes = generateShapes;
+	}
+}
+
+void GameWorldThread::SolveConstraintForces()
+{
+	Physics::ConstraintSystem& constraints = _world->GetConstraints();
+	int numBatches = constraints.GetNumForceBatches();
+
+	int batch = 0;
+	do
+	{
+		BeginConstraintForceBatch();
+
+		if (batch < numBatches)
+		{
+			constraints.SolveForceBatch(batch, _threadId, _numThreads, _peerId);
+		}
+
+		JoinConstraintForceBatch();
+
+		batch++;
+	} while (batch < numBatches);
+}
+
+void GameWorldThread::ProjectConstraints()
+{
+	Physics::ConstraintSystem& constraints = _world->GetConstraints();
+	int numBatches = constraints.GetNumProjectionBatches();
+
+	int batch = 0;
+	do
+	{
+		BeginConstraintProjectionBatch();
+
+		if (batch < numBatches)
+		{
+			constraints.SolveProjectionBatch(batch, _threadId, _numThreads, _peerId);
+		}
+
+		JoinConstraintProjectionBatch();
+
+		batch++;
+	} while (batch < numBatches);
+}
+
+// The game world thread solves its share of each batch directly, so only the workers' stages are used
+void GameWorldThread::BeginConstraintForceBatch()
+{
+	for (unsigned i = 0; i < _workers.size(); ++i)
+	{
+		_workers[i]->_constraintForceStage.Begin();
+	}
+}
+
+void GameWorldThread::BeginConstraintProjectionBatch()
+{
+	for (unsigned i = 0; i < _workers.size(); ++i)
+	{
+		_workers[i]->_constraintProjectionStage.Begin();
+	}
+}
+
+void GameWorldThread::JoinConstraintForceBatch()
+{
+	for (unsigned i = 0; i < _workers.size(); ++i)
+	{
+		_workers[i]->_constraintForceStage.WaitForCompletion();
+	}
+}
+
+void GameWorldThread::JoinConstraintProjectionBatch()
+{
+	for (unsigned i = 0; i < _workers.size(); ++i)
+	{
+		_workers[i]->_constraintProjectionStage.WaitForCompletion();
+	}
+}
+
 void GameWorldThread::BeginIntegration()
 {
 	_integrationStage.Begin();
@@ -438,6 +641,16 @@ void GameWorldThread::BeginSolveCollisions()
 	}
 }
 
+void GameWorldThread::BeginGenerateShapes()
+{
+	_generateShapesStage.Begin();
+
+	for (unsigned i = 0; i < _workers.size(); ++i)
+	{
+		_workers[i]->_generateShapesStage.Begin();
+	}
+}
+
 void GameWorldThread::JoinIntegration()
 {
 	_integrationStage.WaitForCompletion();
@@ -478,6 +691,16 @@ void GameWorldThread::JoinSolveCollisions()
 	}
 }
 
+void GameWorldThread::JoinGenerateShapes()
+{
+	_generateShapesStage.WaitForCompletion();
+
+	for (unsigned i = 0; i < _workers.size(); ++i)
+	{
+		_workers[i]->_generateShapesStage.WaitForCompletion();
+	}
+}
+
 void GameWorldThread::CreateSession()
 {
 	Threading::ScopedLock lock(_stateChangeMutex);
@@ -51,10 +51,13 @@ public:
 protected:
 
 	virtual void PhysicsStep();
+	void SolveConstraintForces();
 	void Integrate();
+	void ProjectConstraints();
 	void BroadPhase();
 	void SolveCollisions();
 	void DetectCollisions();
+	void GenerateShapes();
 	World* _world;
 
 private:
@@ -70,10 +73,17 @@ private:
 	volatile double _delta;
 	volatile bool _haltPhysics;
 
+	// Set at the start of each tick, shapes aren't generated without a renderer
+	volatile bool _generateShapes;
+
+	// Constraint stages are begun once for each batch of constraints
+	PhysicsStage _constraintForceStage;
 	PhysicsStage _integrationStage;
+	PhysicsStage _constraintProjectionStage;
 	PhysicsStage _broadPhaseStage;
 	PhysicsStage _detectCollisionStage;
 	PhysicsStage _solveCollisionStage;
+	PhysicsStage _generateShapesStage;
 };
 
 class GameWorldThread : public PhysicsWorkerThread
@@ -90,12 +100,17 @@ public:
 	void SetWorld(World* worldState);
 	void SetStepDelta(double delta);
 	double GetStepDelta();
+	void SetGenerateShapes(bool generateShapes);
 
 	void BeginThreads();
 
 	unsigned TicksPerSec();
 	void ResetTicksCounter();	
 
+	// Average seconds spent each tick solving the contacts of the objects this
+	// peer owns. Should only be called from the simulation thread
+	double GetSolveTime() const;
+
 	void StopPhysics();
 	
 	void SetMouseState(int x, int y, bool leftButton, bool rightButton);
@@ -113,15 +128,25 @@ private:
 
 	void ExitWorkers();
 
+	void SolveConstraintForces();
+	void ProjectConstraints();
+
+	void BeginConstraintForceBatch();
+	void BeginConstraintProjectionBatch();
+	void JoinConstraintForceBatch();
+	void JoinConstraintProjectionBatch();
+
 	void BeginIntegration();
 	void BeginBroadphase();
 	void BeginDetectCollisions();
 	void BeginSolveCollisions();
+	void BeginGenerateShapes();
 
 	void JoinIntegration();
 	void JoinBroadphase();
 	void JoinDetectCollisions();
 	void JoinSolveCollisions();
+	void JoinGenerateShapes();
 
 	void PhysicsStep();
 
@@ -133,6 +158,10 @@ private:
 	unsigned _tickCount;
 
 	Timer _timer;
+	double _solveTime;
+
+	// Fraction of each tick's solve time which is blended into the average
+	static const double SOLVE_TIME_SMOOTHING;
 
 	Threading::Mutex _stateChangeMutex;
 
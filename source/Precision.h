@@ -0,0 +1,21 @@
+// David Hart - 2012
+//
+// Real is the scalar type used for simulation state. Defining
+// PHYSICS_SINGLE_PRECISION builds the physics with floats, which halves the
+// size of the state and of the data moved through the solvers. Settings,
+// networking and rendering keep their own types and convert at the boundary.
+// The ReleaseFloat configuration defines it
+
+#pragma once
+
+#include "Vector.h"
+
+#ifdef PHYSICS_SINGLE_PRECISION
+typedef float Real;
+const char* const PHYSICS_PRECISION_NAME = "single";
+#else
+typedef double Real;
+const char* const PHYSICS_PRECISION_NAME = "double";
+#endif
+
+typedef Vector2<Real> Vector2r;
@@ -0,0 +1,175 @@
+// David Hart - 2012
+
+#include "RegionMap.h"
+#include "Util.h"
+#include <cassert>
+#include <algorithm>
+
+const double RegionMap::LOAD_TOLERANCE = 0.1;
+const double RegionMap::REBALANCE_RATE = 0.25;
+const double RegionMap::MIN_REGION_SHARE = 0.05;
+
+RegionMap::RegionMap() :
+	_worldMin(0, 0),
+	_worldMax(0, 0)
+{
+	_peers.push_back(0);
+}
+
+void RegionMap::Create(const Vector2d& worldMin, const Vector2d& worldMax)
+{
+	_worldMin = worldMin;
+	_worldMax = worldMax;
+
+	_peers.assign(1, 0);
+	_boundaries.clear();
+}
+
+void RegionMap::Divide(const std::vector<unsigned>& peers)
+{
+	assert(peers.size() > 0);
+
+	std::vector<double> boundaries;
+	double width = (_worldMax.x() - _worldMin.x()) / peers.size();
+
+	for (unsigned i = 1; i < peers.size(); ++i)
+	{
+		boundaries.push_back(_worldMin.x() + width * i);
+	}
+
+	SetRegions(peers, boundaries);
+}
+
+void RegionMap::SetRegions(const std::vector<unsigned>& peers, const std::vector<double>& boundaries)
+{
+	assert(peers.size() > 0 && boundaries.size() + 1 == peers.size());
+
+	_peers = peers;
+	_boundaries = boundaries;
+}
+
+unsigned RegionMap::GetNumRegions() const
+{
+	return _peers.size();
+}
+
+unsigned RegionMap::GetPeer(unsigned region) const
+{
+	return _peers[region];
+}
+
+double RegionMap::GetBoundary(unsigned region) const
+{
+	return _boundaries[region];
+}
+
+bool RegionMap::Rebalance(std::vector<double>& objectPositions, const std::vector<double>& stepTimes)
+{
+	assert(stepTimes.size() == _peers.size());
+
+	unsigned numRegions = _peers.size();
+
+	if (numRegions < 2 || objectPositions.size() < 2)
+		return false;
+
+	double averageTime = 0;
+	bool balanced = true;
+
+	for (unsigned i = 0; i < numRegions; ++i)
+	{
+		averageTime += stepTimes[i] / numRegions;
+	}
+
+	for (unsigned i = 0; i < numRegions; ++i)
+	{
+		if (stepTimes[i] <= 0)
+			return false;
+
+		if (stepTimes[i] > averageTime * (1 + LOAD_TOLERANCE) || stepTimes[i] < averageTime * (1 - LOAD_TOLERANCE))
+			balanced = false;
+	}
+
+	if (balanced)
+		return false;
+
+	std::sort(objectPositions.begin(), objectPositions.end());
+
+	// Step times are assumed to grow with the number of objects simulated, so
+	// each region's share is scaled by how far its peer is from the average
+	std::vector<double> shares(numRegions);
+	double totalShare = 0;
+	unsigned first = 0;
+
+	for (unsigned i = 0; i < numRegions; ++i)
+	{
+		unsigned last = first;
+
+		while (last < objectPositions.size() && (i + 1 == numRegions || objectPositions[last] < _boundaries[i]))
+		{
+			last++;
+		}
+
+		double share = (double)(last - first) / objectPositions.size();
+		share = Util::Max(share, MIN_REGION_SHARE);
+
+		shares[i] = share * averageTime / stepTimes[i];
+		totalShare += shares[i];
+
+		first = last;
+	}
+
+	double minWidth = (_worldMax.x() - _worldMin.x()) * MIN_REGION_SHARE;
+	double cumulativeShare = 0;
+
+	for (unsigned i = 0; i + 1 < numRegions; ++i)
+	{
+		cumulativeShare += shares[i] / totalShare;
+
+		// The balanced boundary lies between the last object of this region and
+		// the first of the next
+		unsigned index = (unsigned)Util::Clamp(cumulativeShare * objectPositions.size(), 1.0, objectPositions.size() - 1.0);
+		double target = (objectPositions[index - 1] + objectPositions[index]) * 0.5;
+
+		double boundary = _boundaries[i] + (target - _boundaries[i]) * REBALANCE_RATE;
+
+		// Keep every region at least the minimum width
+		double lowest = (i == 0 ? _worldMin.x() : _boundaries[i - 1]) + minWidth;
+		double highest = _worldMax.x() - minWidth * (numRegions - 1 - i);
+
+		_boundaries[i] = Util::Clamp(boundary, lowest, highest);
+	}
+
+	return true;
+}
+
+bool RegionMap::HasPeer(unsigned peerId) const
+{
+	for (unsigned i = 0; i < _peers.size(); ++i)
+	{
+		if (_peers[i] == peerId)
+			return true;
+	}
+
+	return false;
+}
+
+unsigned RegionMap::GetPeerForPoint(const Vector2d& point) const
+{
+	// There are only a handful of regions, so a linear search is fine
+	unsigned region = 0;
+
+	while (region < _boundaries.size() && point.x() >= _boundaries[region])
+	{
+		region++;
+	}
+
+	return _peers[region];
+}
+
+AABB RegionMap::GetRegionBounds(unsigned region) const
+{
+	double xMin = region == 0 ? _worldMin.x() : _boundaries[region - 1];
+	double xMax = region == _boundaries.size() ? _worldMax.x() : _boundaries[region];
+
+	return AABB(Vector2d(xMin, _worldMin.y()), Vector2d(xMax, _worldMax.y()));
+}
@@ -0,0 +1,71 @@
+// David Hart - 2012
+//
+// class RegionMap
+//   RegionMap divides the world into vertical strips, one for each peer in the
+//   session. Each peer takes ownership of the objects inside its own strip. The
+//   session master decides the map and sends it to the other peers whenever a
+//   peer joins or leaves, the strips are ordered left to right by peer id. The
+//   boundaries are moved as the session runs so that peers which take longer
+//   to simulate a tick are given fewer objects
+
+#pragma once
+
+#include "Vector.h"
+#include "AABB.h"
+#include <vector>
+
+class RegionMap
+{
+
+public:
+
+	// Peer ids are below this, the session master is always peer 0
+	static const unsigned MAX_PEERS = 8;
+
+	RegionMap();
+
+	// Starts with a single region covering the whole world, owned by peer 0
+	void Create(const Vector2d& worldMin, const Vector2d& worldMax);
+
+	// Splits the world into strips of equal width, peers should be in ascending order
+	void Divide(const std::vector<unsigned>& peers);
+
+	// There should be one boundary fewer than peers, in ascending order
+	void SetRegions(const std::vector<unsigned>& peers, const std::vector<double>& boundaries);
+
+	unsigned GetNumRegions() const;
+	unsigned GetPeer(unsigned region) const;
+
+	// The x coordinate between a region and the one to its right
+	double GetBoundary(unsigned region) const;
+
+	// Moves the boundaries part of the way towards giving each peer a share of the
+	// objects which would equalise their step times, given the x coordinates of
+	// every object and the step time of the peer of each region. Step times
+	// should only count work on the objects a peer owns. Returns false
+	// if the step times are already close enough that nothing was moved
+	bool Rebalance(std::vector<double>& objectPositions, const std::vector<double>& stepTimes);
+
+	bool HasPeer(unsigned peerId) const;
+	unsigned GetPeerForPoint(const Vector2d& point) const;
+
+	AABB GetRegionBounds(unsigned region) const;
+
+private:
+
+	Vector2d _worldMin;
+	Vector2d _worldMax;
+
+	std::vector<unsigned> _peers;
+	std::vector<double> _boundaries;
+
+	// Step times within this fraction of the average are considered balanced
+	static const double LOAD_TOLERANCE;
+
+	// Fraction of the distance to the balanced boundary moved by each rebalance,
+	// so a single slow tick can't move every object at once
+	static const double REBALANCE_RATE;
+
+	// No region is given less than this fraction of the objects or the world width
+	static const double MIN_REGION_SHARE;
+};
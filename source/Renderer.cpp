@@ -65,6 +65,15 @@ void Renderer::DrawInstances(VertexBinding& binding, ePrimitive primitive, unsig
 	binding.Unbind();
 }
 
+void Renderer::MultiDraw(VertexBinding& binding, ePrimitive primitive, const int* first, const int* count, unsigned int draws) const
+{
+	binding.Bind();
+
+	_glex->glMultiDrawArrays(primitive, first, count, draws);
+
+	binding.Unbind();
+}
+
 void Renderer::ViewMatrix(const Matrix4& view)
 {
 	_view = view;
@@ -77,6 +77,9 @@ public:
 	void Draw(VertexBinding& binding, ePrimitive primitive, unsigned int offset, unsigned int indices) const;
 	void DrawInstances(VertexBinding& binding, ePrimitive primitive, unsigned int offset, unsigned int indices, unsigned int instances) const;
 
+	// Draws several ranges of vertices from the binding in one call
+	void MultiDraw(VertexBinding& binding, ePrimitive primitive, const int* first, const int* count, unsigned int draws) const;
+
 	void ViewMatrix(const Matrix4& view);
 
 	void UpdateStandardUniforms(const ShaderProgram& shader, const StandardUniformBlock& uniforms) const;
@@ -5,6 +5,81 @@
 #include "Renderer.h"
 #include <algorithm>
 
+FilledShapeArray::FilledShapeArray() :
+	_quadCapacity(0),
+	_triangleCapacity(0),
+	_numQuads(0),
+	_numTriangles(0),
+	_needsDisposing(false),
+	_needsUpdate(false)
+{
+}
+
+FilledShapeArray::~FilledShapeArray()
+{
+	assert(!_needsDisposing);
+}
+
+bool FilledShapeArray::Reserve(unsigned int quadCapacity, unsigned int triangleCapacity)
+{
+	if (quadCapacity <= _quadCapacity && triangleCapacity <= _triangleCapacity)
+		return false;
+
+	_quadCapacity = Util::Max(quadCapacity, _quadCapacity);
+	_triangleCapacity = Util::Max(triangleCapacity, _triangleCapacity);
+
+	_instanceBuffer.SetData(NULL, (_quadCapacity + _triangleCapacity) * sizeof(Triangle));
+	_needsUpdate = true;
+
+	return true;
+}
+
+void FilledShapeArray::UpdateQuads(const Quad* quads, unsigned int count, const ShapeRange* ranges, unsigned int numRanges)
+{
+	assert(count <= _quadCapacity);
+
+	UpdateRanges(0, quads, count, ranges, numRanges);
+	_numQuads = count;
+}
+
+void FilledShapeArray::UpdateTriangles(const Triangle* triangles, unsigned int count, const ShapeRange* ranges, unsigned int numRanges)
+{
+	assert(count <= _triangleCapacity);
+
+	UpdateRanges(_quadCapacity, triangles, count, ranges, numRanges);
+	_numTriangles = count;
+}
+
+void FilledShapeArray::UpdateRanges(unsigned int offset, const void* shapes, unsigned int count, const ShapeRange* ranges, unsigned int numRanges)
+{
+	const char* data = (const char*)shapes;
+
+	for (unsigned int i = 0; i < numRanges; ++i)
+	{
+		// Shapes removed since the range was recorded aren't drawn
+		if (ranges[i]._begin >= count)
+			continue;
+
+		unsigned int rangeCount = ranges[i]._count;
+		if (ranges[i]._begin + rangeCount > count)
+			rangeCount = count - ranges[i]._begin;
+
+		_instanceBuffer.UpdateRegion((offset + ranges[i]._begin) * sizeof(Triangle),
+			data + ranges[i]._begin * sizeof(Triangle), rangeCount * sizeof(Triangle));
+	}
+}
+
+void FilledShapeArray::Dispose()
+{
+	_instanceBuffer.Dispose();
+
+	if (_needsDisposing)
+	{
+		_bufferBinding.Dispose();
+		_needsDisposing = false;
+	}
+}
+
 ShapeBatch::ShapeBatch() :
 	_renderer(NULL)
 {
@@ -13,33 +88,17 @@ ShapeBatch::ShapeBatch() :
 void ShapeBatch::Create(const Renderer* renderer)
 {
 	_renderer = renderer;
-	const float quadVerts [] =
-	{
-		-0.5f, -0.5f,
-		0.5f, -0.5f,
-		0.5f, 0.5f,
-		-0.5f, 0.5f,
-	};
 
-	const unsigned int quadIndices[] =
-	{
-		0, 1, 2,
-		0, 2, 3,
-	};
-
-	_quadBuffer.Create(*renderer, quadVerts, sizeof(quadVerts));
-	_quadIndices.Create(*renderer, quadIndices, sizeof(quadIndices));
+	// Quads are uploaded into the same buffer as triangles using the triangle layout
+	assert(sizeof(Quad) == sizeof(Triangle));
 
 	_vertexColorFrag.CreateFromFile(*renderer, "data/vertexColor.frag");
 
-	_quadVertShader.CreateFromFile(*renderer, "data/quadBatch.vert");
-	_quadShader.Create(*renderer, _quadVertShader, _vertexColorFrag);
-	renderer->GetStandardUniforms(_quadShader, _quadUniforms);
-
-	_triangleVertShader.CreateFromFile(*renderer, "data/triangleBatch.vert");
-	_triangleGeomShader.CreateFromFile(*renderer, "data/triangleBatch.geom");
-	_triangleShader.Create(*renderer, _triangleVertShader, _vertexColorFrag, _triangleGeomShader);
-	renderer->GetStandardUniforms(_triangleShader, _triangleUniforms);
+	_shapeVertShader.CreateFromFile(*renderer, "data/shapeBatch.vert");
+	_shapeGeomShader.CreateFromFile(*renderer, "data/shapeBatch.geom");
+	_shapeShader.Create(*renderer, _shapeVertShader, _vertexColorFrag, _shapeGeomShader);
+	renderer->GetStandardUniforms(_shapeShader, _shapeUniforms);
+	_firstTriangleUniform = _shapeShader.GetUniform("firstTriangle");
 
 	_lineVertShader.CreateFromFile(*renderer, "data/lineBatch.vert");
 	_lineGeomShader.CreateFromFile(*renderer, "data/lineBatch.geom");
@@ -49,14 +108,9 @@ void ShapeBatch::Create(const Renderer* renderer)
 
 void ShapeBatch::Dispose()
 {
-	for (unsigned i = 0; i < _quadArrays.size(); ++i)
+	for (unsigned i = 0; i < _filledShapeArrays.size(); ++i)
 	{
-		_quadArrays[i]->Dispose();
-	}
-
-	for (unsigned i = 0; i < _triangleArrays.size(); ++i)
-	{
-		_triangleArrays[i]->Dispose();
+		_filledShapeArrays[i]->Dispose();
 	}
 
 	for (unsigned i = 0; i < _lineArrays.size(); ++i)
@@ -64,15 +118,9 @@ void ShapeBatch::Dispose()
 		_lineArrays[i]->Dispose();
 	}
 
-	_quadShader.Dispose();
-	_quadVertShader.Dispose();
-
-	_quadBuffer.Dispose();
-	_quadIndices.Dispose();
-
-	_triangleShader.Dispose();
-	_triangleVertShader.Dispose();
-	_triangleGeomShader.Dispose();
+	_shapeShader.Dispose();
+	_shapeVertShader.Dispose();
+	_shapeGeomShader.Dispose();
 
 	_lineShader.Dispose();
 	_lineVertShader.Dispose();
@@ -87,22 +135,13 @@ void ShapeBatch::Draw()
 	_renderer->EnableBlend(true);
 	_renderer->BlendMode(BLEND_ALPHA);
 
-	// Draw Quads
-	_quadShader.Use();
-	_renderer->UpdateStandardUniforms(_quadShader, _quadUniforms);
-
-	for(unsigned int i = 0; i < _quadArrays.size(); i++)
-	{
-		DrawQuadArray(_quadArrays[i]);
-	}
+	// Draw Quads and Triangles
+	_shapeShader.Use();
+	_renderer->UpdateStandardUniforms(_shapeShader, _shapeUniforms);
 
-	// Draw Triangles
-	_triangleShader.Use();
-	_renderer->UpdateStandardUniforms(_triangleShader, _triangleUniforms);
-
-	for (unsigned int i = 0; i < _triangleArrays.size(); ++i)
+	for (unsigned int i = 0; i < _filledShapeArrays.size(); ++i)
 	{
-		DrawTriangleArray(_triangleArrays[i]);
+		DrawFilledShapeArray(_filledShapeArrays[i]);
 	}
 
 	// Draw Lines
@@ -115,61 +154,44 @@ void ShapeBatch::Draw()
 	}
 }
 
-void ShapeBatch::DrawQuadArray(QuadArray* quadArray)
+void ShapeBatch::DrawFilledShapeArray(FilledShapeArray* shapeArray)
 {
-	if (quadArray->GetCount() == 0)
+	if (shapeArray->_numQuads == 0 && shapeArray->_numTriangles == 0)
 		return;
 
-	if (quadArray->_needsUpdate)
+	if (shapeArray->_needsUpdate)
 	{
-		UpdateQuadArrayBinding(quadArray);
-		quadArray->_needsUpdate = false;
+		UpdateFilledShapeArrayBinding(shapeArray);
+		shapeArray->_needsUpdate = false;
 	}
 
-	_renderer->DrawInstances(quadArray->_bufferBinding, PT_TRIANGLES, 0, 6, quadArray->GetCount());
-}
+	// The shader tells quads from triangles by where they are in the buffer
+	_shapeShader.SetUniform(_firstTriangleUniform, (int)shapeArray->_quadCapacity);
 
-void ShapeBatch::UpdateQuadArrayBinding(QuadArray* quadArray)
-{
-	quadArray->_needsDisposing = true;
-
-	const ArrayElement vertexLayout [] =
-	{
-		ArrayElement(_quadBuffer, "in_vertex", 2, AE_FLOAT, sizeof(float)*2, 0, 0),
-		ArrayElement(quadArray->_instanceBuffer, "in_positionRotation", 3, AE_FLOAT, sizeof(Quad), 0, 1),
-		ArrayElement(quadArray->_instanceBuffer, "in_color", 4, AE_UBYTE, sizeof(Quad), sizeof(float)*3, 1), 
-	};
+	const int first[] = { 0, (int)shapeArray->_quadCapacity };
+	const int count[] = { (int)shapeArray->_numQuads, (int)shapeArray->_numTriangles };
 
-	quadArray->_bufferBinding.Create(*_renderer, _quadShader, vertexLayout, 3, _quadIndices, AE_UINT); 
+	_renderer->MultiDraw(shapeArray->_bufferBinding, PT_POINTS, first, count, 2);
 }
 
-void ShapeBatch::DrawTriangleArray(TriangleArray* triangleArray)
+void ShapeBatch::UpdateFilledShapeArrayBinding(FilledShapeArray* shapeArray)
 {
-	if (triangleArray->GetCount() == 0)
-		return;
-
-	if (triangleArray->_needsUpdate)
+	if (shapeArray->_needsDisposing)
 	{
-		UpdateTriangleArrayBinding(triangleArray);
-		triangleArray->_needsUpdate = false;
+		shapeArray->_bufferBinding.Dispose();
 	}
 
-	_renderer->Draw(triangleArray->_bufferBinding, PT_POINTS, 0, triangleArray->GetCount());
-}
-
-void ShapeBatch::UpdateTriangleArrayBinding(TriangleArray* triangleArray)
-{
-	triangleArray->_needsDisposing = true;
+	shapeArray->_needsDisposing = true;
 
 	const ArrayElement vertexLayout [] =
 	{
-		ArrayElement(triangleArray->_instanceBuffer, "in_vert0", 2, AE_FLOAT, sizeof(Triangle), 0, 0),
-		ArrayElement(triangleArray->_instanceBuffer, "in_vert1", 2, AE_FLOAT, sizeof(Triangle), sizeof(float)*2, 0),
-		ArrayElement(triangleArray->_instanceBuffer, "in_vert2", 2, AE_FLOAT, sizeof(Triangle), sizeof(float)*4, 0),
-		ArrayElement(triangleArray->_instanceBuffer, "in_color", 4, AE_UBYTE, sizeof(Triangle), sizeof(float)*6, 0), 
+		ArrayElement(shapeArray->_instanceBuffer, "in_vert0", 2, AE_FLOAT, sizeof(Triangle), 0, 0),
+		ArrayElement(shapeArray->_instanceBuffer, "in_vert1", 2, AE_FLOAT, sizeof(Triangle), sizeof(float)*2, 0),
+		ArrayElement(shapeArray->_instanceBuffer, "in_vert2", 2, AE_FLOAT, sizeof(Triangle), sizeof(float)*4, 0),
+		ArrayElement(shapeArray->_instanceBuffer, "in_color", 4, AE_UBYTE, sizeof(Triangle), sizeof(float)*6, 0), 
 	};
 
-	triangleArray->_bufferBinding.Create(*_renderer, _triangleShader, vertexLayout, 4); 
+	shapeArray->_bufferBinding.Create(*_renderer, _shapeShader, vertexLayout, 4); 
 }
 
 void ShapeBatch::DrawLineArray(LineArray* lineArray)
@@ -222,24 +244,14 @@ template <typename T> void ShapeBatch::RemoveShapeArray(T* shapeArray, std::vect
 	shapeArrays.erase(it);
 }
 
-void ShapeBatch::AddArray(QuadArray* quadArray)
-{
-	AddShapeArray<QuadArray>(*_renderer, quadArray, _quadArrays);
-}
-
-void ShapeBatch::RemoveArray(QuadArray* quadArray)
-{
-	RemoveShapeArray<QuadArray>(quadArray, _quadArrays);
-}
-
-void ShapeBatch::AddArray(TriangleArray* triangleArray)
+void ShapeBatch::AddArray(FilledShapeArray* shapeArray)
 {
-	AddShapeArray<TriangleArray>(*_renderer, triangleArray, _triangleArrays);
+	AddShapeArray<FilledShapeArray>(*_renderer, shapeArray, _filledShapeArrays);
 }
 
-void ShapeBatch::RemoveArray(TriangleArray* triangleArray)
+void ShapeBatch::RemoveArray(FilledShapeArray* shapeArray)
 {
-	RemoveShapeArray<TriangleArray>(triangleArray, _triangleArrays);
+	RemoveShapeArray<FilledShapeArray>(shapeArray, _filledShapeArrays);
 }
 
 void ShapeBatch::AddArray(LineArray* lineArray)
@@ -12,10 +12,20 @@
 #include <vector>
 #include <cassert>
 
+// Quads and triangles share one instance layout so they can be drawn from the
+// same buffer, a quad keeps its position and rotation where a triangle keeps
+// its first points
 struct Quad
 {
+	Quad() :
+		_rotation(0)
+	{
+		_unused[0] = _unused[1] = _unused[2] = 0;
+	}
+
 	Vector2f _position;
 	float _rotation;
+	float _unused[3];
 	Color _color;
 };
 
@@ -31,6 +41,13 @@ struct Line
 	Color _color;
 };
 
+// A run of shapes in an array which needs to be uploaded
+struct ShapeRange
+{
+	unsigned int _begin;
+	unsigned int _count;
+};
+
 template<typename T> class ShapeArray
 {
 	friend class ShapeBatch;
@@ -62,6 +79,7 @@ public:
 		_count = count;
 	}
 
+
 	inline unsigned int GetCount() const
 	{
 		return _count;
@@ -88,10 +106,43 @@ private:
 
 };
 
-typedef ShapeArray<Quad> QuadArray;
-typedef ShapeArray<Triangle> TriangleArray;
 typedef ShapeArray<Line> LineArray;
 
+// Quads and triangles in one instance buffer, drawn with a single submission.
+// The quads are stored first and each part of the buffer is sized to its capacity
+class FilledShapeArray
+{
+	friend class ShapeBatch;
+
+public:
+
+	FilledShapeArray();
+	~FilledShapeArray();
+
+	// Grows the buffer to hold this many of each shape. Returns true if the
+	// buffer was recreated, in which case every shape must be uploaded again
+	bool Reserve(unsigned int quadCapacity, unsigned int triangleCapacity);
+
+	// Uploads only the ranges of shapes which changed, the rest of the
+	// buffer must already hold the same shapes
+	void UpdateQuads(const Quad* quads, unsigned int count, const ShapeRange* ranges, unsigned int numRanges);
+	void UpdateTriangles(const Triangle* triangles, unsigned int count, const ShapeRange* ranges, unsigned int numRanges);
+
+private:
+
+	void UpdateRanges(unsigned int offset, const void* shapes, unsigned int count, const ShapeRange* ranges, unsigned int numRanges);
+	void Dispose();
+
+	VertexBuffer _instanceBuffer;
+	VertexBinding _bufferBinding;
+	unsigned int _quadCapacity;
+	unsigned int _triangleCapacity;
+	unsigned int _numQuads;
+	unsigned int _numTriangles;
+	bool _needsDisposing;
+	bool _needsUpdate;
+};
+
 class ShapeBatch
 {
 
@@ -103,12 +154,10 @@ public:
 	void Dispose();
 	void Draw();
 
-	void AddArray(QuadArray* quadArray);
-	void AddArray(TriangleArray* triangleArray);
+	void AddArray(FilledShapeArray* shapeArray);
 	void AddArray(LineArray* lineArray);
 
-	void RemoveArray(QuadArray* quadArray);
-	void RemoveArray(TriangleArray* triangleArray);
+	void RemoveArray(FilledShapeArray* shapeArray);
 	void RemoveArray(LineArray* lineArray);
 
 private:
@@ -116,35 +165,26 @@ private:
 	template <typename T> static void AddShapeArray(const Renderer& renderer, T* shapeArray, std::vector<T*>& shapeArrays);
 	template <typename T> static void RemoveShapeArray(T* shapeArray, std::vector<T*>& shapeArrays);
 
-	void DrawQuadArray(QuadArray* quadArray);
-	void UpdateQuadArrayBinding(QuadArray* quadArray);
-
-	void DrawTriangleArray(TriangleArray* triangleArray);
-	void UpdateTriangleArrayBinding(TriangleArray* triangleArray);
+	void DrawFilledShapeArray(FilledShapeArray* shapeArray);
+	void UpdateFilledShapeArrayBinding(FilledShapeArray* shapeArray);
 
 	void DrawLineArray(LineArray* lineArray);
 	void UpdateLineArrayBinding(LineArray* lineArray);
 
 	FragmentShader _vertexColorFrag;
 
-	VertexShader _quadVertShader;
-	ShaderProgram _quadShader;
-	VertexBuffer _quadBuffer;
-	VertexBuffer _quadIndices;
-	Renderer::StandardUniformBlock _quadUniforms;
-
-	VertexShader _triangleVertShader;
-	GeometryShader _triangleGeomShader;
-	ShaderProgram _triangleShader;
-	Renderer::StandardUniformBlock _triangleUniforms;
+	VertexShader _shapeVertShader;
+	GeometryShader _shapeGeomShader;
+	ShaderProgram _shapeShader;
+	Renderer::StandardUniformBlock _shapeUniforms;
+	Uniform _firstTriangleUniform;
 
 	VertexShader _lineVertShader;
 	GeometryShader _lineGeomShader;
 	ShaderProgram _lineShader;
 	Renderer::StandardUniformBlock _lineUniforms;
 
-	std::vector<QuadArray*> _quadArrays;
-	std::vector<TriangleArray*> _triangleArrays;
+	std::vector<FilledShapeArray*> _filledShapeArrays;
 	std::vector<LineArray*> _lineArrays;
 
 	const Renderer* _renderer;
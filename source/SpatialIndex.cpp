@@ -0,0 +1,422 @@
+// David Hart - 2012
+
+#include "SpatialIndex.h"
+#include "PhysicsObjects.h"
+#include "Util.h"
+#include <algorithm>
+#include <cfloat>
+
+SpatialIndex::SpatialIndex() :
+	_latestSnapshot(-1),
+	_cellsWide(0),
+	_cellsTall(0)
+{
+	for (int i = 0; i < NUM_SNAPSHOTS; ++i)
+	{
+		_snapshots[i]._maxHalfExtent = 0;
+		_snapshots[i]._readers = 0;
+	}
+}
+
+void SpatialIndex::Create(const Vector2d& worldMin, const Vector2d& worldMax, int cellsWide, int cellsTall)
+{
+	Threading::ScopedLock lock(_snapshotMutex);
+
+	_worldMin = worldMin;
+	_worldMax = worldMax;
+	_cellsWide = cellsWide;
+	_cellsTall = cellsTall;
+	_cellSize = (_worldMax - _worldMin) / Vector2d(cellsWide, cellsTall);
+
+	_cellCounts.resize(cellsWide * cellsTall);
+	_latestSnapshot = -1;
+}
+
+void SpatialIndex::Update(const std::vector<Physics::PhysicsObject*>& objects)
+{
+	// Find a snapshot which no query is using, if every snapshot is busy
+	// keep the previous one for another tick
+	int writeSnapshot = -1;
+	{
+		Threading::ScopedLock lock(_snapshotMutex);
+
+		for (int i = 0; i < NUM_SNAPSHOTS; ++i)
+		{
+			if (i != _latestSnapshot && _snapshots[i]._readers == 0)
+			{
+				writeSnapshot = i;
+				break;
+			}
+		}
+	}
+
+	if (writeSnapshot < 0)
+		return;
+
+	Snapshot& snapshot = _snapshots[writeSnapshot];
+	const int numObjects = objects.size();
+	const int numCells = _cellsWide * _cellsTall;
+
+	snapshot._handles.resize(numObjects);
+	snapshot._positions.resize(numObjects);
+	snapshot._halfExtents.resize(numObjects);
+	snapshot._cellObjects.resize(numObjects);
+	snapshot._cellStart.resize(numCells + 1);
+	snapshot._maxHalfExtent = 0;
+
+	std::fill(_cellCounts.begin(), _cellCounts.end(), 0);
+
+	for (int i = 0; i < numObjects; ++i)
+	{
+		snapshot._handles[i] = objects[i]->GetHandle();
+		snapshot._positions[i] = Vector2d(objects[i]->GetPosition());
+		snapshot._halfExtents[i] = objects[i]->GetHalfExtent();
+		snapshot._maxHalfExtent = Util::Max(snapshot._maxHalfExtent, snapshot._halfExtents[i]);
+
+		Vector2i cell = GetCellForPoint(snapshot._positions[i]);
+		_cellCounts[GetCellIndex(cell.x(), cell.y())]++;
+	}
+
+	// Counting sort of the objects into their cells
+	int start = 0;
+	for (int i = 0; i < numCells; ++i)
+	{
+		snapshot._cellStart[i] = start;
+		start += _cellCounts[i];
+		_cellCounts[i] = snapshot._cellStart[i];
+	}
+	snapshot._cellStart[numCells] = start;
+
+	for (int i = 0; i < numObjects; ++i)
+	{
+		Vector2i cell = GetCellForPoint(snapshot._positions[i]);
+		snapshot._cellObjects[_cellCounts[GetCellIndex(cell.x(), cell.y())]++] = i;
+	}
+
+	Threading::ScopedLock lock(_snapshotMutex);
+	_latestSnapshot = writeSnapshot;
+}
+
+const SpatialIndex::Snapshot* SpatialIndex::AcquireSnapshot()
+{
+	Threading::ScopedLock lock(_snapshotMutex);
+
+	if (_latestSnapshot < 0)
+		return NULL;
+
+	_snapshots[_latestSnapshot]._readers++;
+
+	return &_snapshots[_latestSnapshot];
+}
+
+void SpatialIndex::ReleaseSnapshot(const Snapshot* snapshot)
+{
+	Threading::ScopedLock lock(_snapshotMutex);
+
+	_snapshots[snapshot - _snapshots]._readers--;
+}
+
+void SpatialIndex::QueryPoint(const Vector2d& point, std::vector<Physics::ObjectHandle>& results)
+{
+	QueryAABB(AABB(point, point), results);
+}
+
+void SpatialIndex::QueryAABB(const AABB& bounds, std::vector<Physics::ObjectHandle>& results)
+{
+	const Snapshot* snapshot = AcquireSnapshot();
+
+	if (snapshot == NULL)
+		return;
+
+	// Objects are binned by their midpoint, so widen the search by the largest object
+	Vector2d margin(snapshot->_maxHalfExtent);
+	Vector2i minCell = GetCellForPoint(bounds.Min() - margin);
+	Vector2i maxCell = GetCellForPoint(bounds.Max() + margin);
+
+	for (int y = minCell.y(); y <= maxCell.y(); ++y)
+	{
+		for (int x = minCell.x(); x <= maxCell.x(); ++x)
+		{
+			int cell = GetCellIndex(x, y);
+
+			for (int i = snapshot->_cellStart[cell]; i < snapshot->_cellStart[cell + 1]; ++i)
+			{
+				int object = snapshot->_cellObjects[i];
+				const Vector2d& position = snapshot->_positions[object];
+				double halfExtent = snapshot->_halfExtents[object];
+
+				if (position.x() + halfExtent >= bounds.Min().x() &&
+					position.x() - halfExtent <= bounds.Max().x() &&
+					position.y() + halfExtent >= bounds.Min().y() &&
+					position.y() - halfExtent <= bounds.Max().y())
+				{
+					results.push_back(snapshot->_handles[object]);
+				}
+			}
+		}
+	}
+
+	ReleaseSnapshot(snapshot);
+}
+
+bool SpatialIndex::RayCast(const Vector2d& origin, const Vector2d& direction, double maxDistance, RayCastHit& hit)
+{
+	const Snapshot* snapshot = AcquireSnapshot();
+
+	if (snapshot == NULL)
+		return false;
+
+	const double infinity = DBL_MAX;
+
+	// Clip the ray to the world so the walk starts inside the grid
+	double entry = 0;
+	double exit = maxDistance;
+	for (int axis = 0; axis < 2; ++axis)
+	{
+		if (abs(direction[axis]) < Util::EPSILON)
+			continue;
+
+		double t1 = (_worldMin[axis] - origin[axis]) / direction[axis];
+		double t2 = (_worldMax[axis] - origin[axis]) / direction[axis];
+
+		entry = Util::Max(entry, Util::Min(t1, t2));
+		exit = Util::Min(exit, Util::Max(t1, t2));
+	}
+
+	bool found = false;
+	hit._distance = infinity;
+
+	if (entry <= exit)
+	{
+		// Walk the cells the ray passes through in order
+		Vector2i cell = GetCellForPoint(origin + direction * entry);
+		int step[2];
+		double nextCrossing[2];
+		double crossingInterval[2];
+
+		for (int axis = 0; axis < 2; ++axis)
+		{
+			step[axis] = direction[axis] >= 0 ? 1 : -1;
+
+			if (abs(direction[axis]) < Util::EPSILON)
+			{
+				nextCrossing[axis] = infinity;
+				crossingInterval[axis] = infinity;
+			}
+			else
+			{
+				double boundary = _worldMin[axis] + (cell[axis] + (step[axis] > 0 ? 1 : 0)) * _cellSize[axis];
+				nextCrossing[axis] = (boundary - origin[axis]) / direction[axis];
+				crossingInterval[axis] = _cellSize[axis] / abs(direction[axis]);
+			}
+		}
+
+		double cellEntry = entry;
+		int x = cell.x();
+		int y = cell.y();
+
+		// Objects hit before the ray enters a cell have already been found
+		while (x >= 0 && x < _cellsWide && y >= 0 && y < _cellsTall &&
+			   cellEntry <= exit && cellEntry <= hit._distance)
+		{
+			// Objects are binned by their midpoint and may overlap neighbouring cells
+			for (int ny = Util::Max(y - 1, 0); ny <= Util::Min(y + 1, _cellsTall - 1); ++ny)
+			{
+				for (int nx = Util::Max(x - 1, 0); nx <= Util::Min(x + 1, _cellsWide - 1); ++nx)
+				{
+					int neighbour = GetCellIndex(nx, ny);
+
+					for (int i = snapshot->_cellStart[neighbour]; i < snapshot->_cellStart[neighbour + 1]; ++i)
+					{
+						RayCastHit objectHit;
+						if (RayCastObject(*snapshot, snapshot->_cellObjects[i], origin, direction, maxDistance, objectHit) &&
+							objectHit._distance < hit._distance)
+						{
+							hit = objectHit;
+							found = true;
+						}
+					}
+				}
+			}
+
+			if (nextCrossing[0] < nextCrossing[1])
+			{
+				x += step[0];
+				cellEntry = nextCrossing[0];
+				nextCrossing[0] += crossingInterval[0];
+			}
+			else
+			{
+				y += step[1];
+				cellEntry = nextCrossing[1];
+				nextCrossing[1] += crossingInterval[1];
+			}
+		}
+	}
+
+	ReleaseSnapshot(snapshot);
+
+	return found;
+}
+
+void SpatialIndex::QueryNearest(const Vector2d& point, unsigned count, double maxDistance, std::vector<Physics::ObjectHandle>& results)
+{
+	if (count == 0)
+		return;
+
+	const Snapshot* snapshot = AcquireSnapshot();
+
+	if (snapshot == NULL)
+		return;
+
+	std::vector< std::pair<double, int> > candidates;
+
+	Vector2i centre = GetCellForPoint(point);
+	double cellSize = Util::Min(_cellSize.x(), _cellSize.y());
+	int maxRing = Util::Max(_cellsWide, _cellsTall);
+
+	// Search rings of cells around the point until no unsearched cell can hold a closer object
+	for (int ring = 0; ring <= maxRing; ++ring)
+	{
+		for (int y = centre.y() - ring; y <= centre.y() + ring; ++y)
+		{
+			if (y < 0 || y >= _cellsTall)
+				continue;
+
+			// Only the edge of the ring is new
+			int xStep = (y == centre.y() - ring || y == centre.y() + ring) ? 1 : 2 * ring;
+
+			for (int x = centre.x() - ring; x <= centre.x() + ring; x += Util::Max(xStep, 1))
+			{
+				if (x < 0 || x >= _cellsWide)
+					continue;
+
+				int cell = GetCellIndex(x, y);
+
+				for (int i = snapshot->_cellStart[cell]; i < snapshot->_cellStart[cell + 1]; ++i)
+				{
+					int object = snapshot->_cellObjects[i];
+					double distance = DistanceToObject(*snapshot, object, point);
+
+					if (distance <= maxDistance)
+					{
+						candidates.push_back(std::make_pair(distance, object));
+					}
+				}
+			}
+		}
+
+		// Anything outside this ring is at least this far away
+		double unsearchedDistance = ring * cellSize - snapshot->_maxHalfExtent;
+
+		if (unsearchedDistance > maxDistance)
+			break;
+
+		if (candidates.size() >= count)
+		{
+			std::nth_element(candidates.begin(), candidates.begin() + (count - 1), candidates.end());
+
+			if (candidates[count - 1].first <= unsearchedDistance)
+				break;
+		}
+	}
+
+	unsigned numResults = Util::Min((unsigned)candidates.size(), count);
+	std::partial_sort(candidates.begin(), candidates.begin() + numResults, candidates.end());
+
+	for (unsigned i = 0; i < numResults; ++i)
+	{
+		results.push_back(snapshot->_handles[candidates[i].second]);
+	}
+
+	ReleaseSnapshot(snapshot);
+}
+
+Vector2i SpatialIndex::GetCellForPoint(const Vector2d& point) const
+{
+	Vector2i cell(Vector2d(_cellsWide, _cellsTall) * (point - _worldMin) / (_worldMax - _worldMin));
+
+	return Vector2i(Util::Clamp(cell.x(), 0, _cellsWide - 1), Util::Clamp(cell.y(), 0, _cellsTall - 1));
+}
+
+int SpatialIndex::GetCellIndex(int x, int y) const
+{
+	return x + y * _cellsWide;
+}
+
+double SpatialIndex::DistanceToObject(const Snapshot& snapshot, int object, const Vector2d& point)
+{
+	Vector2d delta = point - snapshot._positions[object];
+	double halfExtent = snapshot._halfExtents[object];
+
+	Vector2d outside(Util::Max(abs(delta.x()) - halfExtent, 0.0), Util::Max(abs(delta.y()) - halfExtent, 0.0));
+
+	return outside.length();
+}
+
+bool SpatialIndex::RayCastObject(const Snapshot& snapshot, int object, const Vector2d& origin, const Vector2d& direction, double maxDistance, RayCastHit& hit)
+{
+	const Vector2d& position = snapshot._positions[object];
+	double halfExtent = snapshot._halfExtents[object];
+
+	if (halfExtent <= 0)
+		return false;
+
+	// Slab test against the object's bounding box
+	double entry = -DBL_MAX;
+	double exit = DBL_MAX;
+	int entryAxis = 0;
+
+	for (int axis = 0; axis < 2; ++axis)
+	{
+		double slabMin = position[axis] - halfExtent;
+		double slabMax = position[axis] + halfExtent;
+
+		if (abs(direction[axis]) < Util::EPSILON)
+		{
+			if (origin[axis] < slabMin || origin[axis] > slabMax)
+				return false;
+
+			continue;
+		}
+
+		double t1 = (slabMin - origin[axis]) / direction[axis];
+		double t2 = (slabMax - origin[axis]) / direction[axis];
+
+		if (t1 > t2)
+			std::swap(t1, t2);
+
+		if (t1 > entry)
+		{
+			entry = t1;
+			entryAxis = axis;
+		}
+
+		exit = Util::Min(exit, t2);
+	}
+
+	if (entry > exit || exit < 0 || entry > maxDistance)
+		return false;
+
+	hit._object = snapshot._handles[object];
+
+	// Rays starting inside an object hit it immediately
+	if (entry < 0)
+	{
+		hit._distance = 0;
+		hit._point = origin;
+		hit._normal = -direction;
+		return true;
+	}
+
+	hit._distance = entry;
+	hit._point = origin + direction * entry;
+	hit._normal = Vector2d(0);
+
+	if (entryAxis == 0)
+		hit._normal.x(direction.x() > 0 ? -1.0 : 1.0);
+	else
+		hit._normal.y(direction.y() > 0 ? -1.0 : 1.0);
+
+	return true;
+}
@@ -0,0 +1,95 @@
+// David Hart - 2012
+//
+// class SpatialIndex
+//   SpatialIndex keeps snapshots of object positions binned into the broadphase
+//   grid, taken by the simulation thread at the end of each tick. Queries can be
+//   made from any thread, each query reads the most recent snapshot, which is
+//   not written to until every query using it has finished. Results are object
+//   handles, which should be resolved with World::GetObject as the object may
+//   have been removed or moved in the world since the snapshot was taken
+
+#pragma once
+
+#include "Vector.h"
+#include "AABB.h"
+#include "Threading.h"
+#include "ObjectPool.h"
+#include <vector>
+
+namespace Physics
+{
+	class PhysicsObject;
+}
+
+struct RayCastHit
+{
+	Physics::ObjectHandle _object;
+	double _distance;
+	Vector2d _point;
+	Vector2d _normal;
+};
+
+class SpatialIndex
+{
+
+public:
+
+	SpatialIndex();
+
+	void Create(const Vector2d& worldMin, const Vector2d& worldMax, int cellsWide, int cellsTall);
+
+	// Should only be called from the simulation thread
+	void Update(const std::vector<Physics::PhysicsObject*>& objects);
+
+	// Thread safe, results are appended
+	void QueryPoint(const Vector2d& point, std::vector<Physics::ObjectHandle>& results);
+	void QueryAABB(const AABB& bounds, std::vector<Physics::ObjectHandle>& results);
+
+	// Finds the first object whose bounding box is hit by the ray, direction must be unit length
+	bool RayCast(const Vector2d& origin, const Vector2d& direction, double maxDistance, RayCastHit& hit);
+
+	// Finds up to count objects within maxDistance of the point ordered nearest first,
+	// the distance is measured to the edge of each object's bounding box
+	void QueryNearest(const Vector2d& point, unsigned count, double maxDistance, std::vector<Physics::ObjectHandle>& results);
+
+private:
+
+	struct Snapshot
+	{
+		std::vector<Physics::ObjectHandle> _handles;
+		std::vector<Vector2d> _positions;
+		std::vector<double> _halfExtents;
+
+		// Objects sorted by cell, the objects in cell i are
+		// _cellObjects[_cellStart[i]] to _cellObjects[_cellStart[i+1]-1]
+		std::vector<int> _cellStart;
+		std::vector<int> _cellObjects;
+
+		double _maxHalfExtent;
+		int _readers;
+	};
+
+	const Snapshot* AcquireSnapshot();
+	void ReleaseSnapshot(const Snapshot* snapshot);
+
+	Vector2i GetCellForPoint(const Vector2d& point) const;
+	int GetCellIndex(int x, int y) const;
+
+	static double DistanceToObject(const Snapshot& snapshot, int object, const Vector2d& point);
+	static bool RayCastObject(const Snapshot& snapshot, int object, const Vector2d& origin, const Vector2d& direction, double maxDistance, RayCastHit& hit);
+
+	// Queries may hold a snapshot while a new one is written
+	static const int NUM_SNAPSHOTS = 3;
+	Snapshot _snapshots[NUM_SNAPSHOTS];
+	int _latestSnapshot;
+
+	Threading::Mutex _snapshotMutex;
+
+	Vector2d _worldMin;
+	Vector2d _worldMax;
+	Vector2d _cellSize;
+	int _cellsWide;
+	int _cellsTall;
+
+	std::vector<int> _cellCounts;
+};
@@ -0,0 +1,233 @@
+// David Hart - 2012
+
+#include "SpringNetwork.h"
+#include "PhysicsObjects.h"
+#include "World.h"
+#include "Util.h"
+#include <cmath>
+
+#if defined(_M_IX86) || defined(_M_X64) || defined(__SSE2__)
+#define SPRING_NETWORK_SSE2
+#include <emmintrin.h>
+#endif
+
+using namespace Physics;
+
+#ifdef SPRING_NETWORK_SSE2
+
+// Overloads for a batch of Reals, four floats or two doubles
+namespace
+{
+#ifdef PHYSICS_SINGLE_PRECISION
+	typedef __m128 RealBatch;
+	inline RealBatch Load(const float* p) { return _mm_loadu_ps(p); }
+	inline void Store(float* p, RealBatch v) { _mm_storeu_ps(p, v); }
+	inline RealBatch Set(float v) { return _mm_set1_ps(v); }
+	inline RealBatch Add(RealBatch a, RealBatch b) { return _mm_add_ps(a, b); }
+	inline RealBatch Sub(RealBatch a, RealBatch b) { return _mm_sub_ps(a, b); }
+	inline RealBatch Mul(RealBatch a, RealBatch b) { return _mm_mul_ps(a, b); }
+	inline RealBatch Div(RealBatch a, RealBatch b) { return _mm_div_ps(a, b); }
+	inline RealBatch Sqrt(RealBatch a) { return _mm_sqrt_ps(a); }
+	inline RealBatch Max(RealBatch a, RealBatch b) { return _mm_max_ps(a, b); }
+	inline RealBatch MaskGreaterEqual(RealBatch a, RealBatch b, RealBatch v) { return _mm_and_ps(_mm_cmpge_ps(a, b), v); }
+#else
+	typedef __m128d RealBatch;
+	inline RealBatch Load(const double* p) { return _mm_loadu_pd(p); }
+	inline void Store(double* p, RealBatch v) { _mm_storeu_pd(p, v); }
+	inline RealBatch Set(double v) { return _mm_set1_pd(v); }
+	inline RealBatch Add(RealBatch a, RealBatch b) { return _mm_add_pd(a, b); }
+	inline RealBatch Sub(RealBatch a, RealBatch b) { return _mm_sub_pd(a, b); }
+	inline RealBatch Mul(RealBatch a, RealBatch b) { return _mm_mul_pd(a, b); }
+	inline RealBatch Div(RealBatch a, RealBatch b) { return _mm_div_pd(a, b); }
+	inline RealBatch Sqrt(RealBatch a) { return _mm_sqrt_pd(a); }
+	inline RealBatch Max(RealBatch a, RealBatch b) { return _mm_max_pd(a, b); }
+	inline RealBatch MaskGreaterEqual(RealBatch a, RealBatch b, RealBatch v) { return _mm_and_pd(_mm_cmpge_pd(a, b), v); }
+#endif
+
+	const int BATCH_SIZE = sizeof(RealBatch) / sizeof(Real);
+}
+
+#endif
+
+SpringNetwork::SpringNetwork()
+{
+}
+
+int SpringNetwork::AddParticle(PhysicsObject* object)
+{
+	assert(object != NULL);
+
+	_particles.push_back(object);
+
+	_inverseMass.push_back(0);
+	_initialPosition.push_back(Vector2r(0));
+	_initialVelocity.push_back(Vector2r(0));
+	_position.push_back(Vector2r(0));
+	_velocity.push_back(Vector2r(0));
+	_acceleration.push_back(Vector2r(0));
+	_velocitySum.push_back(Vector2r(0));
+	_accelerationSum.push_back(Vector2r(0));
+
+	return _particles.size() - 1;
+}
+
+void SpringNetwork::AddSpring(int particleA, int particleB, Real length, Real k, Real b)
+{
+	assert(particleA != particleB);
+	assert(particleA >= 0 && particleA < GetNumParticles());
+	assert(particleB >= 0 && particleB < GetNumParticles());
+
+	_springParticleA.push_back(particleA);
+	_springParticleB.push_back(particleB);
+	_springLength.push_back(length);
+	_springK.push_back(k);
+	_springDamping.push_back(b);
+
+	_springDx.push_back(0);
+	_springDy.push_back(0);
+	_springDvx.push_back(0);
+	_springDvy.push_back(0);
+	_springScale.push_back(0);
+}
+
+int SpringNetwork::GetNumParticles() const
+{
+	return _particles.size();
+}
+
+int SpringNetwork::GetNumSprings() const
+{
+	return _springParticleA.size();
+}
+
+void SpringNetwork::Integrate(Real deltaTime, World& world)
+{
+	const int numParticles = GetNumParticles();
+
+	for (int i = 0; i < numParticles; ++i)
+	{
+		const PhysicsObject* particle = _particles[i];
+
+		_inverseMass[i] = 1 / particle->GetMass();
+		_initialPosition[i] = particle->_state._position;
+		_initialVelocity[i] = particle->_state._velocity;
+		_velocitySum[i] = Vector2r(0);
+		_accelerationSum[i] = Vector2r(0);
+	}
+
+	// Integrate using RK4 method, each evaluation starts from the previous derivative
+	EvaluateDerivative(0, 1, world);
+	EvaluateDerivative(deltaTime / 2, 2, world);
+	EvaluateDerivative(deltaTime / 2, 2, world);
+	EvaluateDerivative(deltaTime, 1, world);
+
+	const Real step = deltaTime / 6;
+
+	for (int i = 0; i < numParticles; ++i)
+	{
+		PhysicsObject* particle = _particles[i];
+
+		particle->_state._position = MulAdd(_initialPosition[i], _velocitySum[i], step);
+		particle->_state._velocity = MulAdd(_initialVelocity[i], _accelerationSum[i], step);
+
+		particle->_constraintAcceleration = Vector2r(0);
+		particle->_constraintStiffness = 0;
+		particle->_constraintDamping = 0;
+	}
+}
+
+void SpringNetwork::EvaluateDerivative(Real deltaTime, Real weight, World& world)
+{
+	const int numParticles = GetNumParticles();
+
+	for (int i = 0; i < numParticles; ++i)
+	{
+		_position[i] = MulAdd(_initialPosition[i], _velocity[i], deltaTime);
+		_velocity[i] = MulAdd(_initialVelocity[i], _acceleration[i], deltaTime);
+
+		// External forces such as gravity and springs in the constraint system
+		State state;
+		state._position = _position[i];
+		state._velocity = _velocity[i];
+		_acceleration[i] = _particles[i]->CalculateAcceleration(state, world);
+	}
+
+	AccumulateSpringForces();
+
+	for (int i = 0; i < numParticles; ++i)
+	{
+		_velocitySum[i].addScaled(_velocity[i], weight);
+		_accelerationSum[i].addScaled(_acceleration[i], weight);
+	}
+}
+
+void SpringNetwork::AccumulateSpringForces()
+{
+	const int numSprings = GetNumSprings();
+
+	// Gather the ends of each spring, particles are shared between springs
+	for (int i = 0; i < numSprings; ++i)
+	{
+		const int a = _springParticleA[i];
+		const int b = _springParticleB[i];
+
+		_springDx[i] = _position[b].x() - _position[a].x();
+		_springDy[i] = _position[b].y() - _position[a].y();
+		_springDvx[i] = _velocity[a].x() - _velocity[b].x();
+		_springDvy[i] = _velocity[a].y() - _velocity[b].y();
+	}
+
+	int solved = 0;
+
+#ifdef SPRING_NETWORK_SSE2
+	const RealBatch minLength = Set((Real)Util::EPSILON);
+
+	for (; solved + BATCH_SIZE <= numSprings; solved += BATCH_SIZE)
+	{
+		RealBatch dx = Load(&_springDx[solved]);
+		RealBatch dy = Load(&_springDy[solved]);
+		RealBatch closing = Add(Mul(dx, Load(&_springDvx[solved])), Mul(dy, Load(&_springDvy[solved])));
+		RealBatch length = Sqrt(Add(Mul(dx, dx), Mul(dy, dy)));
+
+		// Springs whose ends are together have no direction, their force is masked out
+		RealBatch safeLength = Max(length, minLength);
+		RealBatch stretch = Sub(length, Load(&_springLength[solved]));
+		RealBatch force = Sub(Mul(Load(&_springK[solved]), stretch), Div(Mul(Load(&_springDamping[solved]), closing), safeLength));
+
+		Store(&_springScale[solved], MaskGreaterEqual(length, minLength, Div(force, safeLength)));
+	}
+#endif
+
+	SolveSpringForces(solved, numSprings);
+
+	// Scatter the forces back to the particles
+	for (int i = 0; i < numSprings; ++i)
+	{
+		const int a = _springParticleA[i];
+		const int b = _springParticleB[i];
+
+		Vector2r force(_springDx[i] * _springScale[i], _springDy[i] * _springScale[i]);
+
+		_acceleration[a].addScaled(force, _inverseMass[a]);
+		_acceleration[b].addScaled(force, -_inverseMass[b]);
+	}
+}
+
+void SpringNetwork::SolveSpringForces(int first, int end)
+{
+	for (int i = first; i < end; ++i)
+	{
+		Real length = sqrt(_springDx[i] * _springDx[i] + _springDy[i] * _springDy[i]);
+
+		if (length < Util::EPSILON)
+		{
+			_springScale[i] = 0;
+			continue;
+		}
+
+		Real closingSpeed = (_springDx[i] * _springDvx[i] + _springDy[i] * _springDvy[i]) / length;
+		Real force = _springK[i] * (length - _springLength[i]) - _springDamping[i] * closingSpeed;
+
+		_springScale[i] = force / length;
+	}
+}
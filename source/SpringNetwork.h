@@ -0,0 +1,74 @@
+// David Hart - 2012
+//
+// class SpringNetwork
+//   SpringNetwork integrates a group of particles joined by damped springs as a
+//   single system. Springs are stored as pairs of particle indices in flat arrays
+//   and each one is evaluated once per derivative, applying equal and opposite
+//   forces to both ends. The ends of every spring are gathered into flat arrays
+//   so the spring forces can be solved several springs at a time with SSE2
+
+#pragma once
+
+#include "Vector.h"
+#include "Precision.h"
+#include <vector>
+
+class World;
+
+namespace Physics
+{
+	class PhysicsObject;
+
+	class SpringNetwork
+	{
+
+	public:
+
+		SpringNetwork();
+
+		// Returns the index of the particle within the network
+		int AddParticle(PhysicsObject* object);
+		void AddSpring(int particleA, int particleB, Real length, Real k, Real b);
+
+		int GetNumParticles() const;
+		int GetNumSprings() const;
+
+		// Integrates all particles together using RK4
+		void Integrate(Real deltaTime, World& world);
+
+	private:
+
+		void EvaluateDerivative(Real deltaTime, Real weight, World& world);
+		void AccumulateSpringForces();
+
+		// Sets the scale of each spring's separation which gives its force
+		void SolveSpringForces(int first, int end);
+
+		std::vector<PhysicsObject*> _particles;
+
+		// Springs
+		std::vector<int> _springParticleA;
+		std::vector<int> _springParticleB;
+		std::vector<Real> _springLength;
+		std::vector<Real> _springK;
+		std::vector<Real> _springDamping;
+
+		// Per spring scratch, the separation of the ends, the velocity of end A
+		// relative to end B and the scale of the separation giving the force
+		std::vector<Real> _springDx;
+		std::vector<Real> _springDy;
+		std::vector<Real> _springDvx;
+		std::vector<Real> _springDvy;
+		std::vector<Real> _springScale;
+
+		// Per particle integration state
+		std::vector<Real> _inverseMass;
+		std::vector<Vector2r> _initialPosition;
+		std::vector<Vector2r> _initialVelocity;
+		std::vector<Vector2r> _position;
+		std::vector<Vector2r> _velocity;
+		std::vector<Vector2r> _acceleration;
+		std::vector<Vector2r> _velocitySum;
+		std::vector<Vector2r> _accelerationSum;
+	};
+}
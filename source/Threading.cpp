@@ -1,10 +1,13 @@
 // David Hart - 2012
 
 #include "Threading.h"
-#include <process.h>
 
 using namespace Threading;
 
+#ifdef _WIN32
+
+#include <process.h>
+
 Thread::Thread() :
 	_threadHandle(0)
 {
@@ -90,6 +93,123 @@ void Mutex::Exit()
 	ReleaseMutex(_handle);
 }
 
+#else
+
+// Events are manual reset and mutexes are recursive, to match the Windows objects
+
+Thread::Thread() :
+	_started(false),
+	_running(false)
+{
+}
+
+Thread::~Thread()
+{
+}
+
+void Thread::Start()
+{
+	// Set before the thread starts as the thread clears it when it finishes
+	_running = true;
+	_started = pthread_create(&_thread, NULL, &ThreadStartBootstrap, this) == 0;
+
+	if (!_started)
+		_running = false;
+}
+
+void Thread::Join()
+{
+	if (_started)
+	{
+		pthread_join(_thread, NULL);
+		_started = false;
+	}
+}
+
+void* Thread::ThreadStartBootstrap(void* data)
+{
+	Thread* thread = (Thread*)data;
+
+	thread->ThreadMain();
+
+	thread->_running = false;
+
+	return NULL;
+}
+
+bool Thread::IsRunning()
+{
+	return _running;
+}
+
+Event::Event() :
+	_raised(false)
+{
+	pthread_mutex_init(&_mutex, NULL);
+	pthread_cond_init(&_condition, NULL);
+}
+
+Event::~Event()
+{
+	pthread_cond_destroy(&_condition);
+	pthread_mutex_destroy(&_mutex);
+}
+
+void Event::Wait()
+{
+	pthread_mutex_lock(&_mutex);
+
+	while (!_raised)
+	{
+		pthread_cond_wait(&_condition, &_mutex);
+	}
+
+	pthread_mutex_unlock(&_mutex);
+}
+
+void Event::Raise()
+{
+	pthread_mutex_lock(&_mutex);
+	_raised = true;
+	pthread_cond_broadcast(&_condition);
+	pthread_mutex_unlock(&_mutex);
+}
+
+void Event::Reset()
+{
+	pthread_mutex_lock(&_mutex);
+	_raised = false;
+	pthread_mutex_unlock(&_mutex);
+}
+
+Mutex::Mutex()
+{
+	pthread_mutexattr_t attributes;
+	pthread_mutexattr_init(&attributes);
+	pthread_mutexattr_settype(&attributes, PTHREAD_MUTEX_RECURSIVE);
+
+	pthread_mutex_init(&_mutex, &attributes);
+
+	pthread_mutexattr_destroy(&attributes);
+}
+
+Mutex::~Mutex()
+{
+	pthread_mutex_destroy(&_mutex);
+}
+
+void Mutex::Enter()
+{
+	pthread_mutex_lock(&_mutex);
+}
+
+void Mutex::Exit()
+{
+	pthread_mutex_unlock(&_mutex);
+}
+
+#endif
+
 ScopedLock::ScopedLock(Mutex& mutex) :
 	_mutex(mutex)
 {
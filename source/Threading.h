@@ -2,7 +2,12 @@
 
 #pragma once
 
+#ifdef _WIN32
 #include <Windows.h>
+#else
+#include <pthread.h>
+#endif
+
 #include "Uncopyable.h"
 
 namespace Threading
@@ -24,8 +29,16 @@ namespace Threading
 	private:
 		
 		virtual unsigned ThreadMain() = 0;
+
+#ifdef _WIN32
 		static unsigned __stdcall ThreadStartBootstrap(void* data);
 		HANDLE _threadHandle;
+#else
+		static void* ThreadStartBootstrap(void* data);
+		pthread_t _thread;
+		bool _started;
+		volatile bool _running;
+#endif
 
 	};
 
@@ -42,7 +55,13 @@ namespace Threading
 
 	private:
 
+#ifdef _WIN32
 		HANDLE _handle;
+#else
+		pthread_mutex_t _mutex;
+		pthread_cond_t _condition;
+		bool _raised;
+#endif
 
 	};
 
@@ -59,7 +78,11 @@ namespace Threading
 
 	private:
 
+#ifdef _WIN32
 		HANDLE _handle;
+#else
+		pthread_mutex_t _mutex;
+#endif
 	};
 
 	class ScopedLock : public Uncopyable
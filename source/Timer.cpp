@@ -2,6 +2,18 @@
 
 #include "Timer.h"
 
+#ifndef _WIN32
+#include <time.h>
+
+static double GetMonotonicTime()
+{
+	timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return now.tv_sec + now.tv_nsec * 1e-9;
+}
+#endif
+
 Timer::Timer()
 {
 	Start();
@@ -9,14 +21,22 @@ Timer::Timer()
 
 void Timer::Start()
 {
+#ifdef _WIN32
 	QueryPerformanceCounter(&_startTime);
 	QueryPerformanceFrequency(&_freq);
+#else
+	_startTime = GetMonotonicTime();
+#endif
 }
 
 double Timer::GetTime()
 {
+#ifdef _WIN32
 	LARGE_INTEGER endTime;
 	QueryPerformanceCounter(&endTime);
 	
 	return (double)(endTime.QuadPart-_startTime.QuadPart)/_freq.QuadPart;
+#else
+	return GetMonotonicTime() - _startTime;
+#endif
 }
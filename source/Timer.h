@@ -2,7 +2,9 @@
 
 #pragma once
 
+#ifdef _WIN32
 #include <Windows.h>
+#endif
 
 class Timer
 {
@@ -15,6 +17,10 @@ public:
 
 private:
 
+#ifdef _WIN32
 	LARGE_INTEGER _startTime;
 	LARGE_INTEGER _freq;
+#else
+	double _startTime;
+#endif
 };
\ No newline at end of file
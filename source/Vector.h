@@ -26,11 +26,15 @@ public:
 	Vector2<T> operator-() const;
 	
 	T length() const;
+	T lengthSquared() const;
 	T dot(const Vector2<T>& rhs) const;
 	Vector2<T> unit() const;
 	Vector2<T> tangent() const;
 	const Vector2<T>& normalize();
 
+	// Adds v * scale in place
+	Vector2<T>& addScaled(const Vector2<T>& v, T scale);
+
 	T x() const;
 	T y() const;
 
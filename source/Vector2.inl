@@ -8,28 +8,28 @@
 #include <cassert>
 
 template <typename T>
-Vector2<T>::Vector2()
+inline Vector2<T>::Vector2()
 {
 	_v[0] = 0;
 	_v[1] = 0;
 }
 
 template <typename T>
-Vector2<T>::Vector2(T v)
+inline Vector2<T>::Vector2(T v)
 {
 	_v[0] = v;
 	_v[1] = v;
 }
 
 template <typename T> template <typename R>
-Vector2<T>::Vector2(const Vector2<R>& rhs)
+inline Vector2<T>::Vector2(const Vector2<R>& rhs)
 {
 	_v[0] = (T)rhs.x();
 	_v[1] = (T)rhs.y();
 }
 
 template <typename T>
-Vector2<T>::Vector2(T x, T y)
+inline Vector2<T>::Vector2(T x, T y)
 {
 	_v[0] = x;
 	_v[1] = y;
@@ -38,48 +38,48 @@ Vector2<T>::Vector2(T x, T y)
 template <typename T>
 inline Vector2<T>& Vector2<T>::operator+=(const Vector2<T>& rhs)
 {
-	x(x() + rhs.x());
-	y(y() + rhs.y());
+	_v[0] += rhs._v[0];
+	_v[1] += rhs._v[1];
 	return *this;
 }
 
 template <typename T>
 inline Vector2<T>& Vector2<T>::operator-=(const Vector2<T>& rhs)
 {
-	x(x() - rhs.x());
-	y(y() - rhs.y());
+	_v[0] -= rhs._v[0];
+	_v[1] -= rhs._v[1];
 	return *this;
 }
 
 template <typename T>
 inline Vector2<T>& Vector2<T>::operator*=(const Vector2<T>& rhs)
 {
-	x(x() * rhs.x());
-	y(y() * rhs.y());
+	_v[0] *= rhs._v[0];
+	_v[1] *= rhs._v[1];
 	return *this;
 }
 
 template <typename T>
 inline Vector2<T>& Vector2<T>::operator*=(T rhs)
 {
-	x(x() * rhs);
-	y(y() * rhs);
+	_v[0] *= rhs;
+	_v[1] *= rhs;
 	return *this;
 }
 
 template <typename T>
 inline Vector2<T>& Vector2<T>::operator/=(const Vector2<T>& rhs)
 {
-	x(x() / rhs.x());
-	y(y() / rhs.y());
+	_v[0] /= rhs._v[0];
+	_v[1] /= rhs._v[1];
 	return *this;
 }
 
 template <typename T>
 inline Vector2<T>& Vector2<T>::operator/=(T rhs)
 {
-	x(x() / rhs);
-	y(y() / rhs);
+	_v[0] /= rhs;
+	_v[1] /= rhs;
 	return *this;
 }
 
@@ -92,13 +92,27 @@ inline Vector2<T> Vector2<T>::operator-() const
 template <typename T>
 inline T Vector2<T>::length() const
 {
-	return sqrt(x() * x() + y() * y());
+	return sqrt(lengthSquared());
+}
+
+template <typename T>
+inline T Vector2<T>::lengthSquared() const
+{
+	return _v[0] * _v[0] + _v[1] * _v[1];
 }
 
 template <typename T>
 inline T Vector2<T>::dot(const Vector2<T>& rhs) const
 {
-	return x() * rhs.x() + y() * rhs.y();
+	return _v[0] * rhs._v[0] + _v[1] * rhs._v[1];
+}
+
+template <typename T>
+inline Vector2<T>& Vector2<T>::addScaled(const Vector2<T>& v, T scale)
+{
+	_v[0] += v._v[0] * scale;
+	_v[1] += v._v[1] * scale;
+	return *this;
 }
 
 template <typename T>
@@ -181,37 +195,37 @@ inline Vector3<T> Vector2<T>::xy1()
 template <typename T>
 inline Vector2<T> operator+(const Vector2<T>& lhs, const Vector2<T>& rhs)
 {
-	return Vector2<T>(lhs) += rhs;
+	return Vector2<T>(lhs.x() + rhs.x(), lhs.y() + rhs.y());
 }
 
 template <typename T>
 inline Vector2<T> operator-(const Vector2<T>& lhs, const Vector2<T>& rhs)
 {
-	return Vector2<T>(lhs) -= rhs;
+	return Vector2<T>(lhs.x() - rhs.x(), lhs.y() - rhs.y());
 }
 
 template <typename T>
 inline Vector2<T> operator*(const Vector2<T>& lhs, const Vector2<T>& rhs)
 {
-	return Vector2<T>(lhs) *= rhs;
+	return Vector2<T>(lhs.x() * rhs.x(), lhs.y() * rhs.y());
 }
 
 template <typename T>
 inline Vector2<T> operator*(T lhs, const Vector2<T>& rhs)
 {
-	return Vector2<T>(rhs) *= lhs;
+	return Vector2<T>(lhs * rhs.x(), lhs * rhs.y());
 }
 
 template <typename T>
 inline Vector2<T> operator*(const Vector2<T>& lhs, T rhs)
 {
-	return Vector2<T>(lhs) *= rhs;
+	return Vector2<T>(lhs.x() * rhs, lhs.y() * rhs);
 }
 
 template <typename T>
 inline Vector2<T> operator/(const Vector2<T>& lhs, const Vector2<T>& rhs)
 {
-	return Vector2<T>(lhs) /= rhs;
+	return Vector2<T>(lhs.x() / rhs.x(), lhs.y() / rhs.y());
 }
 
 template <typename T>
@@ -223,7 +237,14 @@ inline Vector2<T> operator/(T lhs, const Vector2<T>& rhs)
 template <typename T>
 inline Vector2<T> operator/(const Vector2<T>& lhs, T rhs)
 {
-	return Vector2<T>(lhs) /= rhs;
+	return Vector2<T>(lhs.x() / rhs, lhs.y() / rhs);
+}
+
+// Returns a + b * scale without the intermediate vector
+template <typename T>
+inline Vector2<T> MulAdd(const Vector2<T>& a, const Vector2<T>& b, T scale)
+{
+	return Vector2<T>(a.x() + b.x() * scale, a.y() + b.y() * scale);
 }
 
 template <typename T>
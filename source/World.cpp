@@ -1,32 +1,72 @@
 // David Hart - 2012
 
 #include "World.h"
+#include <cstring>
+#include <algorithm>
 
-Color World::PEER0_COLOR(0.0f, 1.0f, 0.4f);
-Color World::PEER1_COLOR(1.0f, 0.4f, 0.0f);
+Color World::PEER_COLORS[RegionMap::MAX_PEERS] =
+{
+	Color(0.0f, 1.0f, 0.4f),
+	Color(1.0f, 0.4f, 0.0f),
+	Color(0.2f, 0.5f, 1.0f),
+	Color(1.0f, 0.9f, 0.1f),
+	Color(0.9f, 0.2f, 0.9f),
+	Color(0.1f, 0.9f, 0.9f),
+	Color(1.0f, 0.3f, 0.4f),
+	Color(0.6f, 0.4f, 1.0f),
+};
+
+World::ShapeBuffer::ShapeBuffer() :
+	_numQuads(0),
+	_numTriangles(0),
+	_tick(0),
+	_cellMargin(0),
+	_binned(false)
+{
+	_quadRanges.reserve(MAX_DIRTY_RANGES);
+	_triangleRanges.reserve(MAX_DIRTY_RANGES);
+}
 
 World::World() :
-	_drawBuffer(0),
-	_readBuffer(0),
-	_writeBuffer(1),
-	_freeBuffer(2),
+	_writeBuffer(0),
+	_drawBuffer(1),
+	_sharedBuffer(2),
+	_numQuads(0),
+	_numTriangles(0),
+	_quadCapacity(0),
+	_triangleCapacity(0),
+	_writeTick(1),
+	_drawnTick(0),
+	_hasRenderer(false),
+	_viewChanged(false),
+	_shapesCulled(false),
+	_viewCulled(false),
+	_leftButton(false),
+	_rightButton(false),
+	_rightButtonHandled(false),
 	_worldMin(-20, 0),
 	_worldMax(20, 20),
+	_cursorSpring(Physics::INVALID_CONSTRAINT),
 	_objectTiedToCursor(NULL),
 	_colorMode(COLOR_PROPERTY),
 	_resetBlobbyPressed(false),
-	_blobby(NULL),
-	_peerBounds(Vector2d(0, 0), Vector2d(10, 10)),
-	_otherPeerId(-1),
+	_blobbyParts(Physics::BlobbyObject::DEFAULT_NUM_PARTS),
+	_blobbyStiffness(Physics::BlobbyObject::DEFAULT_STIFFNESS),
+	_peerBoundsChanged(true),
 	_gravity(-9.81),
 	_friction(0.05),
 	_elasticity(0.8),
 	_simSpeed(1)
 {
+	_copyRanges.reserve(MAX_DIRTY_RANGES);
+
+	for (unsigned i = 0; i < RegionMap::MAX_PEERS; ++i)
+	{
+		_hasPeerBounds[i] = false;
+	}
+
 	_objectBuckets.resize(GetNumBucketsTall()*GetNumBucketsWide());
 
-	_cursorSpring.SetSpringConstant(1000);
-	_cursorSpring.SetDampingConstant(100);
 	for (unsigned i = 0; i < _objectBuckets.size(); ++i)
 	{
 		_objectBuckets[i].reserve(20);
@@ -47,7 +87,7 @@ World::~World()
 {
 	for (unsigned i = 0; i < _objects.size(); ++i)
 	{
-		delete _objects[i];
+		DestroyObject(_objects[i]);
 	}
 }
 
@@ -57,10 +97,23 @@ void World::Create(const Renderer* renderer, const Vector2d& worldMin, const Vec
 	_worldMax = worldMax;
 	_bucketSize = (_worldMax - _worldMin) / Vector2d(GetNumBucketsWide(), GetNumBucketsTall());
 
+	// Boundary collisions are only tested in the outer ring of buckets, so no object
+	// may be able to reach a wall from further in than that
+	assert(_bucketSize.x() > 0.5 && _bucketSize.y() > 0.5);
+
+	_spatialIndex.Create(_worldMin, _worldMax, GetNumBucketsWide(), GetNumBucketsTall());
+	_regionMap.Create(_worldMin, _worldMax);
+
+	// Without a renderer the world runs headless and no shapes are generated
+	_hasRenderer = renderer != NULL;
+	_viewBounds = AABB(_worldMin, _worldMax);
+
+	if (!_hasRenderer)
+		return;
+
 	_shapeBatch.Create(renderer);
 
-	_shapeBatch.AddArray(&_quadBuffer);
-	_shapeBatch.AddArray(&_triangleBuffer);
+	_shapeBatch.AddArray(&_shapeArray);
 	_shapeBatch.AddArray(&_springBuffer);
 
 	_worldBoundaryLines.resize(4 + // World Boundary
@@ -111,20 +164,34 @@ void World::Create(const Renderer* renderer, const Vector2d& worldMin, const Vec
 	_worldBoundaryBuffer.SetShapes(&_worldBoundaryLines[0], _worldBoundaryLines.size());
 
 	_shapeBatch.AddArray(&_peerBoundaryBuffer);
-	_peerBoundaryLines.resize(4);
+	_peerBoundaryLines.resize(4 * RegionMap::MAX_PEERS);
 	UpdatePeerBoundaryLines();
 }
 
 void World::Dispose()
 {
-	_shapeBatch.Dispose();
+	if (_hasRenderer)
+	{
+		_shapeBatch.Dispose();
+	}
 }
 
-Physics::TriangleObject* World::AddTriangle()
+bool World::HasRenderer() const
+{
+	return _hasRenderer;
+}
+
+void World::GenerateShapes(int objectMin, int objectMax)
 {
-	_buffers[_writeBuffer]._triangles.push_back(Triangle());
+	for (int i = objectMin; i <= objectMax; ++i)
+	{
+		_objects[i]->UpdateShape(*this);
+	}
+}
 
-	Physics::TriangleObject* triangle = new Physics::TriangleObject(_buffers[_writeBuffer]._triangles.size() - 1);
+Physics::TriangleObject* World::AddTriangle()
+{
+	Physics::TriangleObject* triangle = new (_trianglePool.Allocate()) Physics::TriangleObject(*this);
 
 	AddObject(triangle);
 
@@ -133,9 +200,7 @@ Physics::TriangleObject* World::AddTriangle()
 
 Physics::BoxObject* World::AddBox()
 {
-	_buffers[_writeBuffer]._quads.push_back(Quad());
-
-	Physics::BoxObject* box = new Physics::BoxObject(_buffers[_writeBuffer]._quads.size() - 1);
+	Physics::BoxObject* box = new (_boxPool.Allocate()) Physics::BoxObject(*this);
 
 	AddObject(box);
 
@@ -144,16 +209,22 @@ Physics::BoxObject* World::AddBox()
 
 Physics::BlobbyObject* World::AddBlobbyObject()
 {
-	Physics::BlobbyObject* blobby = new Physics::BlobbyObject(*this);
+	return AddBlobbyObject(_blobbyParts, _blobbyStiffness);
+}
+
+Physics::BlobbyObject* World::AddBlobbyObject(int numParts, double stiffness)
+{
+	Physics::BlobbyObject* blobby = new (_blobbyPool.Allocate()) Physics::BlobbyObject(*this, numParts, (Real)stiffness);
 
 	AddObject(blobby);
+	_blobbies.push_back(blobby);
 
 	return blobby;
 }
 
 Physics::BlobbyPart* World::AddBlobbyPart()
 {
-	Physics::BlobbyPart* part = new Physics::BlobbyPart();
+	Physics::BlobbyPart* part = new (_blobbyPartPool.Allocate()) Physics::BlobbyPart();
 
 	AddObject(part);
 
@@ -162,22 +233,160 @@ Physics::BlobbyPart* World::AddBlobbyPart()
 
 void World::AddObject(Physics::PhysicsObject* object)
 {
+	// Reuse a free handle slot if there is one
+	int slot;
+	if (_freeHandleSlots.size() > 0)
+	{
+		slot = _freeHandleSlots.back();
+		_freeHandleSlots.pop_back();
+	}
+	else
+	{
+		slot = _handleSlots.size();
+
+		HandleSlot handleSlot;
+		handleSlot._generation = 0;
+		_handleSlots.push_back(handleSlot);
+	}
+
+	_handleSlots[slot]._object = _objects.size();
+
 	object->SetId(_objects.size());
+	object->SetHandle(Physics::ObjectHandle(slot, _handleSlots[slot]._generation));
 	_objects.push_back(object);
 }
 
-void World::ClearObjects()
+bool World::RemoveObject(const Physics::ObjectHandle& handle)
 {
+	Physics::PhysicsObject* object = GetObject(handle);
+
+	if (object == NULL)
+		return false;
+
+	// Parts are removed along with the blobby which owns them
+	assert(object->GetParent() == NULL);
 
-	for (unsigned int i = 0; i < _objects.size(); ++i)
+	if (object->GetSerializationType() == Physics::OBJECT_BLOBBY)
 	{
-		delete _objects[i];
+		Physics::BlobbyObject* blobby = static_cast<Physics::BlobbyObject*>(object);
+
+		for (int i = 0; i < blobby->GetNumParts(); ++i)
+		{
+			RemoveFromWorld(blobby->GetPart(i));
+		}
+
+		for (unsigned i = 0; i < _blobbies.size(); ++i)
+		{
+			if (_blobbies[i] == blobby)
+			{
+				_blobbies[i] = _blobbies.back();
+				_blobbies.pop_back();
+				break;
+			}
+		}
+	}
+
+	RemoveFromWorld(object);
+
+	return true;
+}
+
+void World::RemoveFromWorld(Physics::PhysicsObject* object)
+{
+	_constraints.RemoveConstraintsOn(object);
+
+	// The cursor spring was removed with the object's other constraints
+	if (object == _objectTiedToCursor)
+	{
+		_cursorSpring = Physics::INVALID_CONSTRAINT;
+		_objectTiedToCursor = NULL;
+	}
+
+	object->ReleaseShapes(*this);
+
+	// Move the last object into the freed index. The buckets are rebuilt by the
+	// next broadphase before they are used, so they don't need to be updated
+	int id = object->GetId();
+	Physics::PhysicsObject* last = _objects.back();
+
+	_objects[id] = last;
+	last->SetId(id);
+	_handleSlots[last->GetHandle()._index]._object = id;
+
+	_objects.pop_back();
+
+	DestroyObject(object);
+}
+
+void World::DestroyObject(Physics::PhysicsObject* object)
+{
+	// Invalidate any handles to the object and free its slot
+	const Physics::ObjectHandle& handle = object->GetHandle();
+	_handleSlots[handle._index]._object = -1;
+	_handleSlots[handle._index]._generation++;
+	_freeHandleSlots.push_back(handle._index);
+
+	switch (object->GetSerializationType())
+	{
+	case Physics::OBJECT_BOX:
+		_boxPool.Free(static_cast<Physics::BoxObject*>(object));
+		break;
+
+	case Physics::OBJECT_TRIANGLE:
+		_trianglePool.Free(static_cast<Physics::TriangleObject*>(object));
+		break;
+
+	case Physics::OBJECT_BLOBBY:
+		_blobbyPool.Free(static_cast<Physics::BlobbyObject*>(object));
+		break;
+
+	case Physics::OBJECT_BLOBBY_PART:
+		_blobbyPartPool.Free(static_cast<Physics::BlobbyPart*>(object));
+		break;
+
+	default:
+		assert(false);
+	}
+}
+
+void World::ReserveObjects(int boxes, int triangles, int blobbyParts, int blobbies)
+{
+	_boxPool.Reserve(boxes);
+	_trianglePool.Reserve(triangles);
+	_blobbyPartPool.Reserve(blobbyParts);
+	_blobbyPool.Reserve(blobbies);
+
+	int numObjects = boxes + triangles + blobbyParts + blobbies;
+	_objects.reserve(numObjects);
+
+	// Blobbies draw a triangle for each of their parts
+	ReserveShapes(boxes, triangles + blobbyParts);
+	_quadOwners.reserve(boxes);
+	_triangleOwners.reserve(triangles + blobbyParts);
+	_handleSlots.reserve(numObjects);
+	_freeHandleSlots.reserve(numObjects);
+}
+
+void World::ClearObjects()
+{
+	// Destroy in reverse so objects added again in the same order get back the same handle slots
+	for (int i = _objects.size() - 1; i >= 0; --i)
+	{
+		DestroyObject(_objects[i]);
 	}
 
 	_objects.clear();
+	_blobbies.clear();
+
+	// Constraints refer to the deleted objects
+	_constraints.Clear();
+	_cursorSpring = Physics::INVALID_CONSTRAINT;
+	_objectTiedToCursor = NULL;
 
-	_buffers[_writeBuffer]._quads.clear();
-	_buffers[_writeBuffer]._triangles.clear();
+	_numQuads = 0;
+	_numTriangles = 0;
+	_quadOwners.clear();
+	_triangleOwners.clear();
 }
 
 Physics::PhysicsObject* World::GetObject(int id)
@@ -185,6 +394,34 @@ Physics::PhysicsObject* World::GetObject(int id)
 	return _objects[id];
 }
 
+Physics::PhysicsObject* World::GetObject(const Physics::ObjectHandle& handle)
+{
+	if (handle._index < 0 || handle._index >= (int)_handleSlots.size())
+		return NULL;
+
+	const HandleSlot& slot = _handleSlots[handle._index];
+
+	if (slot._generation != handle._generation || slot._object < 0)
+		return NULL;
+
+	return _objects[slot._object];
+}
+
+Physics::ConstraintSystem& World::GetConstraints()
+{
+	return _constraints;
+}
+
+SpatialIndex& World::GetSpatialIndex()
+{
+	return _spatialIndex;
+}
+
+void World::UpdateSpatialIndex()
+{
+	_spatialIndex.Update(_objects);
+}
+
 void World::BroadPhase(int bucketXMin, int bucketXMax)
 {
 	// Clear buckets this thread manages
@@ -206,7 +443,7 @@ void World::BroadPhase(int bucketXMin, int bucketXMax)
 
 	for (unsigned i = 0; i < _objects.size(); ++i)
 	{
-		Vector2d position = _objects[i]->GetPosition();
+		Vector2d position(_objects[i]->GetPosition());
 
 		// If the position is somewhere within the band this thread is concerned with
 		if (   (position.x() >= bucketXMinWorldSpace || xMin)
@@ -224,23 +461,163 @@ void World::BroadPhase(int bucketXMin, int bucketXMax)
 			assert(bucket.x() <= bucketXMax);
 
 			_objectBuckets[GetBucketIndex(bucket)].push_back(i);
+
+			// Each object is placed by exactly one thread
+			_collisionVelocities[i] = _objects[i]->GetVelocity();
 		}
 	}
 }
 
-void World::DetectCollisions(int bucketXMin, int bucketXMax)
+void World::PrepareContacts(unsigned numThreads)
 {
+	_contactArenas.resize(numThreads);
+	_collisionVelocities.resize(_objects.size());
+
+	_threadContactImpulses.resize(numThreads);
+
+	for (unsigned i = 0; i < numThreads; ++i)
+	{
+		_threadContactImpulses[i].clear();
+	}
+
+	_contactImpulses.clear();
+}
+
+void World::DetectCollisions(int bucketXMin, int bucketXMax, unsigned threadId)
+{
+	// Contacts are only added to objects in this thread's buckets, so all
+	// of an object's contacts end up in the same arena
+	_contactArenas[threadId].clear();
+
 	Vector2i bucket;
 	for (bucket.x(bucketXMin); bucket.x() <= bucketXMax; bucket.x(bucket.x() + 1))
 	{
 		for (bucket.y(0); bucket.y() < GetNumBucketsTall(); bucket.y(bucket.y() + 1))
 		{
-			DetectCollisionsInBucket(bucket);
+			DetectCollisionsInBucket(bucket, threadId);
+		}
+	}
+
+	DetectBoundaryCollisions(bucketXMin, bucketXMax, threadId);
+}
+
+const Physics::ContactArena& World::GetContactArena(unsigned threadId) const
+{
+	return _contactArenas[threadId];
+}
+
+void World::AddContactImpulse(unsigned threadId, const Physics::ContactImpulse& impulse)
+{
+	_threadContactImpulses[threadId].push_back(impulse);
+}
+
+void World::ApplyContactImpulses()
+{
+	for (unsigned i = 0; i < _threadContactImpulses.size(); ++i)
+	{
+		const Physics::ContactImpulseList& impulses = _threadContactImpulses[i];
+
+		for (unsigned j = 0; j < impulses.size(); ++j)
+		{
+			// Our copy reacts straight away rather than waiting for the owner's update
+			Physics::PhysicsObject* object = _objects[impulses[j]._object];
+			object->SetVelocity(object->GetVelocity() + impulses[j]._velocity);
+			object->SetPosition(object->GetPosition() + impulses[j]._position);
+		}
+
+		_contactImpulses.insert(_contactImpulses.end(), impulses.begin(), impulses.end());
+	}
+}
+
+const Physics::ContactImpulseList& World::GetContactImpulses() const
+{
+	return _contactImpulses;
+}
+
+const Vector2r& World::GetCollisionVelocity(int object) const
+{
+	return _collisionVelocities[object];
+}
+
+void World::DetectBoundaryCollisions(int bucketXMin, int bucketXMax, unsigned threadId)
+{
+	// Only objects in the outer ring of buckets can touch the world boundary,
+	// anything outside the world is clamped into this ring by the broadphase
+	for (int x = bucketXMin; x <= bucketXMax; ++x)
+	{
+		if (x == 0 || x == GetNumBucketsWide() - 1)
+		{
+			for (int y = 0; y < GetNumBucketsTall(); ++y)
+			{
+				DetectBoundaryCollisionsInBucket(Vector2i(x, y), threadId);
+			}
+		}
+		else
+		{
+			DetectBoundaryCollisionsInBucket(Vector2i(x, 0), threadId);
+			DetectBoundaryCollisionsInBucket(Vector2i(x, GetNumBucketsTall() - 1), threadId);
+		}
+	}
+}
+
+void World::DetectBoundaryCollisionsInBucket(const Vector2i& bucket, unsigned threadId)
+{
+	Bucket& objects = _objectBuckets[GetBucketIndex(bucket)];
+	Physics::ContactArena& arena = _contactArenas[threadId];
+
+	Physics::Contact contact;
+	contact._other = -1;
+
+	for (unsigned i = 0; i < objects.size(); ++i)
+	{
+		Physics::PhysicsObject* object = _objects[objects[i]];
+
+		Vector2r position = object->GetPosition();
+		Vector2r min = Vector2r(_worldMin) + Vector2r(object->GetHalfExtent());
+		Vector2r max = Vector2r(_worldMax) - Vector2r(object->GetHalfExtent());
+
+		// Early out for the common case of an object in a boundary bucket but clear of the walls
+		if (position.x() >= min.x() && position.x() <= max.x() &&
+			position.y() >= min.y() && position.y() <= max.y())
+		{
+			continue;
+		}
+
+		// top
+		if (position.y() > max.y())
+		{
+			contact._penetrationDistance = (float)(position.y() - max.y());
+			contact._normal = Physics::NORMAL_NEGATIVE_Y;
+			object->AddContact(contact, threadId, arena);
+		}
+
+		// bottom
+		if (position.y() < min.y())
+		{
+			contact._penetrationDistance = (float)(min.y() - position.y());
+			contact._normal = Physics::NORMAL_POSITIVE_Y;
+			object->AddContact(contact, threadId, arena);
+		}
+
+		// right
+		if (position.x() > max.x())
+		{
+			contact._penetrationDistance = (float)(position.x() - max.x());
+			contact._normal = Physics::NORMAL_NEGATIVE_X;
+			object->AddContact(contact, threadId, arena);
+		}
+
+		// left
+		if (position.x() < min.x())
+		{
+			contact._penetrationDistance = (float)(min.x() - position.x());
+			contact._normal = Physics::NORMAL_POSITIVE_X;
+			object->AddContact(contact, threadId, arena);
 		}
 	}
 }
 
-void World::TestObjectsAgainstBucket(Bucket& objects, const Vector2i& bucket)
+void World::TestObjectsAgainstBucket(Bucket& objects, const Vector2i& bucket, unsigned threadId)
 {
 	if (bucket.x() < 0) return;
 	if (bucket.x() >= GetNumBucketsWide()) return;
@@ -248,6 +625,7 @@ void World::TestObjectsAgainstBucket(Bucket& objects, const Vector2i& bucket)
 	if (bucket.y() >= GetNumBucketsTall()) return;
 
 	Bucket& testBucket = _objectBuckets[GetBucketIndex(bucket)];
+	Physics::ContactArena& arena = _contactArenas[threadId];
 
 	Physics::Contact contact;
 
@@ -259,15 +637,17 @@ void World::TestObjectsAgainstBucket(Bucket& objects, const Vector2i& bucket)
 
 			if (object->TestCollision(*_objects[testBucket[j]], contact))
 			{
-				object->AddContact(contact);
+				contact._other = testBucket[j];
+				object->AddContact(contact, threadId, arena);
 			}
 		}
 	}
 }
 
-void World::DetectCollisionsInBucket(const Vector2i& bucket)
+void World::DetectCollisionsInBucket(const Vector2i& bucket, unsigned threadId)
 {
 	Bucket& bucketObjects = _objectBuckets[GetBucketIndex(bucket)];
+	Physics::ContactArena& arena = _contactArenas[threadId];
 	
 	Physics::Contact contact;
 
@@ -280,10 +660,12 @@ void World::DetectCollisionsInBucket(const Vector2i& bucket)
 
 			if (objectA->TestCollision(*objectB, contact))
 			{
-				objectA->AddContact(contact);
+				contact._other = bucketObjects[j];
+				objectA->AddContact(contact, threadId, arena);
 
 				contact.Reverse();
-				objectB->AddContact(contact);
+				contact._other = bucketObjects[i];
+				objectB->AddContact(contact, threadId, arena);
 			}
 		}
 	}
@@ -293,24 +675,32 @@ void World::DetectCollisionsInBucket(const Vector2i& bucket)
 		for (int y = -1; y < 2; y++)
 		{
 			if (!(x == 0 && y == 0))
-				TestObjectsAgainstBucket(bucketObjects, bucket + Vector2i(x, y));
+				TestObjectsAgainstBucket(bucketObjects, bucket + Vector2i(x, y), threadId);
 		}
 	}
 }
 
 void World::UpdateTriangle(int id, const Triangle& triangle)
 {
-	_buffers[_writeBuffer]._triangles[id] = triangle;
+	if (memcmp(&_triangles[id], &triangle, sizeof(Triangle)) != 0)
+	{
+		_triangles[id] = triangle;
+		_triangleChangeTicks[id] = _writeTick;
+	}
 }
 
 void World::UpdateQuad(int id, const Quad& quad)
 {
-	_buffers[_writeBuffer]._quads[id] = quad;
+	if (memcmp(&_quads[id], &quad, sizeof(Quad)) != 0)
+	{
+		_quads[id] = quad;
+		_quadChangeTicks[id] = _writeTick;
+	}
 }
 
 const Quad* World::GetQuadDrawBuffer() const
 {
-	if (_buffers[_drawBuffer]._quads.empty())
+	if (_buffers[_drawBuffer]._numQuads == 0)
 		return NULL;
 
 	return &(_buffers[_drawBuffer]._quads[0]);
@@ -318,7 +708,7 @@ const Quad* World::GetQuadDrawBuffer() const
 
 const Triangle* World::GetTriangleDrawBuffer() const
 {
-	if (_buffers[_drawBuffer]._triangles.empty())
+	if (_buffers[_drawBuffer]._numTriangles == 0)
 		return NULL;
 
 	return &(_buffers[_drawBuffer]._triangles[0]);
@@ -326,80 +716,346 @@ const Triangle* World::GetTriangleDrawBuffer() const
 
 int World::GetNumQuads() const
 {
-	return _buffers[_drawBuffer]._quads.size();
+	return _buffers[_drawBuffer]._numQuads;
 }
 
 int World::GetNumTriangles() const
 {
-	return _buffers[_drawBuffer]._quads.size();
+	return _buffers[_drawBuffer]._numTriangles;
 }
 
 void World::Draw()
 {
-	SwapDrawState();
+	if (!_hasRenderer)
+		return;
 
 	UpdatePeerBoundaryLines();
 	UpdateSpringLine();
 
-	_quadBuffer.SetShapes(GetQuadDrawBuffer(), _buffers[_drawBuffer]._quads.size());
-	_triangleBuffer.SetShapes(GetTriangleDrawBuffer(), _buffers[_drawBuffer]._triangles.size());
+	// The instance buffers still hold the last state if nothing new was published
+	bool newState = SwapDrawState();
+
+	if (newState || _viewChanged)
+	{
+		UploadShapes(_buffers[_drawBuffer], newState);
+
+		_drawnTick = _buffers[_drawBuffer]._tick;
+		_viewChanged = false;
+	}
 
 	_shapeBatch.Draw();
 }
 
-void World::SwapDrawState()
+void World::UploadShapes(const ShapeBuffer& buffer, bool newState)
 {
-	Threading::ScopedLock lock(_stateChangeMutex);
+	// Growing the instance buffer discards its contents
+	bool uploadAll = _shapeArray.Reserve(buffer._quads.size(), buffer._triangles.size());
 
-	if (_drawBuffer != _readBuffer)
+	// Shapes are sorted by the cell their centre is in, so widen the view
+	// by how far they can reach outside it
+	Vector2d margin((double)buffer._cellMargin);
+	Vector2i maxCell(GetNumBucketsWide() - 1, GetNumBucketsTall() - 1);
+
+	Vector2i cellMin = GetBucketForPoint(_viewBounds.Min() - margin);
+	Vector2i cellMax = GetBucketForPoint(_viewBounds.Max() + margin);
+	cellMin = Vector2i(Util::Min(cellMin.x(), maxCell.x()), Util::Min(cellMin.y(), maxCell.y()));
+	cellMax = Vector2i(Util::Min(cellMax.x(), maxCell.x()), Util::Min(cellMax.y(), maxCell.y()));
+
+	bool wholeWorldVisible = cellMin.x() == 0 && cellMin.y() == 0 && cellMax.x() == maxCell.x() && cellMax.y() == maxCell.y();
+
+	_viewCulled = !wholeWorldVisible;
+
+	// States published before the view was culled aren't sorted, so draw every
+	// shape until a sorted state arrives
+	if (wholeWorldVisible || !buffer._binned)
 	{
-		// If the buffers were resized while we were drawing update the old draw buffer to the new size
-		if (_buffers[_drawBuffer]._quads.size() != _buffers[_writeBuffer]._quads.size())
+		// The instance buffers hold the visible shapes, not the shapes by index
+		if (_shapesCulled || uploadAll)
+		{
+			ShapeRange allQuads = { 0, (unsigned)buffer._numQuads };
+			ShapeRange allTriangles = { 0, (unsigned)buffer._numTriangles };
+
+			_shapeArray.UpdateQuads(GetQuadDrawBuffer(), buffer._numQuads, &allQuads, 1);
+			_shapeArray.UpdateTriangles(GetTriangleDrawBuffer(), buffer._numTriangles, &allTriangles, 1);
+
+			_shapesCulled = false;
+		}
+		else if (newState)
 		{
-			_buffers[_drawBuffer]._quads.resize(_buffers[_writeBuffer]._quads.size());
+			_shapeArray.UpdateQuads(GetQuadDrawBuffer(), buffer._numQuads,
+				buffer._quadRanges.empty() ? NULL : &buffer._quadRanges[0], buffer._quadRanges.size());
+			_shapeArray.UpdateTriangles(GetTriangleDrawBuffer(), buffer._numTriangles,
+				buffer._triangleRanges.empty() ? NULL : &buffer._triangleRanges[0], buffer._triangleRanges.size());
 		}
 
-		if (_buffers[_drawBuffer]._triangles.size() != _buffers[_writeBuffer]._triangles.size())
+		return;
+	}
+
+	unsigned numQuads = GatherVisibleShapes(buffer._quads, buffer._quadCellStart, buffer._cellQuads, cellMin, cellMax, _visibleQuads);
+	unsigned numTriangles = GatherVisibleShapes(buffer._triangles, buffer._triangleCellStart, buffer._cellTriangles, cellMin, cellMax, _visibleTriangles);
+
+	ShapeRange visibleQuads = { 0, numQuads };
+	ShapeRange visibleTriangles = { 0, numTriangles };
+
+	_shapeArray.UpdateQuads(_visibleQuads.empty() ? NULL : &_visibleQuads[0], numQuads, &visibleQuads, 1);
+	_shapeArray.UpdateTriangles(_visibleTriangles.empty() ? NULL : &_visibleTriangles[0], numTriangles, &visibleTriangles, 1);
+
+	_shapesCulled = true;
+}
+
+template <typename T> unsigned World::GatherVisibleShapes(const std::vector<T>& shapes, const std::vector<int>& cellStart, const std::vector<int>& cellShapes,
+	const Vector2i& cellMin, const Vector2i& cellMax, std::vector<T>& visible)
+{
+	if (visible.size() < shapes.size())
+	{
+		visible.resize(shapes.size());
+	}
+
+	unsigned count = 0;
+
+	for (int y = cellMin.y(); y <= cellMax.y(); ++y)
+	{
+		// The cells in a row are next to each other in the sorted shapes
+		int first = cellStart[GetBucketIndex(Vector2i(cellMin.x(), y))];
+		int end = cellStart[GetBucketIndex(Vector2i(cellMax.x(), y)) + 1];
+
+		for (int i = first; i < end; ++i)
 		{
-			_buffers[_drawBuffer]._triangles.resize(_buffers[_writeBuffer]._triangles.size());
+			visible[count++] = shapes[cellShapes[i]];
 		}
+	}
+
+	return count;
+}
+
+void World::SetViewBounds(const AABB& bounds)
+{
+	_viewBounds = bounds;
+	_viewChanged = true;
+}
+
+bool World::SwapDrawState()
+{
+	// Only the simulation sets the fresh flag and only the renderer clears it,
+	// so if it is set here it is still set when the exchange is made
+	if ((_sharedBuffer & FRESH_STATE) == 0)
+		return false;
+
+	// Give back the buffer we finished drawing and take the latest state
+	_drawBuffer = InterlockedExchange(&_sharedBuffer, _drawBuffer) & BUFFER_INDEX_MASK;
 
-		_freeBuffer = _drawBuffer;
+	return true;
+}
+
+void World::PrepareWriteState()
+{
+	// Buffers are only short of the capacity if more shapes were added than were
+	// reserved, each one is grown once the next time it is written to
+	GrowShapeBuffer(_buffers[_writeBuffer]);
+}
+
+void World::GrowShapeBuffer(ShapeBuffer& buffer)
+{
+	if ((int)buffer._quads.size() < _quadCapacity)
+	{
+		buffer._quads.resize(_quadCapacity);
+		buffer._cellQuads.resize(_quadCapacity);
+	}
+
+	if ((int)buffer._triangles.size() < _triangleCapacity)
+	{
+		buffer._triangles.resize(_triangleCapacity);
+		buffer._cellTriangles.resize(_triangleCapacity);
 	}
 
-	_drawBuffer = _readBuffer;
+	int numCells = GetNumBucketsWide() * GetNumBucketsTall();
+	buffer._quadCellStart.resize(numCells + 1);
+	buffer._triangleCellStart.resize(numCells + 1);
 }
 
 void World::SwapWriteState()
 {
-	Threading::ScopedLock lock(_stateChangeMutex);
+	ShapeBuffer& buffer = _buffers[_writeBuffer];
+
+	// Bring the buffer up to date by copying the shapes changed since it was last written
+	FindChangedRanges(_quadChangeTicks, _numQuads, buffer._tick, _copyRanges);
+	CopyRanges(_quads, buffer._quads, _copyRanges);
+
+	FindChangedRanges(_triangleChangeTicks, _numTriangles, buffer._tick, _copyRanges);
+	CopyRanges(_triangles, buffer._triangles, _copyRanges);
+
+	// The renderer may upload a later state before it takes this one, which
+	// only means some of the ranges were already uploaded
+	unsigned drawnTick = _drawnTick;
+	FindChangedRanges(_quadChangeTicks, _numQuads, drawnTick, buffer._quadRanges);
+	FindChangedRanges(_triangleChangeTicks, _numTriangles, drawnTick, buffer._triangleRanges);
+
+	buffer._numQuads = _numQuads;
+	buffer._numTriangles = _numTriangles;
+	buffer._tick = _writeTick++;
+
+	buffer._binned = _hasRenderer && _viewCulled;
+
+	if (buffer._binned)
+	{
+		BinShapes(buffer);
+	}
+
+	// Publish the state we just wrote and write to the buffer it replaces, which
+	// is either the previous state or one the renderer has finished with
+	_writeBuffer = InterlockedExchange(&_sharedBuffer, _writeBuffer | FRESH_STATE) & BUFFER_INDEX_MASK;
+}
+
+void World::FindChangedRanges(const std::vector<unsigned>& changeTicks, int count, unsigned sinceTick, std::vector<ShapeRange>& ranges)
+{
+	ranges.clear();
+
+	for (int i = 0; i < count; ++i)
+	{
+		if (changeTicks[i] <= sinceTick)
+			continue;
+
+		if (!ranges.empty())
+		{
+			ShapeRange& last = ranges.back();
+
+			// Extend the last range over small gaps, or over everything once there are too many ranges
+			if ((unsigned)i <= last._begin + last._count + RANGE_MERGE_GAP || ranges.size() == MAX_DIRTY_RANGES)
+			{
+				last._count = i + 1 - last._begin;
+				continue;
+			}
+		}
+
+		ShapeRange range;
+		range._begin = i;
+		range._count = 1;
+		ranges.push_back(range);
+	}
+}
+
+template <typename T> void World::CopyRanges(const std::vector<T>& source, std::vector<T>& destination, const std::vector<ShapeRange>& ranges)
+{
+	for (unsigned i = 0; i < ranges.size(); ++i)
+	{
+		memcpy(&destination[ranges[i]._begin], &source[ranges[i]._begin], ranges[i]._count * sizeof(T));
+	}
+}
+
+void World::GrowShapes()
+{
+	if ((int)_quads.size() < _quadCapacity)
+	{
+		_quads.resize(_quadCapacity);
+		_quadChangeTicks.resize(_quadCapacity, 0);
+	}
+
+	if ((int)_triangles.size() < _triangleCapacity)
+	{
+		_triangles.resize(_triangleCapacity);
+		_triangleChangeTicks.resize(_triangleCapacity, 0);
+	}
+}
+
+void World::ReserveShapes(int quads, int triangles)
+{
+	_quadCapacity = Util::Max(_quadCapacity, quads);
+	_triangleCapacity = Util::Max(_triangleCapacity, triangles);
+
+	GrowShapes();
+
+	for (int i = 0; i < NUM_STATE_BUFFERS; ++i)
+	{
+		GrowShapeBuffer(_buffers[i]);
+	}
+}
+
+int World::GetShapeCell(const Vector2f& point) const
+{
+	int x = (int)((point.x() - _worldMin.x()) / _bucketSize.x());
+	int y = (int)((point.y() - _worldMin.y()) / _bucketSize.y());
+
+	x = Util::Clamp(x, 0, GetNumBucketsWide() - 1);
+	y = Util::Clamp(y, 0, GetNumBucketsTall() - 1);
+
+	return x + y * GetNumBucketsWide();
+}
+
+Vector2f World::GetShapeCentre(const Quad& quad)
+{
+	return quad._position;
+}
+
+Vector2f World::GetShapeCentre(const Triangle& triangle)
+{
+	return (triangle._points[0] + triangle._points[1] + triangle._points[2]) / 3.0f;
+}
+
+float World::GetShapeRadius(const Quad&, const Vector2f&)
+{
+	// Quads are unit squares which may be rotated
+	return 0.71f;
+}
+
+float World::GetShapeRadius(const Triangle& triangle, const Vector2f& centre)
+{
+	float radius = 0;
+
+	for (int i = 0; i < 3; ++i)
+	{
+		radius = Util::Max(radius, (triangle._points[i] - centre).length());
+	}
+
+	return radius;
+}
+
+void World::BinShapes(ShapeBuffer& buffer)
+{
+	float quadMargin = BinShapesByCell(buffer._quads, buffer._numQuads, buffer._quadCellStart, buffer._cellQuads);
+	float triangleMargin = BinShapesByCell(buffer._triangles, buffer._numTriangles, buffer._triangleCellStart, buffer._cellTriangles);
+
+	buffer._cellMargin = Util::Max(quadMargin, triangleMargin);
+}
+
+template <typename T> float World::BinShapesByCell(const std::vector<T>& shapes, int count, std::vector<int>& cellStart, std::vector<int>& cellShapes)
+{
+	std::fill(cellStart.begin(), cellStart.end(), 0);
+
+	float margin = 0;
+
+	// Count the shapes in each cell and find the furthest any reaches from its centre
+	for (int i = 0; i < count; ++i)
+	{
+		Vector2f centre = GetShapeCentre(shapes[i]);
+
+		cellStart[GetShapeCell(centre) + 1]++;
+		margin = Util::Max(margin, GetShapeRadius(shapes[i], centre));
+	}
 
-	// If the buffers were resized while we were drawing update the old freeBuffer buffer to the new size
-	if (_buffers[_freeBuffer]._quads.size() != _buffers[_writeBuffer]._quads.size())
+	for (unsigned i = 1; i < cellStart.size(); ++i)
 	{
-		_buffers[_freeBuffer]._quads.resize(_buffers[_writeBuffer]._quads.size());
+		cellStart[i] += cellStart[i - 1];
 	}
 
-	if (_buffers[_freeBuffer]._triangles.size() != _buffers[_writeBuffer]._triangles.size())
+	// Placing each shape moves the start of its cell on to the start of the next
+	for (int i = 0; i < count; ++i)
 	{
-		_buffers[_freeBuffer]._triangles.resize(_buffers[_writeBuffer]._triangles.size());
+		cellShapes[cellStart[GetShapeCell(GetShapeCentre(shapes[i]))]++] = i;
 	}
 
-	// The state we just wrote is now the readable state
-	_readBuffer = _writeBuffer;
+	for (unsigned i = cellStart.size() - 1; i > 0; --i)
+	{
+		cellStart[i] = cellStart[i - 1];
+	}
 
-	// Write to the invalid state, which is either the one just wrote
-	// or one that the renderer recently finished with
-	_writeBuffer = _freeBuffer;
+	cellStart[0] = 0;
 
-	// The previous readState will be invalid after the next step and  
-	// will be written to at the next oppertunity
-	_freeBuffer = _readBuffer;
+	return margin;
 }
 
 void World::UpdateObject(int object, double delta)
 {
-	_objects[object]->Integrate(delta, *this);
+	_objects[object]->Integrate((Real)delta, *this);
 }
 
 int World::GetNumObjects() const
@@ -434,38 +1090,60 @@ void World::HandleUserInteraction()
 {
 	Threading::ScopedLock lock(_userInteractionMutex);
 
-	_cursorSpring.SetFixedEndpoint(_cursor);
-
 	if (_leftButton && _objectTiedToCursor == NULL)
 	{
 		Physics::PhysicsObject* object = FindObjectAtPoint(_cursor);
 		if (object != NULL)
 		{
-			// TODO: Worldspace -> object space function
-			_cursorSpring.SetObjectSpaceAttachmentPoint(_cursor - object->GetPosition());
-			object->AddConstraint(&_cursorSpring);
+			// The spring is scaled by mass so all objects follow the cursor equally well
+			Physics::SpringConstraint spring;
+			spring._bodyA = object;
+			spring._offsetA = Vector2r(_cursor) - object->GetPosition();
+			spring._k = 1000 * object->GetMass();
+			spring._b = 100 * object->GetMass();
+
+			_cursorSpring = _constraints.AddSpring(spring);
 			_objectTiedToCursor = object;
 		}
 	}
 
 	if (!_leftButton && _objectTiedToCursor != NULL)
 	{
-		_objectTiedToCursor->RemoveConstraint(&_cursorSpring);
+		_constraints.RemoveSpring(_cursorSpring);
+		_cursorSpring = Physics::INVALID_CONSTRAINT;
 		_objectTiedToCursor = NULL;
 	}
 
 	if (_objectTiedToCursor != NULL)
 	{
-		_springEnd = _objectTiedToCursor->GetPosition() + _cursorSpring.GetAttachmentPoint();
+		Physics::SpringConstraint* spring = _constraints.GetSpring(_cursorSpring);
+		spring->_offsetB = Vector2r(_cursor);
+
+		_springEnd = Vector2d(spring->GetEndA());
 	}
 
-	if (_resetBlobbyPressed && _otherPeerId < 0) // Dont try to add an object if we have another peer
+	// Right clicking removes the object under the cursor. Removals aren't sent
+	// to the other peers, so like adding objects this only works without any
+	if (_rightButton && !_rightButtonHandled && !InSession())
+	{
+		Physics::PhysicsObject* object = FindObjectAtPoint(_cursor);
+		if (object != NULL)
+		{
+			if (object->GetParent() != NULL)
+				object = object->GetParent();
+
+			RemoveObject(object->GetHandle());
+		}
+	}
+
+	_rightButtonHandled = _rightButton;
+
+	if (_resetBlobbyPressed && !InSession()) // Dont try to add an object if we have another peer
 	{
-		if (_blobby == NULL)
-			_blobby = AddBlobbyObject();
+		if (_blobbies.size() == 0)
+			AddBlobbyObject();
 
-		_blobby->SetPosition(Vector2d(0, 40));
-		_blobby->SetVelocity(Vector2d(0, 0));
+		ResetBlobbies();
 		_resetBlobbyPressed = false;
 	}
 }
@@ -481,49 +1159,61 @@ void World::UpdateMouseInput(const Vector2d& cursorPosition, bool leftButton, bo
 
 Physics::PhysicsObject* World::FindObjectAtPoint(const Vector2d& point)
 {
-	Vector2i bucketCoord = GetBucketForPoint(point);
-	Physics::PhysicsObject* object = NULL;
+	// An object is picked when the point is within half a unit of its midpoint
+	// on both axes, the closest such object is picked
+	const double PICK_HALF_EXTENT = 0.5;
 
-	for (int x = Util::Max(bucketCoord.x() - 1, 0); x < bucketCoord.x() + 2 && x < GetNumBucketsWide(); x++)
+	std::vector<Physics::ObjectHandle> results;
+	_spatialIndex.QueryAABB(AABB(point - Vector2d(PICK_HALF_EXTENT), point + Vector2d(PICK_HALF_EXTENT)), results);
+
+	Physics::PhysicsObject* picked = NULL;
+	double pickedDistance = 0;
+
+	for (unsigned i = 0; i < results.size(); ++i)
 	{
-		for (int y = Util::Max(bucketCoord.y() - 1, 0); y < bucketCoord.y() + 2 && y < GetNumBucketsTall(); y++)
-		{
-			object = FindObjectAtPointInBucket(point, Vector2i(x, y));
+		// The snapshot may be a tick old, the object may since have been removed
+		Physics::PhysicsObject* object = GetObject(results[i]);
 
-			if (object != NULL) 
-				return object;
+		if (object == NULL)
+			continue;
+
+		Vector2d delta = point - Vector2d(object->GetPosition());
+
+		if (abs(delta.x()) < PICK_HALF_EXTENT && abs(delta.y()) < PICK_HALF_EXTENT &&
+			(picked == NULL || delta.length() < pickedDistance))
+		{
+			picked = object;
+			pickedDistance = delta.length();
 		}
 	}
 
-	return NULL;
+	return picked;
 }
 
-Physics::PhysicsObject* World::FindObjectAtPointInBucket(const Vector2d& point, const Vector2i& bucketCoord)
+const RegionMap& World::GetRegionMap() const
 {
-	Bucket& objects = _objectBuckets[GetBucketIndex(bucketCoord)];
+	return _regionMap;
+}
 
-	for (unsigned i = 0; i < objects.size(); ++i)
-	{
-		// TODO: intersection test method in physics object
-		Physics::PhysicsObject* object = _objects[objects[i]];
+void World::SetRegionMap(const RegionMap& regionMap)
+{
+	_regionMap = regionMap;
 
-		Vector2d position = object->GetPosition();
+	Threading::ScopedLock lock(_boundsChangeMutex);
 
-		if (point.x() < position.x() + 0.5 &&
-			point.x() > position.x() - 0.5 &&
-			point.y() < position.y() + 0.5 &&
-			point.y() > position.y() - 0.5)
+	for (unsigned i = 0; i < RegionMap::MAX_PEERS; ++i)
+	{
+		if (_hasPeerBounds[i] && !_regionMap.HasPeer(i))
 		{
-			return object;
+			_hasPeerBounds[i] = false;
+			_peerBoundsChanged = true;
 		}
 	}
-
-	return NULL;
 }
 
-void World::SetOtherPeerId(int id)
+bool World::InSession() const
 {
-	_otherPeerId = id;
+	return _regionMap.GetNumRegions() > 1;
 }
 
 const std::vector<unsigned>& World::GetObjectsInBucket(int x, int y)
@@ -531,6 +1221,31 @@ const std::vector<unsigned>& World::GetObjectsInBucket(int x, int y)
 	return _objectBuckets[ GetBucketIndex( Vector2i(x, y) ) ];
 }
 
+void World::MarkObjectsInArea(const AABB& area, std::vector<bool>& marks)
+{
+	assert((int)marks.size() == GetNumObjects());
+
+	// Areas outside the world are clamped to the buckets around its edge
+	Vector2i bucketMin = GetBucketForPoint(area.Min());
+	Vector2i bucketMax = GetBucketForPoint(area.Max());
+
+	bucketMax.x(Util::Min(bucketMax.x(), GetNumBucketsWide() - 1));
+	bucketMax.y(Util::Min(bucketMax.y(), GetNumBucketsTall() - 1));
+
+	for (int y = bucketMin.y(); y <= bucketMax.y(); ++y)
+	{
+		for (int x = bucketMin.x(); x <= bucketMax.x(); ++x)
+		{
+			const Bucket& bucket = _objectBuckets[GetBucketIndex(Vector2i(x, y))];
+
+			for (unsigned i = 0; i < bucket.size(); ++i)
+			{
+				marks[bucket[i]] = true;
+			}
+		}
+	}
+}
+
 void World::SetColorMode(eColorMode mode)
 {
 	_colorMode = mode;
@@ -551,18 +1266,70 @@ const Vector2d& World::GetWorldMax()
 	return _worldMax;
 }
 
-int World::CreateQuad()
+int World::CreateQuad(Physics::PhysicsObject* owner)
+{
+	// Past the reserved capacity, the other buffers grow when they are next written
+	if (_numQuads == _quadCapacity)
+	{
+		_quadCapacity = Util::Max(_quadCapacity * 2, 16);
+		GrowShapes();
+		PrepareWriteState();
+	}
+
+	_quads[_numQuads] = Quad();
+	_quadChangeTicks[_numQuads] = _writeTick;
+	_quadOwners.push_back(owner);
+
+	return _numQuads++;
+}
+
+int World::CreateTriangle(Physics::PhysicsObject* owner)
+{
+	if (_numTriangles == _triangleCapacity)
+	{
+		_triangleCapacity = Util::Max(_triangleCapacity * 2, 16);
+		GrowShapes();
+		PrepareWriteState();
+	}
+
+	_triangles[_numTriangles] = Triangle();
+	_triangleChangeTicks[_numTriangles] = _writeTick;
+	_triangleOwners.push_back(owner);
+
+	return _numTriangles++;
+}
+
+void World::RemoveQuad(int id)
 {
-	_buffers[_writeBuffer]._quads.push_back(Quad());
+	int last = _numQuads - 1;
 
-	return _buffers[_writeBuffer]._quads.size() - 1;
+	// Move the last quad into the freed index, the buffers keep their size
+	if (id != last)
+	{
+		_quads[id] = _quads[last];
+		_quadChangeTicks[id] = _writeTick;
+		_quadOwners[id] = _quadOwners[last];
+		_quadOwners[id]->ShapeMoved(last, id);
+	}
+
+	_numQuads--;
+	_quadOwners.pop_back();
 }
 
-int World::CreateTriangle()
+void World::RemoveTriangle(int id)
 {
-	_buffers[_writeBuffer]._triangles.push_back(Triangle());
+	int last = _numTriangles - 1;
+
+	if (id != last)
+	{
+		_triangles[id] = _triangles[last];
+		_triangleChangeTicks[id] = _writeTick;
+		_triangleOwners[id] = _triangleOwners[last];
+		_triangleOwners[id]->ShapeMoved(last, id);
+	}
 
-	return _buffers[_writeBuffer]._triangles.size() - 1;
+	_numTriangles--;
+	_triangleOwners.pop_back();
 }
 
 Color World::GetObjectColor(Physics::PhysicsObject& object)
@@ -570,10 +1337,8 @@ Color World::GetObjectColor(Physics::PhysicsObject& object)
 	switch (GetColorMode())
 	{
 	case COLOR_OWNERSHIP:
-		if (object.GetOwnerId() == 0)
-			return PEER0_COLOR;
-		else if (object.GetOwnerId() == 1)
-			return PEER1_COLOR;
+		if (object.GetOwnerId() < RegionMap::MAX_PEERS)
+			return PEER_COLORS[object.GetOwnerId()];
 
 		break;
 
@@ -614,6 +1379,31 @@ void World::ResetBlobbyPressed()
 	_resetBlobbyPressed = true;
 }
 
+void World::ResetBlobbies()
+{
+	// Lay the blobbies out in rows above the middle of the world
+	const int BLOBBIES_PER_ROW = 20;
+	const double BLOBBY_SPACING = 5;
+
+	for (unsigned i = 0; i < _blobbies.size(); ++i)
+	{
+		int column = i % BLOBBIES_PER_ROW;
+		int row = i / BLOBBIES_PER_ROW;
+
+		double x = (column - (BLOBBIES_PER_ROW - 1) * 0.5) * BLOBBY_SPACING;
+		if (_blobbies.size() == 1)
+			x = 0;
+
+		_blobbies[i]->SetPosition(Vector2r(Vector2d(x, 40 + row * BLOBBY_SPACING)));
+		_blobbies[i]->SetVelocity(Vector2r(0, 0));
+	}
+}
+
+int World::GetNumBlobbies() const
+{
+	return _blobbies.size();
+}
+
 void World::SetClientBounds(const AABB& bounds)
 {
 	Threading::ScopedLock lock(_boundsChangeMutex);
@@ -628,19 +1418,39 @@ void World::GetClientBounds(AABB& bounds)
 	bounds = _clientBounds;
 }
 
-void World::SetPeerBounds(const AABB& bounds)
+void World::SetPeerBounds(unsigned peerId, const AABB& bounds)
 {
 	Threading::ScopedLock lock(_boundsChangeMutex);
 
+	if (peerId >= RegionMap::MAX_PEERS)
+		return;
+
 	_peerBoundsChanged = true;
-	_peerBounds = bounds;
+	_peerBounds[peerId] = bounds;
+	_hasPeerBounds[peerId] = true;
 }
 
-void World::GetPeerBounds(AABB& bounds)
+bool World::GetPeerBounds(unsigned peerId, AABB& bounds)
 {
 	Threading::ScopedLock lock(_boundsChangeMutex);
 
-	bounds = _peerBounds;
+	if (peerId >= RegionMap::MAX_PEERS || !_hasPeerBounds[peerId])
+		return false;
+
+	bounds = _peerBounds[peerId];
+	return true;
+}
+
+void World::ClearPeerBounds()
+{
+	Threading::ScopedLock lock(_boundsChangeMutex);
+
+	for (unsigned i = 0; i < RegionMap::MAX_PEERS; ++i)
+	{
+		_hasPeerBounds[i] = false;
+	}
+
+	_peerBoundsChanged = true;
 }
 
 void World::UpdatePeerBoundaryLines()
@@ -649,40 +1459,42 @@ void World::UpdatePeerBoundaryLines()
 
 	if (_peerBoundsChanged)
 	{
-		Line l;
+		for (unsigned i = 0; i < RegionMap::MAX_PEERS; ++i)
+		{
+			// Peers without bounds get a box of zero size, which isn't visible
+			AABB bounds;
+			if (_hasPeerBounds[i])
+				bounds = _peerBounds[i];
 
-		if (_otherPeerId == 0)
-			l._color = PEER0_COLOR;
-		else if (_otherPeerId == 1)
-			l._color = PEER1_COLOR;
-		else
-			l._color = Color(1.0f, 1.0f, 1.0f, 1.0f);
+			Line l;
+			l._color = PEER_COLORS[i];
 
-		l._points[0].y((float)_peerBounds.Min().y());
-		l._points[1].y((float)_peerBounds.Max().y());
+			l._points[0].y((float)bounds.Min().y());
+			l._points[1].y((float)bounds.Max().y());
 
-		l._points[0].x((float)_peerBounds.Min().x());
-		l._points[1].x((float)_peerBounds.Min().x());
+			l._points[0].x((float)bounds.Min().x());
+			l._points[1].x((float)bounds.Min().x());
 
-		_peerBoundaryLines[0] = l;
+			_peerBoundaryLines[i * 4] = l;
 
-		l._points[0].x((float)_peerBounds.Max().x());
-		l._points[1].x((float)_peerBounds.Max().x());
+			l._points[0].x((float)bounds.Max().x());
+			l._points[1].x((float)bounds.Max().x());
 
-		_peerBoundaryLines[1] = l;
+			_peerBoundaryLines[i * 4 + 1] = l;
 
-		l._points[0].x((float)_peerBounds.Min().x());
-		l._points[1].x((float)_peerBounds.Max().x());
+			l._points[0].x((float)bounds.Min().x());
+			l._points[1].x((float)bounds.Max().x());
 
-		l._points[0].y((float)_peerBounds.Min().y());
-		l._points[1].y((float)_peerBounds.Min().y());
+			l._points[0].y((float)bounds.Min().y());
+			l._points[1].y((float)bounds.Min().y());
 
-		_peerBoundaryLines[2] = l;
+			_peerBoundaryLines[i * 4 + 2] = l;
 
-		l._points[0].y((float)_peerBounds.Max().y());
-		l._points[1].y((float)_peerBounds.Max().y());
+			l._points[0].y((float)bounds.Max().y());
+			l._points[1].y((float)bounds.Max().y());
 
-		_peerBoundaryLines[3] = l;
+			_peerBoundaryLines[i * 4 + 3] = l;
+		}
 
 		_peerBoundaryBuffer.SetShapes(&_peerBoundaryLines[0], _peerBoundaryLines.size());
 
@@ -750,4 +1562,24 @@ void World::SetSimSpeed(double speed)
 double World::GetSimSpeed()
 {
 	return _simSpeed;
+}
+
+void World::SetBlobbyParts(int numParts)
+{
+	_blobbyParts = Util::Clamp(numParts, (int)Physics::BlobbyObject::MIN_NUM_PARTS, (int)Physics::BlobbyObject::MAX_NUM_PARTS);
+}
+
+int World::GetBlobbyParts()
+{
+	return _blobbyParts;
+}
+
+void World::SetBlobbyStiffness(double stiffness)
+{
+	_blobbyStiffness = stiffness;
+}
+
+double World::GetBlobbyStiffness()
+{
+	return _blobbyStiffness;
 }
\ No newline at end of file
@@ -5,6 +5,9 @@
 #include <vector>
 #include "ShapeBatch.h"
 #include "PhysicsObjects.h"
+#include "ConstraintSystem.h"
+#include "SpatialIndex.h"
+#include "RegionMap.h"
 #include "Threading.h"
 #include "Vector.h"
 #include "ShapeBatch.h"
@@ -34,12 +37,42 @@ public:
 	// Should not be called from multiple threads
 	Physics::TriangleObject* AddTriangle();
 	Physics::BoxObject* AddBox();
-	Physics::BlobbyObject* AddBlobbyObject();
+	Physics::BlobbyObject* AddBlobbyObject(); // Uses the world's soft body settings
+	Physics::BlobbyObject* AddBlobbyObject(int numParts, double stiffness);
 	Physics::BlobbyPart* AddBlobbyPart();
 
+	// Removes the object along with its shapes and any constraints attached to it.
+	// The last object is moved into the freed index, so indices into the object
+	// list are only valid until the next removal. Blobby parts are removed along
+	// with their blobby. Returns false if the object was already removed
+	bool RemoveObject(const Physics::ObjectHandle& handle);
+
 	void ClearObjects();
 	Physics::PhysicsObject* GetObject(int id);
 
+	// Returns NULL if the object the handle referred to has been destroyed
+	Physics::PhysicsObject* GetObject(const Physics::ObjectHandle& handle);
+
+	// Grows the object pools and shape buffers so this many of each type can be
+	// added without allocating, should be called before the simulation is started
+	void ReserveObjects(int boxes, int triangles, int blobbyParts, int blobbies);
+
+	Physics::ConstraintSystem& GetConstraints();
+
+	// Queries may be made from any thread, the index is updated at the end of each tick
+	SpatialIndex& GetSpatialIndex();
+	void UpdateSpatialIndex();
+
+	// The area of the world shown by the renderer, only shapes in the cells it overlaps
+	// are uploaded. Should be called from the render thread only
+	void SetViewBounds(const AABB& bounds);
+
+	// Generates the shapes drawn for a range of objects, multiple threads should
+	// not generate shapes for the same objects. Only needed when there is a renderer
+	void GenerateShapes(int objectMin, int objectMax);
+	bool HasRenderer() const;
+
+	// Shapes which haven't changed since the last tick aren't copied or uploaded again
 	void UpdateTriangle(int id, const Triangle& triangle);
 	void UpdateQuad(int id, const Quad& quad);
 
@@ -47,7 +80,13 @@ public:
 	int GetNumTriangles() const;
 	
 	void Draw();
-	void SwapWriteState(); // Thread safe
+
+	// Must be called at the start of each tick, grows the write buffer if
+	// more shapes were added than were reserved
+	void PrepareWriteState();
+
+	// Publishes the shapes written this tick to the renderer, never blocks
+	void SwapWriteState();
 
 	// Multiple threads should not try to update the same object
 	void UpdateObject(int object, double delta);
@@ -63,37 +102,72 @@ public:
 		return _objectBuckets[GetBucketIndex(Vector2i(x, y))].size();
 	}
 
-	void DetectCollisions(int bucketXMin, int bucketXMax);
+	// Must be called before the broadphase each tick
+	void PrepareContacts(unsigned numThreads);
+
+	// Each thread adds the contacts it finds to its own arena, which is cleared first
+	void DetectCollisions(int bucketXMin, int bucketXMax, unsigned threadId);
 	void SolveCollisions(int bucketXMin, int bucketXMax);
 
+	const Physics::ContactArena& GetContactArena(unsigned threadId) const;
+
+	// Impulses for objects owned by other peers, added by the thread solving the
+	// contact. Once collisions are solved they are applied to our copies of the
+	// objects and kept for the network exchange until the next tick
+	void AddContactImpulse(unsigned threadId, const Physics::ContactImpulse& impulse);
+	void ApplyContactImpulses();
+	const Physics::ContactImpulseList& GetContactImpulses() const;
+
+	// Velocity of an object as it was when collisions were detected, so
+	// contacts can be solved against it while it is being changed
+	const Vector2r& GetCollisionVelocity(int object) const;
+
 	void HandleUserInteraction();
 	void UpdateMouseInput(const Vector2d& cursor, bool leftButton, bool rightButton);
 
 	const std::vector<unsigned>& GetObjectsInBucket(int x, int y);
 
+	// Sets the mark of every object the broadphase put into a bucket overlapping
+	// the area, marks should have one entry per object. Should only be called
+	// from the simulation thread, between the broadphase and adding or removing objects
+	void MarkObjectsInArea(const AABB& area, std::vector<bool>& marks);
+
 	void SetColorMode(eColorMode mode);
 	eColorMode GetColorMode();
 
 	const Vector2d& GetWorldMin();
 	const Vector2d& GetWorldMax();
 
-	int CreateTriangle();
-	int CreateQuad();
+	// Shapes are owned by an object, which is told when its shape is moved by a removal
+	int CreateTriangle(Physics::PhysicsObject* owner);
+	int CreateQuad(Physics::PhysicsObject* owner);
+	void RemoveTriangle(int id);
+	void RemoveQuad(int id);
 
 	Color GetObjectColor(Physics::PhysicsObject& object);
 
 	Physics::PhysicsObject* GetSelectedObject();
 
 	void ResetBlobbyPressed();
+	void ResetBlobbies();
+	int GetNumBlobbies() const;
 
-	void SetOtherPeerId(int id);
-
+	// The regions owned by each peer in the session, should only be used from
+	// the simulation thread. Setting the map forgets the view bounds of any peer
+	// which has left the session
+	const RegionMap& GetRegionMap() const;
+	void SetRegionMap(const RegionMap& regionMap);
+	bool InSession() const;
 
 	// Threadsafe calls
 	void SetClientBounds(const AABB& bounds);
 	void GetClientBounds(AABB& bounds);
-	void SetPeerBounds(const AABB& bounds);
-	void GetPeerBounds(AABB& bounds);
+
+	// The view bounds of the other peers, GetPeerBounds returns false if
+	// the bounds of the peer aren't known
+	void SetPeerBounds(unsigned peerId, const AABB& bounds);
+	bool GetPeerBounds(unsigned peerId, AABB& bounds);
+	void ClearPeerBounds();
 
 	void SetGravity(double gravity);
 	double GetGravity();
@@ -107,51 +181,175 @@ public:
 	void SetSimSpeed(double speed);
 	double GetSimSpeed();
 
+	void SetBlobbyParts(int numParts);
+	int GetBlobbyParts();
+
+	void SetBlobbyStiffness(double stiffness);
+	double GetBlobbyStiffness();
+
 private:
 
 	void AddObject(Physics::PhysicsObject* object);
+	void RemoveFromWorld(Physics::PhysicsObject* object);
+	void DestroyObject(Physics::PhysicsObject* object);
 
-	void TestObjectsAgainstBucket(Bucket& objects, const Vector2i& bucket);
-	void DetectCollisionsInBucket(const Vector2i& bucket);
+	void TestObjectsAgainstBucket(Bucket& objects, const Vector2i& bucket, unsigned threadId);
+	void DetectCollisionsInBucket(const Vector2i& bucket, unsigned threadId);
+	void DetectBoundaryCollisions(int bucketXMin, int bucketXMax, unsigned threadId);
+	void DetectBoundaryCollisionsInBucket(const Vector2i& bucket, unsigned threadId);
 	void SolveCollisionsInBucket(const Vector2i& bucket);
 
 	Physics::PhysicsObject* FindObjectAtPoint(const Vector2d& point);
-	Physics::PhysicsObject* FindObjectAtPointInBucket(const Vector2d& point, const Vector2i& bucketCoord);
 
 	Vector2i GetBucketForPoint(const Vector2d& point) const;
 	Vector2d GetBucketMin(int x, int y) const;
 	int GetBucketIndex(const Vector2i& bucket) const;
 
-	// Thread safe
-	void SwapDrawState();
+	// Takes the latest state published by the simulation, never blocks. Returns
+	// false if no state has been published since the last one was taken
+	bool SwapDrawState();
+
+	// Should not be called while the simulation is running
+	void ReserveShapes(int quads, int triangles);
+
+	// Grows the current shapes to the capacity
+	void GrowShapes();
 
 	const Quad* GetQuadDrawBuffer() const;
 	const Triangle* GetTriangleDrawBuffer() const;
+
+	// Ranges of shapes changed after sinceTick, runs closer together than
+	// RANGE_MERGE_GAP are merged and at most MAX_DIRTY_RANGES are returned
+	static void FindChangedRanges(const std::vector<unsigned>& changeTicks, int count, unsigned sinceTick, std::vector<ShapeRange>& ranges);
+	template <typename T> static void CopyRanges(const std::vector<T>& source, std::vector<T>& destination, const std::vector<ShapeRange>& ranges);
 	
 	 // Sould be called from render thread only
 	void UpdatePeerBoundaryLines();
 	void UpdateSpringLine();
 
+	// Shapes are handed from the simulation to the renderer through three buffers.
+	// The simulation owns the write buffer, the renderer owns the draw buffer and
+	// the shared buffer is exchanged with either of them using an atomic swap of
+	// its index. FRESH_STATE is set on the shared index when it holds a state the
+	// renderer hasn't taken yet
+	static const LONG FRESH_STATE = 0x4;
+	static const LONG BUFFER_INDEX_MASK = 0x3;
+
 	int _writeBuffer;
-	int _readBuffer;
-	int _freeBuffer;
 	int _drawBuffer;
+	volatile LONG _sharedBuffer;
+
+	static const unsigned RANGE_MERGE_GAP = 16;
+	static const unsigned MAX_DIRTY_RANGES = 32;
 
+	// Each buffer is sized to the shape capacity, only the first _numQuads
+	// and _numTriangles were in use when the buffer was written. The ranges
+	// hold the shapes which changed after the tick the renderer had last
+	// uploaded when the buffer was published
 	struct ShapeBuffer
 	{
+		ShapeBuffer();
+
 		std::vector<Quad> _quads;
 		std::vector<Triangle> _triangles;
+		int _numQuads;
+		int _numTriangles;
+
+		unsigned _tick;
+		std::vector<ShapeRange> _quadRanges;
+		std::vector<ShapeRange> _triangleRanges;
+
+		// Shapes sorted by broadphase cell, the shapes in cell i are
+		// _cellQuads[_quadCellStart[i]] to _cellQuads[_quadCellStart[i+1]-1]
+		std::vector<int> _quadCellStart;
+		std::vector<int> _cellQuads;
+		std::vector<int> _triangleCellStart;
+		std::vector<int> _cellTriangles;
+
+		// The furthest any shape reaches from the centre it was sorted by
+		float _cellMargin;
+
+		// Shapes are only sorted while the renderer is culling the view
+		bool _binned;
 	};
 
+	void GrowShapeBuffer(ShapeBuffer& buffer);
+
+	// Sorts the shapes in a published buffer by the broadphase cell their centre
+	// is in, so the renderer can skip whole cells outside the view
+	void BinShapes(ShapeBuffer& buffer);
+	template <typename T> float BinShapesByCell(const std::vector<T>& shapes, int count, std::vector<int>& cellStart, std::vector<int>& cellShapes);
+	int GetShapeCell(const Vector2f& point) const;
+	static Vector2f GetShapeCentre(const Quad& quad);
+	static Vector2f GetShapeCentre(const Triangle& triangle);
+	static float GetShapeRadius(const Quad& quad, const Vector2f& centre);
+	static float GetShapeRadius(const Triangle& triangle, const Vector2f& centre);
+
+	// Uploads the changed shapes when the whole world is in view,
+	// otherwise only the shapes in cells overlapping the view
+	void UploadShapes(const ShapeBuffer& buffer, bool newState);
+	template <typename T> unsigned GatherVisibleShapes(const std::vector<T>& shapes, const std::vector<int>& cellStart, const std::vector<int>& cellShapes,
+		const Vector2i& cellMin, const Vector2i& cellMax, std::vector<T>& visible);
+
+	// The current shapes, written by the simulation and copied into the write
+	// buffer when it is published, along with the tick each shape last changed
+	std::vector<Quad> _quads;
+	std::vector<Triangle> _triangles;
+	std::vector<unsigned> _quadChangeTicks;
+	std::vector<unsigned> _triangleChangeTicks;
+	std::vector<ShapeRange> _copyRanges;
+
+	int _numQuads;
+	int _numTriangles;
+	int _quadCapacity;
+	int _triangleCapacity;
+
+	// The tick being written by the simulation and the tick of the last state
+	// uploaded by the renderer
+	unsigned _writeTick;
+	volatile unsigned _drawnTick;
+
+	bool _hasRenderer;
+
+	// Owned by the render thread. While only part of the world is in view the
+	// instance buffers hold just the visible shapes rather than every shape
+	AABB _viewBounds;
+	bool _viewChanged;
+	bool _shapesCulled;
+
+	// Set by the renderer while part of the world is out of view, the
+	// simulation only sorts the shapes it publishes while this is set
+	volatile bool _viewCulled;
+	std::vector<Quad> _visibleQuads;
+	std::vector<Triangle> _visibleTriangles;
+
 	std::vector<Line> _worldBoundaryLines;
 	std::vector<Line> _peerBoundaryLines;
 
 	static const int NUM_STATE_BUFFERS = 3;
 	ShapeBuffer _buffers[3];
 
+	// The object owning each shape in the write buffer
+	std::vector<Physics::PhysicsObject*> _quadOwners;
+	std::vector<Physics::PhysicsObject*> _triangleOwners;
+
 	std::vector<Physics::PhysicsObject*> _objects;
 
-	Threading::Mutex _stateChangeMutex;
+	Physics::ObjectPool<Physics::BoxObject> _boxPool;
+	Physics::ObjectPool<Physics::TriangleObject> _trianglePool;
+	Physics::ObjectPool<Physics::BlobbyPart> _blobbyPartPool;
+	Physics::ObjectPool<Physics::BlobbyObject> _blobbyPool;
+
+	// Handle slots hold the index of their object in _objects
+	struct HandleSlot
+	{
+		int _object;
+		unsigned _generation;
+	};
+
+	std::vector<HandleSlot> _handleSlots;
+	std::vector<int> _freeHandleSlots;
+
 	Threading::Mutex _userInteractionMutex;
 	Threading::Mutex _boundsChangeMutex;
 	Threading::Mutex _springChangeMutex;
@@ -161,36 +359,48 @@ private:
 	Vector2d _cursor;
 	bool _leftButton;
 	bool _rightButton;
+	bool _rightButtonHandled;
 
 	ShapeBatch _shapeBatch;
 	LineArray _worldBoundaryBuffer;
 	LineArray _peerBoundaryBuffer;
 	LineArray _springBuffer;
-	QuadArray _quadBuffer;
-	TriangleArray _triangleBuffer;
+	FilledShapeArray _shapeArray;
 
 	std::vector< Bucket > _objectBuckets;
 
+	std::vector<Physics::ContactArena> _contactArenas;
+	std::vector<Physics::ContactImpulseList> _threadContactImpulses;
+	Physics::ContactImpulseList _contactImpulses;
+	std::vector<Vector2r> _collisionVelocities;
+
+	SpatialIndex _spatialIndex;
+
 	Vector2d _worldMin;
 	Vector2d _worldMax;
 	Vector2d _bucketSize;
 
-	Physics::FixedEndSpringConstraint _cursorSpring;
+	Physics::ConstraintSystem _constraints;
+
+	Physics::ConstraintId _cursorSpring;
 	Physics::PhysicsObject* _objectTiedToCursor;
 
 	eColorMode _colorMode;
 
 	bool _resetBlobbyPressed;
-	Physics::PhysicsObject* _blobby;
+	std::vector<Physics::BlobbyObject*> _blobbies;
+	int _blobbyParts;
+	double _blobbyStiffness;
 
-	AABB _peerBounds;
+	RegionMap _regionMap;
+
+	AABB _peerBounds[RegionMap::MAX_PEERS];
+	bool _hasPeerBounds[RegionMap::MAX_PEERS];
 	AABB _clientBounds;
 	bool _peerBoundsChanged;
 
-	int _otherPeerId;
-
-	static Color PEER0_COLOR;
-	static Color PEER1_COLOR;
+	// Indexed by peer id
+	static Color PEER_COLORS[RegionMap::MAX_PEERS];
 
 	double _gravity;
 	double _elasticity;